@@ -7,6 +7,7 @@
 
 #include "main.h"
 #include "addr.h"
+#include "sock.h"
 
 #include <linux/once.h> // for get_random_once()
 #include <linux/socket.h>
@@ -86,7 +87,7 @@ int ovpn_sockaddr_pair_from_sock(struct ovpn_sockaddr_pair *sapair,
 
 	/* verify socket type */
 	if (tcp) {
-		if (!sk || sk->sk_protocol != IPPROTO_TCP)
+		if (!sk || !ovpn_sock_is_stream(sk))
 			return -EINVAL;
 	} else {
 		if (!sk || sk->sk_protocol != IPPROTO_UDP)
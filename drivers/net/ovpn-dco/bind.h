@@ -25,13 +25,15 @@ static inline bool ovpn_bind_skb_match(const struct ovpn_bind *bind,
 {
 	const unsigned short family = skb_protocol_to_family(skb);
 	const struct ovpn_sockaddr_pair *sap = &bind->sapair;
-	const u32 hash_key = skb_get_hash(skb);
 
 	if (unlikely(!bind))
 		return false;
 
+	/* skb_get_hash() may have to dissect the packet: only do it when
+	 * there is a hash to compare with
+	 */
 	if (unlikely(bind->sapair.skb_hash_defined &&
-		     bind->sapair.skb_hash != hash_key))
+		     bind->sapair.skb_hash != skb_get_hash(skb)))
 		return false;
 
 	if (unlikely(bind->sapair.local.family != family))
@@ -13,11 +13,30 @@
 #include "crypto.h"
 
 #include <uapi/linux/ovpn_dco.h>
+#include <linux/moduleparam.h>
+
+unsigned int ovpn_crypto_inline_max __read_mostly = 256;
+module_param_named(crypto_inline_max, ovpn_crypto_inline_max, uint, 0644);
+MODULE_PARM_DESC(crypto_inline_max,
+		 "Largest packet (bytes) processed inline or with a synchronous transform when the crypto queues are idle (0 to disable)");
 
 static struct ovpn_crypto_key_slot *
 ovpn_ks_new(const struct ovpn_crypto_ops *ops, const struct ovpn_key_config *kc)
 {
-	return ops->new(kc);
+	struct ovpn_crypto_key_slot *ks;
+
+	ks = ops->new(kc);
+	if (IS_ERR(ks))
+		return ks;
+
+	ks->stats = alloc_percpu(struct ovpn_crypto_key_slot_stats);
+	if (!ks->stats) {
+		ops->destroy(ks);
+		return ERR_PTR(-ENOMEM);
+	}
+	ks->last_used = jiffies;
+
+	return ks;
 }
 
 static void ovpn_ks_destroy_rcu(struct rcu_head *head)
@@ -25,9 +44,52 @@ static void ovpn_ks_destroy_rcu(struct rcu_head *head)
 	struct ovpn_crypto_key_slot *ks;
 
 	ks = container_of(head, struct ovpn_crypto_key_slot, rcu);
+	free_percpu(ks->stats);
+	ovpn_pktid_recv_release(&ks->pid_recv);
 	ks->ops->destroy(ks);
 }
 
+/* Sum the per-CPU counters of a key slot. Counters are updated without
+ * synchronization, values may be slightly out of date
+ */
+void ovpn_crypto_key_slot_stats_read(const struct ovpn_crypto_key_slot *ks,
+				     struct ovpn_crypto_key_slot_stats *sum)
+{
+	const struct ovpn_crypto_key_slot_stats *stats;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(ks->stats, cpu);
+
+		sum->rx_packets += READ_ONCE(stats->rx_packets);
+		sum->rx_bytes += READ_ONCE(stats->rx_bytes);
+		sum->tx_packets += READ_ONCE(stats->tx_packets);
+		sum->tx_bytes += READ_ONCE(stats->tx_bytes);
+		sum->rx_auth_fail += READ_ONCE(stats->rx_auth_fail);
+		sum->rx_replay += READ_ONCE(stats->rx_replay);
+	}
+}
+
+void ovpn_crypto_path_stats_read(const struct ovpn_crypto_path_stats __percpu *stats,
+				 struct ovpn_crypto_path_stats *sum)
+{
+	const struct ovpn_crypto_path_stats *s;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(stats, cpu);
+
+		for (i = 0; i < OVPN_CRYPTO_PATH_MAX; i++) {
+			sum->tx[i] += READ_ONCE(s->tx[i]);
+			sum->rx[i] += READ_ONCE(s->rx[i]);
+		}
+	}
+}
+
 void ovpn_crypto_key_slot_release(struct kref *kref)
 {
 	struct ovpn_crypto_key_slot *ks;
@@ -75,6 +137,8 @@ int ovpn_crypto_state_reset(struct ovpn_crypto_state *cs,
 		return PTR_ERR(new);
 
 	new->remote_peer_id = pkr->remote_peer_id;
+	if (cs->pktid_wrap_warn)
+		new->pid_xmit.wrap_warn = cs->pktid_wrap_warn;
 
 	switch (pkr->slot) {
 	case OVPN_KEY_SLOT_PRIMARY:
@@ -174,6 +238,7 @@ ovpn_keys_familiy_get(const struct ovpn_key_config *kc)
 		return OVPN_CRYPTO_FAMILY_NONE;
 	case OVPN_CIPHER_ALG_AES_GCM:
 	case OVPN_CIPHER_ALG_CHACHA20_POLY1305:
+	case OVPN_CIPHER_ALG_AEGIS128:
 		return OVPN_CRYPTO_FAMILY_AEAD;
 	default:
 		return OVPN_CRYPTO_FAMILY_UNDEF;
@@ -202,3 +267,29 @@ void ovpn_crypto_key_slots_swap(struct ovpn_crypto_state *cs)
 
 	mutex_unlock(&cs->mutex);
 }
+
+/* Set the packet ID threshold after which userspace is asked to renegotiate.
+ * Applies to the installed keys as well as to the ones installed later on.
+ */
+void ovpn_crypto_state_set_pktid_wrap_warn(struct ovpn_crypto_state *cs,
+					   u32 threshold)
+{
+	struct ovpn_crypto_key_slot *ks;
+	u64 wrap_warn;
+
+	wrap_warn = threshold ? threshold : PKTID_WRAP_WARN;
+
+	mutex_lock(&cs->mutex);
+	cs->pktid_wrap_warn = threshold;
+
+	ks = rcu_dereference_protected(cs->primary,
+				       lockdep_is_held(&cs->mutex));
+	if (ks)
+		WRITE_ONCE(ks->pid_xmit.wrap_warn, wrap_warn);
+
+	ks = rcu_dereference_protected(cs->secondary,
+				       lockdep_is_held(&cs->mutex));
+	if (ks)
+		WRITE_ONCE(ks->pid_xmit.wrap_warn, wrap_warn);
+	mutex_unlock(&cs->mutex);
+}
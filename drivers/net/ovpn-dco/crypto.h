@@ -11,9 +11,14 @@
 #define _NET_OVPN_DCO_OVPNCRYPTO_H_
 
 #include "main.h"
+#include "crypto_aead.h"
+#include "crypto_none.h"
 #include "pktid.h"
 
+#include <crypto/aead.h>
 #include <uapi/linux/ovpn_dco.h>
+#include <linux/percpu.h>
+#include <linux/preempt.h>
 #include <linux/skbuff.h>
 
 struct ovpn_peer;
@@ -50,6 +55,9 @@ struct ovpn_peer_key_reset {
 };
 
 struct ovpn_crypto_ops {
+	/* returns 1 when the key crossed its packet ID wrap-warn threshold and
+	 * -E2BIG, with the skb left untouched, when its packet IDs ran out
+	 */
 	int (*encrypt)(struct ovpn_crypto_key_slot *ks,
 		       struct sk_buff *skb);
 
@@ -64,19 +72,58 @@ struct ovpn_crypto_ops {
 	int (*encap_overhead)(const struct ovpn_crypto_key_slot *ks);
 };
 
+/* per-CPU usage counters of a key slot */
+struct ovpn_crypto_key_slot_stats {
+	u64 rx_packets;
+	u64 rx_bytes;
+	u64 tx_packets;
+	u64 tx_bytes;
+	u64 rx_auth_fail;
+	u64 rx_replay;
+};
+
+/* where a packet went through the crypto layer */
+enum ovpn_crypto_path {
+	/* right away, on the CPU sending or receiving it */
+	OVPN_CRYPTO_PATH_INLINE,
+	/* by the crypto workers, with a synchronous transform */
+	OVPN_CRYPTO_PATH_WORKER,
+	/* by the crypto workers, offloaded to an asynchronous transform */
+	OVPN_CRYPTO_PATH_ASYNC,
+	OVPN_CRYPTO_PATH_MAX,
+};
+
+/* per-CPU dispatch counters of an interface, reported through ethtool */
+struct ovpn_crypto_path_stats {
+	u64 tx[OVPN_CRYPTO_PATH_MAX];
+	u64 rx[OVPN_CRYPTO_PATH_MAX];
+};
+
 struct ovpn_crypto_key_slot {
 	const struct ovpn_crypto_ops *ops;
 	int remote_peer_id;
 	int key_id;
 
+	struct ovpn_crypto_key_slot_stats __percpu *stats;
+
 	struct crypto_aead *encrypt;
 	struct crypto_aead *decrypt;
+	/* synchronous fallbacks of encrypt and decrypt, only allocated when
+	 * these are asynchronous
+	 */
+	struct crypto_aead *encrypt_sync;
+	struct crypto_aead *decrypt_sync;
 	struct ovpn_nonce_tail nonce_tail_xmit;
 	struct ovpn_nonce_tail nonce_tail_recv;
 
+	/* RX and TX state are written by different CPUs, so is the refcount
+	 * (taken and released for every packet): one cache line each
+	 */
 	struct ovpn_pktid_recv pid_recv ____cacheline_aligned_in_smp;
 	struct ovpn_pktid_xmit pid_xmit ____cacheline_aligned_in_smp;
-	struct kref refcount;
+	struct kref refcount ____cacheline_aligned_in_smp;
+	/* jiffies of last use, shares the line written on every packet */
+	unsigned long last_used;
 	struct rcu_head rcu;
 };
 
@@ -85,8 +132,13 @@ struct ovpn_crypto_state {
 	struct ovpn_crypto_key_slot __rcu *secondary;
 	const struct ovpn_crypto_ops *ops;
 
-	/* protects primary, secondary slots and ops */
-	struct mutex mutex;
+	/* packet ID wrap-warn threshold for new keys (0 means default) */
+	u32 pktid_wrap_warn;
+
+	/* protects primary, secondary slots, ops and pktid_wrap_warn. Kept
+	 * away from the slot pointers, which are read for every packet
+	 */
+	struct mutex mutex ____cacheline_aligned_in_smp;
 };
 
 static inline bool ovpn_crypto_key_slot_hold(struct ovpn_crypto_key_slot *ks)
@@ -99,6 +151,7 @@ static inline void ovpn_crypto_state_init(struct ovpn_crypto_state *cs)
 	RCU_INIT_POINTER(cs->primary, NULL);
 	RCU_INIT_POINTER(cs->secondary, NULL);
 	cs->ops = NULL;
+	cs->pktid_wrap_warn = 0;
 	mutex_init(&cs->mutex);
 }
 
@@ -149,6 +202,132 @@ ovpn_crypto_key_slot_primary(const struct ovpn_crypto_state *cs)
 	return ks;
 }
 
+static inline struct ovpn_crypto_key_slot *
+ovpn_crypto_key_slot_secondary(const struct ovpn_crypto_state *cs)
+{
+	struct ovpn_crypto_key_slot *ks;
+
+	rcu_read_lock();
+	ks = rcu_dereference(cs->secondary);
+	if (unlikely(ks && !ovpn_crypto_key_slot_hold(ks)))
+		ks = NULL;
+	rcu_read_unlock();
+
+	return ks;
+}
+
+extern unsigned int ovpn_crypto_inline_max;
+
+/* true if a packet of len bytes is small enough to skip the crypto workers */
+static inline bool ovpn_crypto_inline_len(unsigned int len)
+{
+	return len <= READ_ONCE(ovpn_crypto_inline_max);
+}
+
+static inline bool ovpn_crypto_tfm_async(const struct crypto_aead *tfm)
+{
+	return tfm && (crypto_aead_alg(tfm)->base.cra_flags & CRYPTO_ALG_ASYNC);
+}
+
+/* Pick the transform for a packet of len bytes: small packets and those
+ * processed from softirq context stay on the CPU when a synchronous fallback
+ * exists, anything else goes to tfm (possibly an accelerator)
+ */
+static inline struct crypto_aead *ovpn_crypto_tfm(struct crypto_aead *tfm,
+						  struct crypto_aead *sync_tfm,
+						  unsigned int len)
+{
+	if (sync_tfm && (in_softirq() || ovpn_crypto_inline_len(len)))
+		return sync_tfm;
+
+	return tfm;
+}
+
+/* path taken by a packet of len bytes processed by the crypto workers.
+ * Inline processing is accounted where it is decided
+ */
+static inline enum ovpn_crypto_path
+ovpn_crypto_worker_path(struct crypto_aead *tfm, struct crypto_aead *sync_tfm,
+			unsigned int len)
+{
+	if (ovpn_crypto_tfm_async(ovpn_crypto_tfm(tfm, sync_tfm, len)))
+		return OVPN_CRYPTO_PATH_ASYNC;
+
+	return OVPN_CRYPTO_PATH_WORKER;
+}
+
+/* true if the key slot never goes async and can therefore be used from
+ * softirq context. Key slots without transforms (cipher "none") are always
+ * synchronous
+ */
+static inline bool
+ovpn_crypto_key_slot_sync(const struct ovpn_crypto_key_slot *ks)
+{
+	if (ovpn_crypto_tfm_async(ks->encrypt) && !ks->encrypt_sync)
+		return false;
+
+	if (ovpn_crypto_tfm_async(ks->decrypt) && !ks->decrypt_sync)
+		return false;
+
+	return true;
+}
+
+/* the data path only ever uses the AEAD or the "none" ops: avoid the
+ * indirect call (and the retpoline) when it is one of them
+ */
+static inline int ovpn_crypto_encrypt(struct ovpn_crypto_key_slot *ks,
+				      struct sk_buff *skb)
+{
+	return INDIRECT_CALL_2(ks->ops->encrypt, ovpn_aead_encrypt,
+			       ovpn_none_encrypt, ks, skb);
+}
+
+static inline int ovpn_crypto_decrypt(struct ovpn_crypto_key_slot *ks,
+				      struct sk_buff *skb, unsigned int op)
+{
+	return INDIRECT_CALL_2(ks->ops->decrypt, ovpn_aead_decrypt,
+			       ovpn_none_decrypt, ks, skb, op);
+}
+
+static inline void ovpn_crypto_key_slot_touch(struct ovpn_crypto_key_slot *ks)
+{
+	/* dirty the cache line at most once per tick */
+	if (READ_ONCE(ks->last_used) != jiffies)
+		WRITE_ONCE(ks->last_used, jiffies);
+}
+
+static inline void
+ovpn_crypto_key_slot_stats_tx(struct ovpn_crypto_key_slot *ks,
+			      unsigned int len)
+{
+	this_cpu_inc(ks->stats->tx_packets);
+	this_cpu_add(ks->stats->tx_bytes, len);
+	ovpn_crypto_key_slot_touch(ks);
+}
+
+/* account the outcome of a decryption: ret is the value returned by the
+ * decrypt op
+ */
+static inline void
+ovpn_crypto_key_slot_stats_rx(struct ovpn_crypto_key_slot *ks, int ret,
+			      unsigned int len)
+{
+	if (likely(!ret)) {
+		this_cpu_inc(ks->stats->rx_packets);
+		this_cpu_add(ks->stats->rx_bytes, len);
+		ovpn_crypto_key_slot_touch(ks);
+	} else if (ret == -EBADMSG) {
+		this_cpu_inc(ks->stats->rx_auth_fail);
+	} else if (ret == -ESTALE) {
+		this_cpu_inc(ks->stats->rx_replay);
+	}
+}
+
+void ovpn_crypto_key_slot_stats_read(const struct ovpn_crypto_key_slot *ks,
+				     struct ovpn_crypto_key_slot_stats *sum);
+void ovpn_crypto_path_stats_read(const struct ovpn_crypto_path_stats __percpu *stats,
+				 struct ovpn_crypto_path_stats *sum);
+
 void ovpn_crypto_key_slot_release(struct kref *kref);
 
 static inline void ovpn_crypto_key_slot_put(struct ovpn_crypto_key_slot *ks)
@@ -172,4 +351,7 @@ ovpn_keys_familiy_get(const struct ovpn_key_config *kc);
 
 void ovpn_crypto_key_slots_swap(struct ovpn_crypto_state *cs);
 
+void ovpn_crypto_state_set_pktid_wrap_warn(struct ovpn_crypto_state *cs,
+					   u32 threshold);
+
 #endif /* _NET_OVPN_DCO_OVPNCRYPTO_H_ */
@@ -19,6 +19,11 @@
 
 #define AUTH_TAG_SIZE	16
 
+/* largest IV among the supported algorithms (AEGIS128). Algorithms with an IV
+ * longer than NONCE_SIZE get the OpenVPN nonce zero-padded at the end
+ */
+#define OVPN_AEAD_MAX_IV_SIZE	16
+
 const struct ovpn_crypto_ops ovpn_aead_ops;
 
 static int ovpn_aead_encap_overhead(const struct ovpn_crypto_key_slot *ks)
@@ -28,17 +33,19 @@ static int ovpn_aead_encap_overhead(const struct ovpn_crypto_key_slot *ks)
 		crypto_aead_authsize(ks->encrypt);	/* Auth Tag */
 }
 
-static int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
-			     struct sk_buff *skb)
+INDIRECT_CALLABLE_SCOPE int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
+					      struct sk_buff *skb)
 {
 	const unsigned int tag_size = crypto_aead_authsize(ks->encrypt);
 	const unsigned int head_size = ovpn_aead_encap_overhead(ks);
 	struct scatterlist sg[MAX_SKB_FRAGS + 2];
+	bool atomic = in_softirq();
 	DECLARE_CRYPTO_WAIT(wait);
 	struct aead_request *req;
+	struct crypto_aead *tfm;
 	struct sk_buff *trailer;
-	u8 iv[NONCE_SIZE];
-	int nfrags, ret;
+	u8 iv[OVPN_AEAD_MAX_IV_SIZE] = { 0 };
+	int nfrags, ret, wrap;
 	u32 pktid, op;
 
 	/* Sample AEAD header format:
@@ -48,6 +55,22 @@ static int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
 	 *          IV head]
 	 */
 
+	/* when called inline we cannot wait for an async transform to
+	 * complete
+	 */
+	tfm = ovpn_crypto_tfm(ks->encrypt, ks->encrypt_sync, skb->len);
+	if (unlikely(atomic && ovpn_crypto_tfm_async(tfm)))
+		return -EAGAIN;
+
+	/* obtain packet ID, which is used both as a first
+	 * 4 bytes of nonce and last 4 bytes of associated data.
+	 * This happens before the skb is touched, so that the caller can
+	 * retry with another key slot if this one is exhausted
+	 */
+	wrap = ovpn_pktid_xmit_next(&ks->pid_xmit, &pktid);
+	if (unlikely(wrap < 0))
+		return wrap;
+
 	/* check that there's enough headroom in the skb for packet
 	 * encapsulation, after adding network header and encryption overhead
 	 */
@@ -62,7 +85,7 @@ static int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
 	if (unlikely(nfrags + 2 > ARRAY_SIZE(sg)))
 		return -ENOSPC;
 
-	req = aead_request_alloc(ks->encrypt, GFP_KERNEL);
+	req = aead_request_alloc(tfm, atomic ? GFP_ATOMIC : GFP_KERNEL);
 	if (unlikely(!req))
 		return -ENOMEM;
 
@@ -84,16 +107,6 @@ static int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
 	__skb_push(skb, tag_size);
 	sg_set_buf(sg + nfrags + 1, skb->data, tag_size);
 
-	/* obtain packet ID, which is used both as a first
-	 * 4 bytes of nonce and last 4 bytes of associated data.
-	 */
-	ret = ovpn_pktid_xmit_next(&ks->pid_xmit, &pktid);
-	if (unlikely(ret < 0)) {
-		if (ret != -1)
-			goto free_req;
-		//ovpn_notify_pktid_wrap_pc(ks->peer, ks->key_id);
-	}
-
 	/* concat 4 bytes packet id and 8 bytes nonce tail into 12 bytes nonce */
 	ovpn_pktid_aead_write(pktid, &ks->nonce_tail_xmit, iv);
 
@@ -111,9 +124,9 @@ static int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
 	sg_set_buf(sg, skb->data, OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE);
 
 	/* setup async crypto operation */
-	aead_request_set_tfm(req, ks->encrypt);
+	aead_request_set_tfm(req, tfm);
 	aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG |
-				       CRYPTO_TFM_REQ_MAY_SLEEP,
+				       (atomic ? 0 : CRYPTO_TFM_REQ_MAY_SLEEP),
 				  crypto_req_done, &wait);
 	aead_request_set_crypt(req, sg, sg, skb->len - head_size, iv);
 	aead_request_set_ad(req, OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE);
@@ -122,26 +135,38 @@ static int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
 	ret = crypto_wait_req(crypto_aead_encrypt(req), &wait);
 	if (ret < 0)
 		pr_err_ratelimited("%s: encrypt failed: %d\n", __func__, ret);
+	else
+		ret = wrap;
 
 free_req:
 	aead_request_free(req);
 	return ret;
 }
 
-static int ovpn_aead_decrypt(struct ovpn_crypto_key_slot *ks,
-			     struct sk_buff *skb, unsigned int op)
+INDIRECT_CALLABLE_SCOPE int ovpn_aead_decrypt(struct ovpn_crypto_key_slot *ks,
+					      struct sk_buff *skb, unsigned int op)
 {
 	const unsigned int tag_size = crypto_aead_authsize(ks->decrypt);
 	struct scatterlist sg[MAX_SKB_FRAGS + 2];
+	u8 iv[OVPN_AEAD_MAX_IV_SIZE] = { 0 };
 	int ret, payload_len, nfrags;
-	u8 *sg_data, iv[NONCE_SIZE];
 	unsigned int payload_offset;
+	bool atomic = in_softirq();
+	u8 *sg_data;
 	DECLARE_CRYPTO_WAIT(wait);
 	struct aead_request *req;
+	struct crypto_aead *tfm;
 	struct sk_buff *trailer;
 	unsigned int sg_len;
 	__be32 *pid;
 
+	/* when called inline or from NAPI (busy polling) we cannot wait for
+	 * an async transform to complete
+	 */
+	tfm = ovpn_crypto_tfm(ks->decrypt, ks->decrypt_sync, skb->len);
+	if (unlikely(atomic && ovpn_crypto_tfm_async(tfm)))
+		return -EAGAIN;
+
 	payload_offset = OVPN_OP_SIZE_V2 + NONCE_WIRE_SIZE + tag_size;
 	payload_len = skb->len - payload_offset;
 
@@ -157,7 +182,7 @@ static int ovpn_aead_decrypt(struct ovpn_crypto_key_slot *ks,
 	if (unlikely(nfrags + 2 > ARRAY_SIZE(sg)))
 		return -ENOSPC;
 
-	req = aead_request_alloc(ks->decrypt, GFP_KERNEL);
+	req = aead_request_alloc(tfm, atomic ? GFP_ATOMIC : GFP_KERNEL);
 	if (unlikely(!req))
 		return -ENOMEM;
 
@@ -189,9 +214,9 @@ static int ovpn_aead_decrypt(struct ovpn_crypto_key_slot *ks,
 	       sizeof(struct ovpn_nonce_tail));
 
 	/* setup async crypto operation */
-	aead_request_set_tfm(req, ks->decrypt);
+	aead_request_set_tfm(req, tfm);
 	aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG |
-				       CRYPTO_TFM_REQ_MAY_SLEEP,
+				       (atomic ? 0 : CRYPTO_TFM_REQ_MAY_SLEEP),
 				  crypto_req_done, &wait);
 	aead_request_set_crypt(req, sg, sg, payload_len + tag_size, iv);
 
@@ -222,12 +247,12 @@ free_req:
 static struct crypto_aead *ovpn_aead_init(const char *title,
 					  const char *alg_name,
 					  const unsigned char *key,
-					  unsigned int keylen)
+					  unsigned int keylen, u32 mask)
 {
 	struct crypto_aead *aead;
 	int ret;
 
-	aead = crypto_alloc_aead(alg_name, 0, 0);
+	aead = crypto_alloc_aead(alg_name, 0, mask);
 	if (IS_ERR(aead)) {
 		ret = PTR_ERR(aead);
 		pr_err("%s crypto_alloc_aead failed, err=%d\n", title, ret);
@@ -249,9 +274,11 @@ static struct crypto_aead *ovpn_aead_init(const char *title,
 		goto error;
 	}
 
-	/* basic AEAD assumption */
-	if (crypto_aead_ivsize(aead) != NONCE_SIZE) {
-		pr_err("%s IV size must be %d\n", title, NONCE_SIZE);
+	/* basic AEAD assumption: the OpenVPN nonce must fit the IV */
+	if (crypto_aead_ivsize(aead) < NONCE_SIZE ||
+	    crypto_aead_ivsize(aead) > OVPN_AEAD_MAX_IV_SIZE) {
+		pr_err("%s IV size must be between %d and %d\n", title,
+		       NONCE_SIZE, OVPN_AEAD_MAX_IV_SIZE);
 		ret = -EINVAL;
 		goto error;
 	}
@@ -277,6 +304,8 @@ static void ovpn_aead_crypto_key_slot_destroy(struct ovpn_crypto_key_slot *ks)
 
 	crypto_free_aead(ks->encrypt);
 	crypto_free_aead(ks->decrypt);
+	crypto_free_aead(ks->encrypt_sync);
+	crypto_free_aead(ks->decrypt_sync);
 	kfree(ks);
 }
 
@@ -304,6 +333,9 @@ ovpn_aead_crypto_key_slot_init(enum ovpn_cipher_alg alg,
 	case OVPN_CIPHER_ALG_CHACHA20_POLY1305:
 		alg_name = "rfc7539(chacha20,poly1305)";
 		break;
+	case OVPN_CIPHER_ALG_AEGIS128:
+		alg_name = "aegis128";
+		break;
 	default:
 		return ERR_PTR(-EOPNOTSUPP);
 	}
@@ -316,11 +348,13 @@ ovpn_aead_crypto_key_slot_init(enum ovpn_cipher_alg alg,
 	ks->ops = &ovpn_aead_ops;
 	ks->encrypt = NULL;
 	ks->decrypt = NULL;
+	ks->encrypt_sync = NULL;
+	ks->decrypt_sync = NULL;
 	kref_init(&ks->refcount);
 	ks->key_id = key_id;
 
 	ks->encrypt = ovpn_aead_init("encrypt", alg_name, encrypt_key,
-				     encrypt_keylen);
+				     encrypt_keylen, 0);
 	if (IS_ERR(ks->encrypt)) {
 		ret = PTR_ERR(ks->encrypt);
 		ks->encrypt = NULL;
@@ -328,13 +362,33 @@ ovpn_aead_crypto_key_slot_init(enum ovpn_cipher_alg alg,
 	}
 
 	ks->decrypt = ovpn_aead_init("decrypt", alg_name, decrypt_key,
-				     decrypt_keylen);
+				     decrypt_keylen, 0);
 	if (IS_ERR(ks->decrypt)) {
 		ret = PTR_ERR(ks->decrypt);
 		ks->decrypt = NULL;
 		goto destroy_ks;
 	}
 
+	/* the transforms picked are offloaded to an accelerator: keep a
+	 * synchronous implementation around for small packets. Not having
+	 * one is not fatal, all packets then go to the accelerator
+	 */
+	if (ovpn_crypto_tfm_async(ks->encrypt)) {
+		ks->encrypt_sync = ovpn_aead_init("encrypt (sync)", alg_name,
+						  encrypt_key, encrypt_keylen,
+						  CRYPTO_ALG_ASYNC);
+		if (IS_ERR(ks->encrypt_sync))
+			ks->encrypt_sync = NULL;
+	}
+
+	if (ovpn_crypto_tfm_async(ks->decrypt)) {
+		ks->decrypt_sync = ovpn_aead_init("decrypt (sync)", alg_name,
+						  decrypt_key, decrypt_keylen,
+						  CRYPTO_ALG_ASYNC);
+		if (IS_ERR(ks->decrypt_sync))
+			ks->decrypt_sync = NULL;
+	}
+
 	if (sizeof(struct ovpn_nonce_tail) != encrypt_nonce_tail_len ||
 	    sizeof(struct ovpn_nonce_tail) != decrypt_nonce_tail_len) {
 		ret = -EINVAL;
@@ -10,6 +10,17 @@
 #ifndef _NET_OVPN_DCO_OVPNAEAD_H_
 #define _NET_OVPN_DCO_OVPNAEAD_H_
 
+#include <linux/indirect_call_wrapper.h>
+
+struct ovpn_crypto_key_slot;
+struct sk_buff;
+
 extern const struct ovpn_crypto_ops ovpn_aead_ops;
 
+INDIRECT_CALLABLE_DECLARE(int ovpn_aead_encrypt(struct ovpn_crypto_key_slot *ks,
+						struct sk_buff *skb));
+INDIRECT_CALLABLE_DECLARE(int ovpn_aead_decrypt(struct ovpn_crypto_key_slot *ks,
+						struct sk_buff *skb,
+						unsigned int op));
+
 #endif /* _NET_OVPN_DCO_OVPNAEAD_H_ */
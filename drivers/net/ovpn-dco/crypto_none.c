@@ -23,7 +23,8 @@ static int ovpn_none_encap_overhead(const struct ovpn_crypto_key_slot *ks)
 		sizeof(u32);				/* Packet ID */
 }
 
-static int ovpn_none_encrypt(struct ovpn_crypto_key_slot *ks, struct sk_buff *skb)
+INDIRECT_CALLABLE_SCOPE int ovpn_none_encrypt(struct ovpn_crypto_key_slot *ks,
+					      struct sk_buff *skb)
 {
 	const u32 head_size = ovpn_none_encap_overhead(ks);
 	u32 pktid, op;
@@ -42,11 +43,8 @@ static int ovpn_none_encrypt(struct ovpn_crypto_key_slot *ks, struct sk_buff *sk
 
 	/* Prepend packet ID */
 	ret = ovpn_pktid_xmit_next(&ks->pid_xmit, &pktid);
-	if (unlikely(ret < 0)) {
-		if (ret != -1)
-			return ret;
-		//ovpn_notify_pktid_wrap_pc(ks->peer, ks->key_id);
-	}
+	if (unlikely(ret < 0))
+		return ret;
 
 	/* place seq # at the beginning of the packet */
 	__skb_push(skb, sizeof(pktid));
@@ -58,10 +56,11 @@ static int ovpn_none_encrypt(struct ovpn_crypto_key_slot *ks, struct sk_buff *sk
 	BUILD_BUG_ON(sizeof(op) != OVPN_OP_SIZE_V2);
 	*((__force __be32 *)skb->data) = htonl(op);
 
-	return 0;
+	return ret;
 }
 
-static int ovpn_none_decrypt(struct ovpn_crypto_key_slot *ks, struct sk_buff *skb, unsigned int op)
+INDIRECT_CALLABLE_SCOPE int ovpn_none_decrypt(struct ovpn_crypto_key_slot *ks,
+					      struct sk_buff *skb, unsigned int op)
 {
 	const u32 payload_offset = ovpn_none_encap_overhead(ks);
 	const u32 opsize = OVPN_OP_SIZE_V2;
@@ -107,6 +106,10 @@ static struct ovpn_crypto_key_slot *ovpn_none_crypto_key_slot_new(const struct o
 		return ERR_PTR(-ENOMEM);
 
 	ks->ops = &ovpn_none_ops;
+	ks->encrypt = NULL;
+	ks->decrypt = NULL;
+	ks->encrypt_sync = NULL;
+	ks->decrypt_sync = NULL;
 	kref_init(&ks->refcount);
 	ks->key_id = kc->key_id;
 
@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include "main.h"
+#include "echo.h"
+#include "ovpn.h"
+#include "ovpnstruct.h"
+#include "peer.h"
+
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/skbuff.h>
+
+/* requests left unanswered before concluding that the remote end does not
+ * implement the extension
+ */
+#define OVPN_ECHO_PROBES 3
+
+/* weight of a new sample in the loss estimate, as a shift */
+#define OVPN_ECHO_LOSS_SHIFT 3
+
+#define OVPN_ECHO_MAGIC_SIZE 16
+
+/* like keepalives, echo messages are sent in place of an IP packet and
+ * start with a byte that is not a valid IP version
+ */
+static const u8 ovpn_echo_request_magic[OVPN_ECHO_MAGIC_SIZE] = {
+	0x2a, 0x3e, 0x91, 0x5c, 0x0b, 0xd7, 0x62, 0xa4,
+	0x1f, 0x88, 0xc3, 0x56, 0xe9, 0x04, 0x7d, 0x01
+};
+
+static const u8 ovpn_echo_reply_magic[OVPN_ECHO_MAGIC_SIZE] = {
+	0x2a, 0x3e, 0x91, 0x5c, 0x0b, 0xd7, 0x62, 0xa4,
+	0x1f, 0x88, 0xc3, 0x56, 0xe9, 0x04, 0x7d, 0x02
+};
+
+struct ovpn_echo_msg {
+	u8 magic[OVPN_ECHO_MAGIC_SIZE];
+	__be32 seq;
+	/* sender clock in nanoseconds, reflected as is by the remote end */
+	__be64 ts;
+} __packed;
+
+/* Enable or disable timestamped keepalives, resetting the estimates */
+void ovpn_peer_echo_set(struct ovpn_peer *peer, bool enable)
+{
+	pr_debug("%s: keepalive echo %s\n", peer->ovpn->dev->name,
+		 enable ? "enabled" : "disabled");
+
+	spin_lock_bh(&peer->echo.lock);
+	peer->echo.since_ns = ktime_get_ns();
+	peer->echo.seq = 0;
+	peer->echo.unanswered = 0;
+	peer->echo.srtt_us = 0;
+	peer->echo.rttvar_us = 0;
+	peer->echo.loss_ppm = 0;
+	peer->echo.requests = 0;
+	peer->echo.replies = 0;
+	WRITE_ONCE(peer->echo.state, enable ? OVPN_ECHO_STATE_PROBING :
+					      OVPN_ECHO_STATE_OFF);
+	spin_unlock_bh(&peer->echo.lock);
+}
+
+static void ovpn_echo_loss(struct ovpn_peer *peer, bool lost)
+{
+	u32 loss = peer->echo.loss_ppm;
+
+	loss -= loss >> OVPN_ECHO_LOSS_SHIFT;
+	if (lost)
+		loss += 1000000 >> OVPN_ECHO_LOSS_SHIFT;
+
+	peer->echo.loss_ppm = loss;
+}
+
+/* Send a timestamped request in place of a keepalive. Return false if the
+ * extension is not in use and a plain keepalive has to be sent instead
+ */
+bool ovpn_echo_xmit(struct ovpn_peer *peer)
+{
+	struct ovpn_echo_msg msg;
+	u32 seq;
+
+	if (!ovpn_peer_echo_enabled(peer))
+		return false;
+
+	spin_lock_bh(&peer->echo.lock);
+	switch (peer->echo.state) {
+	case OVPN_ECHO_STATE_PROBING:
+		if (peer->echo.unanswered >= OVPN_ECHO_PROBES) {
+			WRITE_ONCE(peer->echo.state,
+				   OVPN_ECHO_STATE_UNSUPPORTED);
+			spin_unlock_bh(&peer->echo.lock);
+			pr_debug("%s: keepalive echo not supported by peer\n",
+				 peer->ovpn->dev->name);
+			return false;
+		}
+		break;
+	case OVPN_ECHO_STATE_ACTIVE:
+		/* the previous request was never answered */
+		if (peer->echo.unanswered)
+			ovpn_echo_loss(peer, true);
+		break;
+	default:
+		spin_unlock_bh(&peer->echo.lock);
+		return false;
+	}
+
+	seq = ++peer->echo.seq;
+	peer->echo.unanswered++;
+	peer->echo.requests++;
+	spin_unlock_bh(&peer->echo.lock);
+
+	memcpy(msg.magic, ovpn_echo_request_magic, sizeof(msg.magic));
+	msg.seq = htonl(seq);
+	msg.ts = cpu_to_be64(ktime_get_ns());
+
+	ovpn_xmit_special(peer, &msg, sizeof(msg));
+	return true;
+}
+
+static void ovpn_echo_reply(struct ovpn_peer *peer, u32 seq, u64 ts)
+{
+	u64 now = ktime_get_ns();
+	u32 rtt, delta;
+
+	spin_lock_bh(&peer->echo.lock);
+	/* ignore replies to requests sent before the last reconfiguration */
+	if (peer->echo.state == OVPN_ECHO_STATE_OFF ||
+	    ts < peer->echo.since_ns || ts > now)
+		goto unlock;
+
+	rtt = min_t(u64, div_u64(now - ts, NSEC_PER_USEC), U32_MAX);
+
+	/* state is read on the datapath: avoid dirtying it needlessly */
+	if (peer->echo.state != OVPN_ECHO_STATE_ACTIVE)
+		WRITE_ONCE(peer->echo.state, OVPN_ECHO_STATE_ACTIVE);
+	peer->echo.replies++;
+
+	/* late replies were already accounted as lost */
+	if (seq == peer->echo.seq) {
+		peer->echo.unanswered = 0;
+		ovpn_echo_loss(peer, false);
+	}
+
+	/* RFC 6298 smoothing */
+	if (peer->echo.replies == 1) {
+		peer->echo.srtt_us = rtt;
+		peer->echo.rttvar_us = rtt / 2;
+	} else {
+		delta = abs((s64)peer->echo.srtt_us - rtt);
+		peer->echo.rttvar_us += (s32)(delta - peer->echo.rttvar_us) / 4;
+		peer->echo.srtt_us += (s32)(rtt - peer->echo.srtt_us) / 8;
+	}
+unlock:
+	spin_unlock_bh(&peer->echo.lock);
+}
+
+/* Handle a decrypted payload that is not an IP packet. Return true if it was
+ * an echo request or reply. The skb is left to the caller in any case
+ */
+bool ovpn_echo_recv(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	struct ovpn_echo_msg *msg, reply;
+
+	if (!pskb_may_pull(skb, sizeof(*msg)))
+		return false;
+
+	msg = (struct ovpn_echo_msg *)skb->data;
+
+	/* requests are always answered, so that peers can tell this module
+	 * implements the extension
+	 */
+	if (!memcmp(msg->magic, ovpn_echo_request_magic, sizeof(msg->magic))) {
+		reply = *msg;
+		memcpy(reply.magic, ovpn_echo_reply_magic, sizeof(reply.magic));
+		ovpn_xmit_special(peer, &reply, sizeof(reply));
+		return true;
+	}
+
+	if (!memcmp(msg->magic, ovpn_echo_reply_magic, sizeof(msg->magic))) {
+		ovpn_echo_reply(peer, ntohl(msg->seq), be64_to_cpu(msg->ts));
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_DCO_OVPNECHO_H_
+#define _NET_OVPN_DCO_OVPNECHO_H_
+
+#include <linux/skbuff.h>
+#include <linux/types.h>
+
+struct ovpn_peer;
+
+void ovpn_peer_echo_set(struct ovpn_peer *peer, bool enable);
+bool ovpn_echo_xmit(struct ovpn_peer *peer);
+bool ovpn_echo_recv(struct ovpn_peer *peer, struct sk_buff *skb);
+
+#endif /* _NET_OVPN_DCO_OVPNECHO_H_ */
@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include "main.h"
+#include "fq.h"
+
+#include <linux/reciprocal_div.h>
+#include <linux/slab.h>
+
+struct ovpn_fq *ovpn_fq_new(u32 flows_cnt, u32 quantum, u32 limit)
+{
+	struct ovpn_fq *fq;
+	u32 i;
+
+	if (!flows_cnt || flows_cnt > OVPN_FQ_MAX_FLOWS)
+		return ERR_PTR(-EINVAL);
+
+	fq = kzalloc(sizeof(*fq), GFP_KERNEL);
+	if (!fq)
+		return ERR_PTR(-ENOMEM);
+
+	fq->flows = kvcalloc(flows_cnt, sizeof(*fq->flows), GFP_KERNEL);
+	if (!fq->flows) {
+		kfree(fq);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	for (i = 0; i < flows_cnt; i++) {
+		__skb_queue_head_init(&fq->flows[i].queue);
+		INIT_LIST_HEAD(&fq->flows[i].flowchain);
+	}
+
+	fq->flows_cnt = flows_cnt;
+	fq->quantum = quantum;
+	fq->limit = limit;
+	fq->qlen = 0;
+	INIT_LIST_HEAD(&fq->new_flows);
+	INIT_LIST_HEAD(&fq->old_flows);
+
+	return fq;
+}
+
+void ovpn_fq_free(struct ovpn_fq *fq)
+{
+	u32 i;
+
+	if (!fq)
+		return;
+
+	for (i = 0; i < fq->flows_cnt; i++)
+		__skb_queue_purge(&fq->flows[i].queue);
+
+	kvfree(fq->flows);
+	kfree(fq);
+}
+
+/* drop the head packet of the flow with the largest backlog, so that the
+ * flow responsible for the overload pays for it
+ */
+static void ovpn_fq_drop(struct ovpn_fq *fq)
+{
+	struct ovpn_fq_flow *flow, *fat = NULL;
+	u32 i, max_backlog = 0;
+	struct sk_buff *skb;
+
+	for (i = 0; i < fq->flows_cnt; i++) {
+		flow = &fq->flows[i];
+		if (flow->backlog > max_backlog) {
+			max_backlog = flow->backlog;
+			fat = flow;
+		}
+	}
+
+	if (unlikely(!fat))
+		return;
+
+	skb = __skb_dequeue(&fat->queue);
+	fat->backlog -= skb->len;
+	fq->qlen--;
+	kfree_skb(skb);
+}
+
+/* Enqueue a single (non GSO) plaintext packet */
+void ovpn_fq_enqueue(struct ovpn_fq *fq, struct sk_buff *skb)
+{
+	struct ovpn_fq_flow *flow;
+	u32 idx;
+
+	idx = reciprocal_scale(skb_get_hash(skb), fq->flows_cnt);
+	flow = &fq->flows[idx];
+
+	__skb_queue_tail(&flow->queue, skb);
+	flow->backlog += skb->len;
+	fq->qlen++;
+
+	if (list_empty(&flow->flowchain)) {
+		list_add_tail(&flow->flowchain, &fq->new_flows);
+		flow->deficit = fq->quantum;
+	}
+
+	if (fq->qlen > fq->limit)
+		ovpn_fq_drop(fq);
+}
+
+struct sk_buff *ovpn_fq_dequeue(struct ovpn_fq *fq)
+{
+	struct ovpn_fq_flow *flow;
+	struct list_head *head;
+	struct sk_buff *skb;
+
+begin:
+	head = &fq->new_flows;
+	if (list_empty(head)) {
+		head = &fq->old_flows;
+		if (list_empty(head))
+			return NULL;
+	}
+
+	flow = list_first_entry(head, struct ovpn_fq_flow, flowchain);
+	if (flow->deficit <= 0) {
+		flow->deficit += fq->quantum;
+		list_move_tail(&flow->flowchain, &fq->old_flows);
+		goto begin;
+	}
+
+	skb = __skb_dequeue(&flow->queue);
+	if (!skb) {
+		/* force a pass through old_flows to prevent starvation */
+		if (head == &fq->new_flows && !list_empty(&fq->old_flows))
+			list_move_tail(&flow->flowchain, &fq->old_flows);
+		else
+			list_del_init(&flow->flowchain);
+		goto begin;
+	}
+
+	flow->backlog -= skb->len;
+	flow->deficit -= skb->len;
+	fq->qlen--;
+
+	return skb;
+}
@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_DCO_OVPNFQ_H_
+#define _NET_OVPN_DCO_OVPNFQ_H_
+
+#include <linux/list.h>
+#include <linux/skbuff.h>
+#include <linux/types.h>
+
+/* max number of flow queues that can be configured for a peer */
+#define OVPN_FQ_MAX_FLOWS 1024
+
+/* one inner flow, selected by hashing the plaintext packet */
+struct ovpn_fq_flow {
+	struct sk_buff_head queue;
+	/* link in either new_flows or old_flows */
+	struct list_head flowchain;
+	int deficit;
+	/* bytes queued in this flow */
+	u32 backlog;
+};
+
+/* Per-peer flow queueing (DRR with new/old flow lists, as in fq_codel).
+ *
+ * Only accessed by the peer encrypt_work, therefore no locking is needed.
+ */
+struct ovpn_fq {
+	struct ovpn_fq_flow *flows;
+	u32 flows_cnt;
+	/* bytes a flow may dequeue per round */
+	u32 quantum;
+	/* max number of packets queued across all flows */
+	u32 limit;
+	/* packets queued across all flows */
+	u32 qlen;
+	/* flows that became active in this round get served first */
+	struct list_head new_flows;
+	struct list_head old_flows;
+};
+
+struct ovpn_fq *ovpn_fq_new(u32 flows_cnt, u32 quantum, u32 limit);
+void ovpn_fq_free(struct ovpn_fq *fq);
+void ovpn_fq_enqueue(struct ovpn_fq *fq, struct sk_buff *skb);
+struct sk_buff *ovpn_fq_dequeue(struct ovpn_fq *fq);
+
+static inline bool ovpn_fq_full(const struct ovpn_fq *fq)
+{
+	return fq->qlen >= fq->limit;
+}
+
+#endif /* _NET_OVPN_DCO_OVPNFQ_H_ */
@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include "main.h"
+#include "keepalive.h"
+#include "ovpn.h"
+#include "peer.h"
+
+#include <linux/jiffies.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+/* Pings of all peers are emitted by a single job walking a timing wheel,
+ * rather than by one timer per peer. Sending a packet only pushes the due
+ * time of the peer forward: the job moves peers whose due time changed to
+ * the right slot when it visits them, so that peers with traffic cost one
+ * visit per keepalive interval and peers without traffic one ping.
+ *
+ * A tick is the power of two number of jiffies closest to one second from
+ * below, so that slot indexes do not jump when jiffies wraps around
+ */
+#define OVPN_KEEPALIVE_TICK_SHIFT ilog2(HZ)
+#define OVPN_KEEPALIVE_TICK (1UL << OVPN_KEEPALIVE_TICK_SHIFT)
+#define OVPN_KEEPALIVE_SLOTS 64
+
+/* peers pinged between two acquisitions of the wheel lock */
+#define OVPN_KEEPALIVE_BATCH 32
+
+static void ovpn_keepalive_work(struct work_struct *work);
+
+static struct {
+	spinlock_t lock;
+	struct hlist_head slots[OVPN_KEEPALIVE_SLOTS];
+	/* start of the next tick to process */
+	unsigned long clock;
+	unsigned int peers;
+	struct delayed_work work;
+} ovpn_keepalive = {
+	.lock = __SPIN_LOCK_UNLOCKED(ovpn_keepalive.lock),
+	.work = __DELAYED_WORK_INITIALIZER(ovpn_keepalive.work,
+					   ovpn_keepalive_work, 0),
+};
+
+static struct hlist_head *ovpn_keepalive_slot(unsigned long time)
+{
+	unsigned int i;
+
+	i = (time >> OVPN_KEEPALIVE_TICK_SHIFT) & (OVPN_KEEPALIVE_SLOTS - 1);
+	return &ovpn_keepalive.slots[i];
+}
+
+static void ovpn_keepalive_schedule(void)
+{
+	unsigned long delay = 0;
+
+	lockdep_assert_held(&ovpn_keepalive.lock);
+
+	if (time_before(jiffies, ovpn_keepalive.clock))
+		delay = ovpn_keepalive.clock - jiffies;
+
+	queue_delayed_work(system_power_efficient_wq, &ovpn_keepalive.work,
+			   delay);
+}
+
+/* Collect up to OVPN_KEEPALIVE_BATCH peers due in the tick starting at
+ * ovpn_keepalive.clock, holding a reference to each of them. Peers are
+ * rescheduled one interval later. Return the number of peers collected
+ */
+static unsigned int ovpn_keepalive_collect(struct ovpn_peer **batch)
+{
+	const unsigned long end = ovpn_keepalive.clock + OVPN_KEEPALIVE_TICK;
+	struct hlist_head *slot, *next;
+	struct hlist_node *tmp;
+	struct ovpn_peer *peer;
+	unsigned int n = 0;
+	unsigned long due;
+
+	slot = ovpn_keepalive_slot(ovpn_keepalive.clock);
+	hlist_for_each_entry_safe(peer, tmp, slot, keepalive_node) {
+		due = READ_ONCE(peer->keepalive_xmit_due);
+		if (time_before(due, end)) {
+			if (n == OVPN_KEEPALIVE_BATCH)
+				break;
+
+			/* a peer being released is unlinked right after */
+			if (!ovpn_peer_hold(peer))
+				continue;
+
+			batch[n++] = peer;
+			due = jiffies + msecs_to_jiffies(peer->keepalive_interval *
+							 MSEC_PER_SEC);
+			WRITE_ONCE(peer->keepalive_xmit_due, due);
+		}
+
+		/* sent traffic pushed the due time to a later slot, or the
+		 * peer was pinged just now
+		 */
+		next = ovpn_keepalive_slot(due);
+		if (next != slot) {
+			hlist_del(&peer->keepalive_node);
+			hlist_add_head(&peer->keepalive_node, next);
+		}
+	}
+
+	return n;
+}
+
+static void ovpn_keepalive_work(struct work_struct *work)
+{
+	struct ovpn_peer *batch[OVPN_KEEPALIVE_BATCH];
+	unsigned int i, n;
+
+	spin_lock_bh(&ovpn_keepalive.lock);
+	while (ovpn_keepalive.peers &&
+	       !time_before(jiffies, ovpn_keepalive.clock)) {
+		n = ovpn_keepalive_collect(batch);
+		if (!n) {
+			ovpn_keepalive.clock += OVPN_KEEPALIVE_TICK;
+			continue;
+		}
+		spin_unlock_bh(&ovpn_keepalive.lock);
+
+		for (i = 0; i < n; i++) {
+			ovpn_keepalive_xmit(batch[i]);
+			ovpn_peer_put(batch[i]);
+		}
+
+		cond_resched();
+		spin_lock_bh(&ovpn_keepalive.lock);
+	}
+
+	if (ovpn_keepalive.peers)
+		ovpn_keepalive_schedule();
+	spin_unlock_bh(&ovpn_keepalive.lock);
+}
+
+/* Schedule the first ping of peer one keepalive interval from now */
+void ovpn_keepalive_add(struct ovpn_peer *peer)
+{
+	unsigned long due;
+
+	due = jiffies + msecs_to_jiffies(peer->keepalive_interval *
+					 MSEC_PER_SEC);
+
+	spin_lock_bh(&ovpn_keepalive.lock);
+	WRITE_ONCE(peer->keepalive_xmit_due, due);
+
+	if (!hlist_unhashed(&peer->keepalive_node)) {
+		hlist_del(&peer->keepalive_node);
+	} else if (!ovpn_keepalive.peers++) {
+		/* the wheel was idle: restart from the current tick */
+		ovpn_keepalive.clock = jiffies & ~(OVPN_KEEPALIVE_TICK - 1);
+		ovpn_keepalive_schedule();
+	}
+	hlist_add_head(&peer->keepalive_node, ovpn_keepalive_slot(due));
+	spin_unlock_bh(&ovpn_keepalive.lock);
+}
+
+/* Stop sending pings to peer */
+void ovpn_keepalive_del(struct ovpn_peer *peer)
+{
+	spin_lock_bh(&ovpn_keepalive.lock);
+	if (!hlist_unhashed(&peer->keepalive_node)) {
+		hlist_del_init(&peer->keepalive_node);
+		ovpn_keepalive.peers--;
+	}
+	spin_unlock_bh(&ovpn_keepalive.lock);
+}
+
+/* Called on module unload, once all peers are gone */
+void ovpn_keepalive_cleanup(void)
+{
+	cancel_delayed_work_sync(&ovpn_keepalive.work);
+}
@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_DCO_OVPNKEEPALIVE_H_
+#define _NET_OVPN_DCO_OVPNKEEPALIVE_H_
+
+struct ovpn_peer;
+
+void ovpn_keepalive_add(struct ovpn_peer *peer);
+void ovpn_keepalive_del(struct ovpn_peer *peer);
+void ovpn_keepalive_cleanup(void);
+
+#endif /* _NET_OVPN_DCO_OVPNKEEPALIVE_H_ */
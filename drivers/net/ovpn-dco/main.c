@@ -9,9 +9,12 @@
 
 #include "main.h"
 
+#include "crypto.h"
+#include "keepalive.h"
 #include "ovpn.h"
 #include "ovpnstruct.h"
 #include "netlink.h"
+#include "sample.h"
 
 #include <linux/ethtool.h>
 #include <linux/genetlink.h>
@@ -37,7 +40,10 @@ static void ovpn_struct_free(struct net_device *net)
 {
 	struct ovpn_struct *ovpn = netdev_priv(net);
 
-	ovpn_sock_detach(ovpn->sock);
+	ovpn_rx_steering_clear(ovpn);
+	ovpn_sock_detach(ovpn, ovpn->sock);
+	ovpn_sample_release(ovpn);
+	free_percpu(ovpn->crypto_path);
 	security_tun_dev_free_security(ovpn->security);
 	free_percpu(net->tstats);
 	flush_workqueue(ovpn->crypto_wq);
@@ -74,8 +80,7 @@ static int ovpn_net_stop(struct net_device *dev)
 
 static int ovpn_net_change_mtu(struct net_device *dev, int new_mtu)
 {
-	if (new_mtu < IPV4_MIN_MTU ||
-	    new_mtu + dev->hard_header_len > IP_MAX_MTU)
+	if (new_mtu < IPV4_MIN_MTU || new_mtu > OVPN_MAX_MTU)
 		return -EINVAL;
 
 	dev->mtu = new_mtu;
@@ -110,6 +115,43 @@ static void ovpn_get_drvinfo(struct net_device *dev,
 	strscpy(info->bus_info, "ovpn", sizeof(info->bus_info));
 }
 
+/* must follow the layout of struct ovpn_crypto_path_stats */
+static const char ovpn_ethtool_stats[][ETH_GSTRING_LEN] = {
+	"tx_crypto_inline",
+	"tx_crypto_worker",
+	"tx_crypto_async",
+	"rx_crypto_inline",
+	"rx_crypto_worker",
+	"rx_crypto_async",
+};
+
+static int ovpn_get_sset_count(struct net_device *dev, int sset)
+{
+	if (sset != ETH_SS_STATS)
+		return -EOPNOTSUPP;
+
+	return ARRAY_SIZE(ovpn_ethtool_stats);
+}
+
+static void ovpn_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	if (sset == ETH_SS_STATS)
+		memcpy(data, ovpn_ethtool_stats, sizeof(ovpn_ethtool_stats));
+}
+
+static void ovpn_get_ethtool_stats(struct net_device *dev,
+				   struct ethtool_stats *stats, u64 *data)
+{
+	struct ovpn_struct *ovpn = netdev_priv(dev);
+	struct ovpn_crypto_path_stats sum;
+
+	BUILD_BUG_ON(ARRAY_SIZE(ovpn_ethtool_stats) * sizeof(u64) !=
+		     sizeof(sum));
+
+	ovpn_crypto_path_stats_read(ovpn->crypto_path, &sum);
+	memcpy(data, &sum, sizeof(sum));
+}
+
 bool ovpn_dev_is_valid(const struct net_device *dev)
 {
 	return dev->netdev_ops->ndo_start_xmit == ovpn_net_xmit;
@@ -133,6 +175,9 @@ static const struct ethtool_ops ovpn_ethtool_ops = {
 	.get_drvinfo		= ovpn_get_drvinfo,
 	.get_link		= ethtool_op_get_link,
 	.get_ts_info		= ethtool_op_get_ts_info,
+	.get_sset_count		= ovpn_get_sset_count,
+	.get_strings		= ovpn_get_strings,
+	.get_ethtool_stats	= ovpn_get_ethtool_stats,
 };
 
 static void ovpn_setup(struct net_device *dev)
@@ -152,6 +197,8 @@ static void ovpn_setup(struct net_device *dev)
 	dev->hard_header_len = 0;
 	dev->addr_len = 0;
 	dev->mtu = ETH_DATA_LEN;
+	dev->min_mtu = IPV4_MIN_MTU;
+	dev->max_mtu = OVPN_MAX_MTU;
 
 	/* Zero header length */
 	dev->type = ARPHRD_NONE;
@@ -239,6 +286,7 @@ static __exit void ovpn_cleanup(void)
 {
 	rtnl_link_unregister(&ovpn_link_ops);
 	ovpn_netlink_unregister();
+	ovpn_keepalive_cleanup();
 	rcu_barrier(); /* because we use call_rcu */
 }
 
@@ -54,6 +54,18 @@ void ovpn_release_lock(struct kref *kref);
 
 #define OVPN_QUEUE_LEN 1024
 
+/* upper bound of the data channel overhead: opcode, peer ID, packet ID and
+ * authentication tag, plus the length prefix used on stream transports
+ */
+#define OVPN_MAX_DATA_OVERHEAD 32
+
+/* largest tunnel MTU: once encapsulated, a packet must still fit the 16 bit
+ * length of the TCP framing and of the transport IP header
+ */
+#define OVPN_MAX_MTU \
+	(IP_MAX_MTU - sizeof(struct ipv6hdr) - sizeof(struct udphdr) - \
+	 OVPN_MAX_DATA_OVERHEAD)
+
 /* max allowed parameter values */
 #define OVPN_MAX_PEERS                1000000
 #define OVPN_MAX_DEV_QUEUES           0x1000
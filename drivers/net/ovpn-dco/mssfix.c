@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include "main.h"
+#include "crypto.h"
+#include "mssfix.h"
+#include "ovpnstruct.h"
+#include "peer.h"
+#include "skb.h"
+
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <net/checksum.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+
+/* offset of the flags byte in the TCP header, see tcp_flag_byte() */
+#define OVPN_TCP_FLAGS_OFFSET 13
+
+/* Return the largest MSS allowing a TCP segment with an inner IP header of
+ * iphlen bytes to be sent through the tunnel without the encapsulated packet
+ * exceeding peer->mssfix.size bytes, nor the inner one the tunnel MTU.
+ * Return 0 if no MSS can be computed
+ */
+static unsigned int ovpn_mssfix_mss(struct ovpn_peer *peer, unsigned int iphlen)
+{
+	unsigned int size = READ_ONCE(peer->mssfix.size);
+	struct ovpn_crypto_key_slot *ks;
+	unsigned int overhead;
+
+	switch (peer->ovpn->proto) {
+	case OVPN_PROTO_UDP4:
+		overhead = sizeof(struct iphdr) + sizeof(struct udphdr);
+		break;
+	case OVPN_PROTO_UDP6:
+		overhead = sizeof(struct ipv6hdr) + sizeof(struct udphdr);
+		break;
+	case OVPN_PROTO_TCP4:
+		/* packets are prefixed by their length on stream transports */
+		overhead = sizeof(struct iphdr) + sizeof(struct tcphdr) +
+			   sizeof(u16);
+		break;
+	case OVPN_PROTO_TCP6:
+		overhead = sizeof(struct ipv6hdr) + sizeof(struct tcphdr) +
+			   sizeof(u16);
+		break;
+	default:
+		return 0;
+	}
+
+	ks = ovpn_crypto_key_slot_primary(&peer->crypto);
+	if (unlikely(!ks))
+		return 0;
+	overhead += ks->ops->encap_overhead(ks);
+	ovpn_crypto_key_slot_put(ks);
+
+	if (unlikely(size <= overhead))
+		return 0;
+
+	size = min(size - overhead, peer->ovpn->dev->mtu);
+	if (unlikely(size <= iphlen + sizeof(struct tcphdr)))
+		return 0;
+
+	return size - iphlen - sizeof(struct tcphdr);
+}
+
+/* length of the TCP option at offset, making progress on bogus lengths */
+static unsigned int ovpn_mssfix_optlen(const u8 *opt, unsigned int offset)
+{
+	if (opt[offset] <= TCPOPT_NOP || opt[offset + 1] == 0)
+		return 1;
+
+	return opt[offset + 1];
+}
+
+/* Lower the MSS option of a TCP SYN to mss. Return true if the packet was
+ * modified
+ */
+static bool ovpn_mssfix_clamp(struct sk_buff *skb, unsigned int thoff,
+			      unsigned int mss)
+{
+	unsigned int hdrlen, i;
+	struct tcphdr *th;
+	u16 oldmss;
+	u8 *opt;
+
+	thoff += skb_network_offset(skb);
+
+	if (unlikely(!pskb_may_pull(skb, thoff + sizeof(*th))))
+		return false;
+
+	th = (struct tcphdr *)(skb->data + thoff);
+	hdrlen = th->doff * 4;
+	if (unlikely(hdrlen < sizeof(*th)))
+		return false;
+
+	if (unlikely(skb_ensure_writable(skb, thoff + hdrlen)))
+		return false;
+
+	th = (struct tcphdr *)(skb->data + thoff);
+	opt = (u8 *)th;
+
+	for (i = sizeof(*th); i + TCPOLEN_MSS <= hdrlen;
+	     i += ovpn_mssfix_optlen(opt, i)) {
+		if (opt[i] != TCPOPT_MSS || opt[i + 1] != TCPOLEN_MSS)
+			continue;
+
+		oldmss = (opt[i + 2] << 8) | opt[i + 3];
+		if (oldmss <= mss)
+			return false;
+
+		opt[i + 2] = mss >> 8;
+		opt[i + 3] = mss & 0xff;
+		inet_proto_csum_replace2(&th->check, skb, htons(oldmss),
+					 htons(mss), false);
+		return true;
+	}
+
+	return false;
+}
+
+static bool ovpn_mssfix_is_syn(struct sk_buff *skb, unsigned int thoff)
+{
+	u8 _flags, *flags;
+
+	flags = skb_header_pointer(skb, skb_network_offset(skb) + thoff +
+				   OVPN_TCP_FLAGS_OFFSET, sizeof(_flags),
+				   &_flags);
+
+	return flags && (*flags & TCPHDR_SYN);
+}
+
+static bool ovpn_mssfix(struct ovpn_peer *peer, struct sk_buff *skb,
+			unsigned int thoff)
+{
+	unsigned int mss;
+
+	if (!ovpn_mssfix_is_syn(skb, thoff))
+		return false;
+
+	mss = ovpn_mssfix_mss(peer, thoff);
+	if (unlikely(!mss))
+		return false;
+
+	return ovpn_mssfix_clamp(skb, thoff, mss);
+}
+
+/* Clamp the MSS of TCP SYNs sent through the tunnel. Called by
+ * ovpn_net_xmit() once the IP header has been validated
+ */
+void ovpn_mssfix_xmit(struct ovpn_struct *ovpn, struct sk_buff *skb)
+{
+	struct ovpn_peer *peer;
+	unsigned int thoff;
+
+	/* SYNs are never aggregated */
+	if (skb_is_gso(skb))
+		return;
+
+	switch (skb->protocol) {
+	case htons(ETH_P_IP):
+		if (ip_hdr(skb)->protocol != IPPROTO_TCP ||
+		    ip_is_fragment(ip_hdr(skb)))
+			return;
+		thoff = ip_hdr(skb)->ihl * 4;
+		break;
+	case htons(ETH_P_IPV6):
+		if (!pskb_network_may_pull(skb, sizeof(struct ipv6hdr)) ||
+		    ipv6_hdr(skb)->nexthdr != IPPROTO_TCP)
+			return;
+		thoff = sizeof(struct ipv6hdr);
+		break;
+	default:
+		return;
+	}
+
+	rcu_read_lock();
+	peer = rcu_dereference(ovpn->peer);
+	if (peer && READ_ONCE(peer->mssfix.size) &&
+	    ovpn_mssfix(peer, skb, thoff))
+		atomic64_inc(&peer->mssfix_stats.tx);
+	rcu_read_unlock();
+}
+
+/* Clamp the MSS of TCP SYNs received from the tunnel. The packet must have
+ * been parsed by ovpn_skb_parse_inner()
+ */
+void ovpn_mssfix_recv(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	if (likely(!READ_ONCE(peer->mssfix.size)))
+		return;
+
+	if (OVPN_SKB_CB(skb)->l4proto != IPPROTO_TCP)
+		return;
+
+	if (skb->protocol == htons(ETH_P_IP) && ip_is_fragment(ip_hdr(skb)))
+		return;
+
+	if (ovpn_mssfix(peer, skb, OVPN_SKB_CB(skb)->thoff))
+		atomic64_inc(&peer->mssfix_stats.rx);
+}
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_DCO_OVPNMSSFIX_H_
+#define _NET_OVPN_DCO_OVPNMSSFIX_H_
+
+#include <linux/skbuff.h>
+
+struct ovpn_peer;
+struct ovpn_struct;
+
+void ovpn_mssfix_xmit(struct ovpn_struct *ovpn, struct sk_buff *skb);
+void ovpn_mssfix_recv(struct ovpn_peer *peer, struct sk_buff *skb);
+
+#endif /* _NET_OVPN_DCO_OVPNMSSFIX_H_ */
@@ -7,18 +7,26 @@
  */
 
 #include "main.h"
+#include "echo.h"
 #include "ovpn.h"
 #include "peer.h"
+#include "proto.h"
 #include "netlink.h"
 #include "ovpnstruct.h"
+#include "sample.h"
+#include "steering.h"
 #include "udp.h"
 
 #include <uapi/linux/ovpn_dco.h>
 
 #include <linux/netdevice.h>
+#include <linux/bitmap.h>
+#include <linux/cpumask.h>
 #include <linux/netlink.h>
 #include <linux/rcupdate.h>
+#include <linux/slab.h>
 #include <linux/socket.h>
+#include <linux/sort.h>
 #include <linux/types.h>
 #include <linux/spinlock.h>
 #include <net/genetlink.h>
@@ -27,12 +35,20 @@
 
 enum ovpn_netlink_multicast_groups {
 	OVPN_MCGRP_PEERS,
+	OVPN_MCGRP_SAMPLES,
 };
 
+/* bounds of the number of peers returned by OVPN_CMD_GET_TOP_PEERS */
+#define OVPN_TOP_PEERS_MAX 64
+#define OVPN_TOP_PEERS_DEFAULT 10
+
 static const struct genl_multicast_group ovpn_netlink_mcgrps[] = {
 	[OVPN_MCGRP_PEERS] = { .name = OVPN_NL_MULTICAST_GROUP_PEERS },
+	[OVPN_MCGRP_SAMPLES] = { .name = OVPN_NL_MULTICAST_GROUP_SAMPLES },
 };
 
+static struct genl_family ovpn_netlink_family;
+
 static const struct nla_policy
 ovpn_netlink_policy_key_dir[OVPN_KEY_DIR_ATTR_MAX + 1] = {
 	[OVPN_KEY_DIR_ATTR_CIPHER_KEY] = { .type = NLA_BINARY, .len = U8_MAX },
@@ -69,18 +85,31 @@ static const struct nla_policy ovpn_netlink_policy[OVPN_ATTR_MAX + 1] = {
 		NLA_POLICY_NESTED(ovpn_netlink_policy_sockaddr),
 	[OVPN_ATTR_SOCKADDR_LOCAL] =
 		NLA_POLICY_NESTED(ovpn_netlink_policy_sockaddr),
+	[OVPN_ATTR_PKTID_WRAP_THRESHOLD] = { .type = NLA_U32 },
+	[OVPN_ATTR_FQ_FLOWS] = NLA_POLICY_MAX(NLA_U16, OVPN_FQ_MAX_FLOWS),
+	[OVPN_ATTR_PACING_RATE] = { .type = NLA_U64 },
+	[OVPN_ATTR_MSSFIX] = { .type = NLA_U16 },
+	[OVPN_ATTR_TOP_PEERS_N] = NLA_POLICY_RANGE(NLA_U32, 1,
+						   OVPN_TOP_PEERS_MAX),
+	[OVPN_ATTR_TOP_PEERS_SORT] = NLA_POLICY_MAX(NLA_U8,
+						    OVPN_TOP_PEERS_SORT_PPS),
+	[OVPN_ATTR_SAMPLE_RATE] = { .type = NLA_U32 },
+	[OVPN_ATTR_ECHO] = NLA_POLICY_MAX(NLA_U8, 1),
+	[OVPN_ATTR_TX_THROTTLE] = NLA_POLICY_MAX(NLA_U8, 1),
+	[OVPN_ATTR_RX_CPUMASK] = { .type = NLA_BINARY,
+				   .len = DIV_ROUND_UP(NR_CPUS, 32) * sizeof(u32) },
 };
 
 static struct net_device *
-ovpn_get_dev_from_info(struct net *net, struct genl_info *info)
+ovpn_get_dev_from_attrs(struct net *net, struct nlattr **attrs)
 {
 	struct net_device *dev;
 	int ifindex;
 
-	if (!info->attrs[OVPN_ATTR_IFINDEX])
+	if (!attrs[OVPN_ATTR_IFINDEX])
 		return ERR_PTR(-EINVAL);
 
-	ifindex = nla_get_u32(info->attrs[OVPN_ATTR_IFINDEX]);
+	ifindex = nla_get_u32(attrs[OVPN_ATTR_IFINDEX]);
 
 	dev = dev_get_by_index(net, ifindex);
 	if (!dev)
@@ -112,7 +141,7 @@ static int ovpn_pre_doit(const struct genl_ops *ops, struct sk_buff *skb,
 	struct ovpn_struct *ovpn;
 	struct net_device *dev;
 
-	dev = ovpn_get_dev_from_info(net, info);
+	dev = ovpn_get_dev_from_attrs(net, info->attrs);
 	if (IS_ERR(dev))
 		return PTR_ERR(dev);
 
@@ -160,6 +189,7 @@ static int ovpn_netlink_get_key_dir(struct genl_info *info, struct nlattr *key,
 	switch (cipher) {
 	case OVPN_CIPHER_ALG_AES_GCM:
 	case OVPN_CIPHER_ALG_CHACHA20_POLY1305:
+	case OVPN_CIPHER_ALG_AEGIS128:
 		attr = attrs[OVPN_KEY_DIR_ATTR_CIPHER_KEY];
 		if (!attr)
 			return -EINVAL;
@@ -170,7 +200,8 @@ static int ovpn_netlink_get_key_dir(struct genl_info *info, struct nlattr *key,
 		attr = attrs[OVPN_KEY_DIR_ATTR_NONCE_TAIL];
 		/* These algorithms require a 96bit nonce,
 		 * Construct it by combining 4-bytes packet id and
-		 * 8-bytes nonce-tail from userspace
+		 * 8-bytes nonce-tail from userspace (AEGIS128 takes a 128bit
+		 * nonce, which is zero-padded by the crypto backend)
 		 */
 		if (!attr || nla_len(attr) != NONCE_TAIL_SIZE)
 			return -EINVAL;
@@ -343,6 +374,7 @@ static int ovpn_netlink_new_peer(struct sk_buff *skb, struct genl_info *info)
 	struct ovpn_sockaddr_pair pair;
 	struct ovpn_peer *old, *new;
 	struct nlattr *attr;
+	u16 fq_flows = 0;
 	int ret;
 
 	if (!info->attrs[OVPN_ATTR_SOCKADDR_REMOTE] ||
@@ -365,7 +397,11 @@ static int ovpn_netlink_new_peer(struct sk_buff *skb, struct genl_info *info)
 	if (pair.remote.family != pair.local.family)
 		return -EINVAL;
 
-	new = ovpn_peer_new_with_sockaddr(ovpn, &pair);
+	/* flow queueing can only be chosen when creating the peer */
+	if (info->attrs[OVPN_ATTR_FQ_FLOWS])
+		fq_flows = nla_get_u16(info->attrs[OVPN_ATTR_FQ_FLOWS]);
+
+	new = ovpn_peer_new_with_sockaddr(ovpn, &pair, fq_flows);
 	if (IS_ERR(new)) {
 		pr_err("cannot create new peer object for %pIScp\n",
 		       &pair.remote.u);
@@ -393,6 +429,11 @@ static int ovpn_netlink_set_peer(struct sk_buff *skb, struct genl_info *info)
 	u32 interv, timeout;
 	struct ovpn_peer *peer;
 
+	if (info->attrs[OVPN_ATTR_SAMPLE_RATE] &&
+	    nla_get_u32(info->attrs[OVPN_ATTR_SAMPLE_RATE]) >
+	    OVPN_SAMPLE_RATE_MAX)
+		return -EINVAL;
+
 	peer = ovpn_peer_get(ovpn);
 	if (!peer)
 		return -ENOENT;
@@ -408,8 +449,590 @@ static int ovpn_netlink_set_peer(struct sk_buff *skb, struct genl_info *info)
 	if (keepalive_set)
 		ovpn_peer_keepalive_set(peer, interv, timeout);
 
+	if (info->attrs[OVPN_ATTR_PKTID_WRAP_THRESHOLD]) {
+		u32 threshold;
+
+		threshold = nla_get_u32(info->attrs[OVPN_ATTR_PKTID_WRAP_THRESHOLD]);
+		ovpn_crypto_state_set_pktid_wrap_warn(&peer->crypto, threshold);
+	}
+
+	if (info->attrs[OVPN_ATTR_PACING_RATE])
+		ovpn_peer_pacing_set(peer,
+				     nla_get_u64(info->attrs[OVPN_ATTR_PACING_RATE]));
+
+	if (info->attrs[OVPN_ATTR_MSSFIX])
+		ovpn_peer_mssfix_set(peer,
+				     nla_get_u16(info->attrs[OVPN_ATTR_MSSFIX]));
+
+	if (info->attrs[OVPN_ATTR_SAMPLE_RATE])
+		ovpn_peer_sample_set(peer,
+				     nla_get_u32(info->attrs[OVPN_ATTR_SAMPLE_RATE]));
+
+	if (info->attrs[OVPN_ATTR_ECHO])
+		ovpn_peer_echo_set(peer,
+				   nla_get_u8(info->attrs[OVPN_ATTR_ECHO]));
+
+	if (info->attrs[OVPN_ATTR_TX_THROTTLE])
+		ovpn_udp_tx_throttle_set(peer,
+					 nla_get_u8(info->attrs[OVPN_ATTR_TX_THROTTLE]));
+
+	ovpn_peer_put(peer);
+	return 0;
+}
+
+static int ovpn_netlink_set_rx_cpumask(struct ovpn_struct *ovpn,
+				       struct nlattr *attr)
+{
+	cpumask_var_t mask;
+	unsigned int nbits;
+	int ret;
+
+	if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	nbits = min_t(unsigned int, nla_len(attr) / sizeof(u32) * 32,
+		      nr_cpu_ids);
+	bitmap_from_arr32(cpumask_bits(mask), nla_data(attr), nbits);
+
+	ret = ovpn_rx_steering_set(ovpn, mask);
+	free_cpumask_var(mask);
+
+	return ret;
+}
+
+static int ovpn_netlink_fill_pacing(struct sk_buff *msg,
+				    struct ovpn_peer *peer)
+{
+	struct nlattr *attr;
+
+	attr = nla_nest_start(msg, OVPN_ATTR_PACING);
+	if (!attr)
+		return -EMSGSIZE;
+
+	if (nla_put_u64_64bit(msg, OVPN_PACING_ATTR_RATE,
+			      READ_ONCE(peer->pacing.rate),
+			      OVPN_PACING_ATTR_PAD) ||
+	    nla_put_u64_64bit(msg, OVPN_PACING_ATTR_PACKETS,
+			      atomic64_read(&peer->pacing.packets),
+			      OVPN_PACING_ATTR_PAD) ||
+	    nla_put_u64_64bit(msg, OVPN_PACING_ATTR_DELAYED,
+			      atomic64_read(&peer->pacing.delayed),
+			      OVPN_PACING_ATTR_PAD) ||
+	    nla_put_u64_64bit(msg, OVPN_PACING_ATTR_DELAY_NS,
+			      atomic64_read(&peer->pacing.delay_ns),
+			      OVPN_PACING_ATTR_PAD)) {
+		nla_nest_cancel(msg, attr);
+		return -EMSGSIZE;
+	}
+
+	nla_nest_end(msg, attr);
+	return 0;
+}
+
+static int ovpn_netlink_fill_probation(struct sk_buff *msg,
+				       struct ovpn_peer *peer)
+{
+	unsigned long until = READ_ONCE(peer->probation.until);
+	u32 remaining = 0;
+	struct nlattr *attr;
+
+	if (until && time_before(jiffies, until))
+		remaining = jiffies_to_msecs(until - jiffies);
+
+	attr = nla_nest_start(msg, OVPN_ATTR_PROBATION);
+	if (!attr)
+		return -EMSGSIZE;
+
+	if (nla_put_u64_64bit(msg, OVPN_PROBATION_ATTR_AUTH_FAIL,
+			      atomic64_read(&peer->probation.auth_fail),
+			      OVPN_PROBATION_ATTR_PAD) ||
+	    nla_put_u64_64bit(msg, OVPN_PROBATION_ATTR_COUNT,
+			      atomic64_read(&peer->probation.count),
+			      OVPN_PROBATION_ATTR_PAD) ||
+	    nla_put_u64_64bit(msg, OVPN_PROBATION_ATTR_DROPPED,
+			      atomic64_read(&peer->probation.dropped),
+			      OVPN_PROBATION_ATTR_PAD) ||
+	    nla_put_u32(msg, OVPN_PROBATION_ATTR_REMAINING_MS, remaining)) {
+		nla_nest_cancel(msg, attr);
+		return -EMSGSIZE;
+	}
+
+	nla_nest_end(msg, attr);
+	return 0;
+}
+
+static int ovpn_netlink_fill_mssfix(struct sk_buff *msg,
+				    struct ovpn_peer *peer)
+{
+	struct nlattr *attr;
+
+	if (nla_put_u16(msg, OVPN_ATTR_MSSFIX, READ_ONCE(peer->mssfix.size)))
+		return -EMSGSIZE;
+
+	attr = nla_nest_start(msg, OVPN_ATTR_MSSFIX_STATS);
+	if (!attr)
+		return -EMSGSIZE;
+
+	if (nla_put_u64_64bit(msg, OVPN_MSSFIX_ATTR_TX,
+			      atomic64_read(&peer->mssfix_stats.tx),
+			      OVPN_MSSFIX_ATTR_PAD) ||
+	    nla_put_u64_64bit(msg, OVPN_MSSFIX_ATTR_RX,
+			      atomic64_read(&peer->mssfix_stats.rx),
+			      OVPN_MSSFIX_ATTR_PAD)) {
+		nla_nest_cancel(msg, attr);
+		return -EMSGSIZE;
+	}
+
+	nla_nest_end(msg, attr);
+	return 0;
+}
+
+static int ovpn_netlink_fill_sample(struct sk_buff *msg,
+				    struct ovpn_peer *peer)
+{
+	struct nlattr *attr;
+
+	if (nla_put_u32(msg, OVPN_ATTR_SAMPLE_RATE,
+			READ_ONCE(peer->sample.rate)))
+		return -EMSGSIZE;
+
+	attr = nla_nest_start(msg, OVPN_ATTR_SAMPLE_STATS);
+	if (!attr)
+		return -EMSGSIZE;
+
+	if (nla_put_u64_64bit(msg, OVPN_SAMPLE_STATS_ATTR_TAKEN,
+			      atomic64_read(&peer->sample_stats.taken),
+			      OVPN_SAMPLE_STATS_ATTR_PAD) ||
+	    nla_put_u64_64bit(msg, OVPN_SAMPLE_STATS_ATTR_LOST,
+			      atomic64_read(&peer->sample_stats.lost),
+			      OVPN_SAMPLE_STATS_ATTR_PAD)) {
+		nla_nest_cancel(msg, attr);
+		return -EMSGSIZE;
+	}
+
+	nla_nest_end(msg, attr);
+	return 0;
+}
+
+static int ovpn_netlink_fill_echo(struct sk_buff *msg,
+				  struct ovpn_peer *peer)
+{
+	u32 srtt_us, rttvar_us, loss_ppm;
+	u64 requests, replies;
+	struct nlattr *attr;
+	u8 state;
+
+	spin_lock_bh(&peer->echo.lock);
+	state = peer->echo.state;
+	srtt_us = peer->echo.srtt_us;
+	rttvar_us = peer->echo.rttvar_us;
+	loss_ppm = peer->echo.loss_ppm;
+	requests = peer->echo.requests;
+	replies = peer->echo.replies;
+	spin_unlock_bh(&peer->echo.lock);
+
+	attr = nla_nest_start(msg, OVPN_ATTR_ECHO_STATS);
+	if (!attr)
+		return -EMSGSIZE;
+
+	if (nla_put_u8(msg, OVPN_ECHO_ATTR_STATE, state) ||
+	    nla_put_u32(msg, OVPN_ECHO_ATTR_SRTT_US, srtt_us) ||
+	    nla_put_u32(msg, OVPN_ECHO_ATTR_RTTVAR_US, rttvar_us) ||
+	    nla_put_u32(msg, OVPN_ECHO_ATTR_LOSS_PPM, loss_ppm) ||
+	    nla_put_u64_64bit(msg, OVPN_ECHO_ATTR_REQUESTS, requests,
+			      OVPN_ECHO_ATTR_PAD) ||
+	    nla_put_u64_64bit(msg, OVPN_ECHO_ATTR_REPLIES, replies,
+			      OVPN_ECHO_ATTR_PAD)) {
+		nla_nest_cancel(msg, attr);
+		return -EMSGSIZE;
+	}
+
+	nla_nest_end(msg, attr);
+	return 0;
+}
+
+static int ovpn_netlink_fill_rates(struct sk_buff *msg,
+				   const struct ovpn_peer_rates *rates)
+{
+	struct nlattr *attr;
+
+	attr = nla_nest_start(msg, OVPN_ATTR_RATES);
+	if (!attr)
+		return -EMSGSIZE;
+
+	if (nla_put_u64_64bit(msg, OVPN_RATES_ATTR_RX_BPS, rates->rx_bps,
+			      OVPN_RATES_ATTR_PAD) ||
+	    nla_put_u64_64bit(msg, OVPN_RATES_ATTR_RX_PPS, rates->rx_pps,
+			      OVPN_RATES_ATTR_PAD) ||
+	    nla_put_u64_64bit(msg, OVPN_RATES_ATTR_TX_BPS, rates->tx_bps,
+			      OVPN_RATES_ATTR_PAD) ||
+	    nla_put_u64_64bit(msg, OVPN_RATES_ATTR_TX_PPS, rates->tx_pps,
+			      OVPN_RATES_ATTR_PAD)) {
+		nla_nest_cancel(msg, attr);
+		return -EMSGSIZE;
+	}
+
+	nla_nest_end(msg, attr);
+	return 0;
+}
+
+static int ovpn_netlink_fill_peer(struct sk_buff *msg, struct ovpn_peer *peer)
+{
+	struct ovpn_peer_rates rates;
+	int ret;
+
+	if (nla_put_u32(msg, OVPN_ATTR_IFINDEX, peer->ovpn->dev->ifindex) ||
+	    nla_put_u32(msg, OVPN_ATTR_KEEPALIVE_INTERVAL,
+			peer->keepalive_interval) ||
+	    nla_put_u32(msg, OVPN_ATTR_KEEPALIVE_TIMEOUT,
+			peer->keepalive_timeout) ||
+	    nla_put_u8(msg, OVPN_ATTR_TX_THROTTLE,
+		       READ_ONCE(peer->tx_throttle)))
+		return -EMSGSIZE;
+
+	ret = ovpn_netlink_fill_pacing(msg, peer);
+	if (ret < 0)
+		return ret;
+
+	ret = ovpn_netlink_fill_probation(msg, peer);
+	if (ret < 0)
+		return ret;
+
+	ret = ovpn_netlink_fill_mssfix(msg, peer);
+	if (ret < 0)
+		return ret;
+
+	ret = ovpn_netlink_fill_sample(msg, peer);
+	if (ret < 0)
+		return ret;
+
+	ret = ovpn_netlink_fill_echo(msg, peer);
+	if (ret < 0)
+		return ret;
+
+	ovpn_peer_stats_get_rates(&peer->stats, &rates);
+	return ovpn_netlink_fill_rates(msg, &rates);
+}
+
+static int ovpn_netlink_get_peer(struct sk_buff *skb, struct genl_info *info)
+{
+	struct ovpn_struct *ovpn = info->user_ptr[0];
+	struct ovpn_peer *peer;
+	struct sk_buff *msg;
+	void *hdr;
+	int ret;
+
+	peer = ovpn_peer_get(ovpn);
+	if (!peer)
+		return -ENOENT;
+
+	msg = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!msg) {
+		ret = -ENOMEM;
+		goto err_put_peer;
+	}
+
+	hdr = genlmsg_put(msg, info->snd_portid, info->snd_seq,
+			  &ovpn_netlink_family, 0, OVPN_CMD_GET_PEER);
+	if (!hdr) {
+		ret = -ENOBUFS;
+		goto err_free_msg;
+	}
+
+	ret = ovpn_netlink_fill_peer(msg, peer);
+	if (ret < 0)
+		goto err_free_msg;
+
+	genlmsg_end(msg, hdr);
 	ovpn_peer_put(peer);
+
+	return genlmsg_reply(msg, info);
+
+err_free_msg:
+	nlmsg_free(msg);
+err_put_peer:
+	ovpn_peer_put(peer);
+	return ret;
+}
+
+static int ovpn_netlink_fill_key_stats(struct sk_buff *skb,
+				       struct netlink_callback *cb,
+				       struct ovpn_struct *ovpn,
+				       enum ovpn_key_slot slot,
+				       struct ovpn_crypto_key_slot *ks)
+{
+	struct ovpn_crypto_key_slot_stats stats;
+	struct nlattr *attr;
+	void *hdr;
+
+	hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+			  &ovpn_netlink_family, NLM_F_MULTI,
+			  OVPN_CMD_GET_KEY_STATS);
+	if (!hdr)
+		return -EMSGSIZE;
+
+	ovpn_crypto_key_slot_stats_read(ks, &stats);
+
+	if (nla_put_u32(skb, OVPN_ATTR_IFINDEX, ovpn->dev->ifindex) ||
+	    nla_put_u8(skb, OVPN_ATTR_KEY_SLOT, slot) ||
+	    nla_put_u16(skb, OVPN_ATTR_KEY_ID, ks->key_id))
+		goto err_cancel;
+
+	attr = nla_nest_start(skb, OVPN_ATTR_KEY_STATS);
+	if (!attr)
+		goto err_cancel;
+
+	if (nla_put_u64_64bit(skb, OVPN_KEY_STATS_ATTR_RX_PACKETS,
+			      stats.rx_packets, OVPN_KEY_STATS_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, OVPN_KEY_STATS_ATTR_RX_BYTES,
+			      stats.rx_bytes, OVPN_KEY_STATS_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, OVPN_KEY_STATS_ATTR_TX_PACKETS,
+			      stats.tx_packets, OVPN_KEY_STATS_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, OVPN_KEY_STATS_ATTR_TX_BYTES,
+			      stats.tx_bytes, OVPN_KEY_STATS_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, OVPN_KEY_STATS_ATTR_AUTH_FAIL,
+			      stats.rx_auth_fail, OVPN_KEY_STATS_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, OVPN_KEY_STATS_ATTR_REPLAY,
+			      stats.rx_replay, OVPN_KEY_STATS_ATTR_PAD) ||
+	    nla_put_u32(skb, OVPN_KEY_STATS_ATTR_IDLE_MS,
+			jiffies_to_msecs(jiffies - READ_ONCE(ks->last_used))) ||
+	    nla_put_u64_64bit(skb, OVPN_KEY_STATS_ATTR_TX_PKTID,
+			      atomic64_read(&ks->pid_xmit.seq_num),
+			      OVPN_KEY_STATS_ATTR_PAD) ||
+	    nla_put_u32(skb, OVPN_KEY_STATS_ATTR_REPLAY_WINDOW,
+			READ_ONCE(ks->pid_recv.size)) ||
+	    nla_put_u32(skb, OVPN_KEY_STATS_ATTR_MAX_BACKTRACK,
+			READ_ONCE(ks->pid_recv.max_backtrack)))
+		goto err_cancel;
+
+	nla_nest_end(skb, attr);
+	genlmsg_end(skb, hdr);
+
 	return 0;
+
+err_cancel:
+	genlmsg_cancel(skb, hdr);
+	return -EMSGSIZE;
+}
+
+/* dump the key slots of one interface, starting from *slot. On failure *slot
+ * is left pointing to the slot that did not fit in the message
+ */
+static int ovpn_netlink_dump_keys(struct sk_buff *skb,
+				  struct netlink_callback *cb,
+				  struct ovpn_struct *ovpn, int *slot)
+{
+	struct ovpn_crypto_key_slot *ks;
+	struct ovpn_peer *peer;
+	int ret = 0;
+
+	peer = ovpn_peer_get(ovpn);
+	if (!peer)
+		return 0;
+
+	for (; *slot < __OVPN_KEY_SLOT_AFTER_LAST; (*slot)++) {
+		if (*slot == OVPN_KEY_SLOT_PRIMARY)
+			ks = ovpn_crypto_key_slot_primary(&peer->crypto);
+		else
+			ks = ovpn_crypto_key_slot_secondary(&peer->crypto);
+		if (!ks)
+			continue;
+
+		ret = ovpn_netlink_fill_key_stats(skb, cb, ovpn, *slot, ks);
+		ovpn_crypto_key_slot_put(ks);
+		if (ret < 0)
+			break;
+	}
+
+	ovpn_peer_put(peer);
+	return ret;
+}
+
+static int ovpn_netlink_dump_key_stats(struct sk_buff *skb,
+				       struct netlink_callback *cb)
+{
+	struct net *net = sock_net(cb->skb->sk);
+	struct nlattr *attrs[OVPN_ATTR_MAX + 1];
+	int idx = 0, s_idx = cb->args[0];
+	int slot = cb->args[1];
+	struct net_device *dev;
+	u32 ifindex = 0;
+	int ret;
+
+	ret = nlmsg_parse_deprecated(cb->nlh, GENL_HDRLEN, attrs, OVPN_ATTR_MAX,
+				     ovpn_netlink_policy, cb->extack);
+	if (ret < 0)
+		return ret;
+
+	if (attrs[OVPN_ATTR_IFINDEX])
+		ifindex = nla_get_u32(attrs[OVPN_ATTR_IFINDEX]);
+
+	rcu_read_lock();
+	for_each_netdev_rcu(net, dev) {
+		if (!ovpn_dev_is_valid(dev))
+			continue;
+		if (ifindex && dev->ifindex != ifindex)
+			continue;
+		if (idx < s_idx) {
+			idx++;
+			continue;
+		}
+
+		if (ovpn_netlink_dump_keys(skb, cb, netdev_priv(dev), &slot) < 0)
+			break;
+
+		slot = 0;
+		idx++;
+	}
+	rcu_read_unlock();
+
+	cb->args[0] = idx;
+	cb->args[1] = slot;
+
+	return skb->len;
+}
+
+/* entry of the OVPN_CMD_GET_TOP_PEERS ranking */
+struct ovpn_top_peer {
+	struct ovpn_peer_rates rates;
+	u64 key;
+	int ifindex;
+};
+
+static int ovpn_top_peer_cmp(const void *a, const void *b)
+{
+	const struct ovpn_top_peer *pa = a, *pb = b;
+
+	if (pa->key == pb->key)
+		return 0;
+
+	return pa->key < pb->key ? 1 : -1;
+}
+
+/* Select the n busiest peers of net into top, sorted by decreasing rate.
+ * Only the current minimum of top has to be looked at for most peers, so
+ * this stays linear in the number of peers.
+ *
+ * Return the number of entries filled
+ */
+static unsigned int ovpn_top_peers_collect(struct net *net,
+					   struct ovpn_top_peer *top,
+					   unsigned int n,
+					   enum ovpn_top_peers_sort by)
+{
+	unsigned int count = 0, min = 0, i;
+	struct ovpn_top_peer cur;
+	struct ovpn_struct *ovpn;
+	struct net_device *dev;
+	struct ovpn_peer *peer;
+
+	rcu_read_lock();
+	for_each_netdev_rcu(net, dev) {
+		if (!ovpn_dev_is_valid(dev))
+			continue;
+
+		ovpn = netdev_priv(dev);
+		peer = rcu_dereference(ovpn->peer);
+		if (!peer)
+			continue;
+
+		ovpn_peer_stats_get_rates(&peer->stats, &cur.rates);
+		if (by == OVPN_TOP_PEERS_SORT_PPS)
+			cur.key = cur.rates.rx_pps + cur.rates.tx_pps;
+		else
+			cur.key = cur.rates.rx_bps + cur.rates.tx_bps;
+		cur.ifindex = dev->ifindex;
+
+		if (count < n) {
+			top[count] = cur;
+			if (cur.key < top[min].key)
+				min = count;
+			count++;
+			continue;
+		}
+
+		if (cur.key <= top[min].key)
+			continue;
+
+		top[min] = cur;
+		for (i = 0; i < count; i++)
+			if (top[i].key < top[min].key)
+				min = i;
+	}
+	rcu_read_unlock();
+
+	sort(top, count, sizeof(*top), ovpn_top_peer_cmp, NULL);
+
+	return count;
+}
+
+static int ovpn_netlink_fill_top_peer(struct sk_buff *skb,
+				      struct netlink_callback *cb,
+				      const struct ovpn_top_peer *top)
+{
+	void *hdr;
+
+	hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+			  &ovpn_netlink_family, NLM_F_MULTI,
+			  OVPN_CMD_GET_TOP_PEERS);
+	if (!hdr)
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, OVPN_ATTR_IFINDEX, top->ifindex) ||
+	    ovpn_netlink_fill_rates(skb, &top->rates)) {
+		genlmsg_cancel(skb, hdr);
+		return -EMSGSIZE;
+	}
+
+	genlmsg_end(skb, hdr);
+	return 0;
+}
+
+/* The ranking is computed again if the reply does not fit in one message:
+ * cb->args[0] is the number of entries already sent, cb->args[1] is set
+ * once all of them were
+ */
+static int ovpn_netlink_dump_top_peers(struct sk_buff *skb,
+				       struct netlink_callback *cb)
+{
+	enum ovpn_top_peers_sort by = OVPN_TOP_PEERS_SORT_BPS;
+	struct net *net = sock_net(cb->skb->sk);
+	unsigned int n = OVPN_TOP_PEERS_DEFAULT;
+	struct nlattr *attrs[OVPN_ATTR_MAX + 1];
+	struct ovpn_top_peer *top;
+	unsigned int count, i;
+	int ret;
+
+	if (cb->args[1])
+		return 0;
+
+	ret = nlmsg_parse_deprecated(cb->nlh, GENL_HDRLEN, attrs, OVPN_ATTR_MAX,
+				     ovpn_netlink_policy, cb->extack);
+	if (ret < 0)
+		return ret;
+
+	if (attrs[OVPN_ATTR_TOP_PEERS_N])
+		n = nla_get_u32(attrs[OVPN_ATTR_TOP_PEERS_N]);
+	if (attrs[OVPN_ATTR_TOP_PEERS_SORT])
+		by = nla_get_u8(attrs[OVPN_ATTR_TOP_PEERS_SORT]);
+
+	top = kcalloc(n, sizeof(*top), GFP_KERNEL);
+	if (!top)
+		return -ENOMEM;
+
+	count = ovpn_top_peers_collect(net, top, n, by);
+
+	for (i = cb->args[0]; i < count; i++)
+		if (ovpn_netlink_fill_top_peer(skb, cb, &top[i]) < 0)
+			break;
+
+	kfree(top);
+
+	cb->args[0] = i;
+	if (i >= count)
+		cb->args[1] = 1;
+
+	return skb->len;
 }
 
 /**
@@ -422,10 +1045,11 @@ static int ovpn_netlink_set_peer(struct sk_buff *skb, struct genl_info *info)
 static int ovpn_netlink_start_vpn(struct sk_buff *skb, struct genl_info *info)
 {
 	struct ovpn_struct *ovpn = info->user_ptr[0];
+	bool shared = false, steering = false;
 	enum ovpn_proto proto;
 	enum ovpn_mode mode;
 	struct socket *sock;
-	u32 sockfd;
+	u32 sockfd, peer_id;
 	int ret;
 
 	if (!info->attrs[OVPN_ATTR_SOCKET] ||
@@ -451,13 +1075,36 @@ static int ovpn_netlink_start_vpn(struct sk_buff *skb, struct genl_info *info)
 		return -EOPNOTSUPP;
 	}
 
+	/* a peer-id means that the UDP socket may be shared with other
+	 * interfaces: incoming data packets are dispatched based on it
+	 */
+	if (info->attrs[OVPN_ATTR_REMOTE_PEER_ID]) {
+		peer_id = nla_get_u32(info->attrs[OVPN_ATTR_REMOTE_PEER_ID]);
+		if (peer_id >= OVPN_OP_PEER_ID_UNDEF)
+			return -EINVAL;
+		ovpn->peer_id = peer_id;
+		shared = true;
+	}
+
+	/* RX steering is configured per interface and applies to the whole
+	 * session
+	 */
+	if (info->attrs[OVPN_ATTR_RX_CPUMASK]) {
+		ret = ovpn_netlink_set_rx_cpumask(ovpn,
+						  info->attrs[OVPN_ATTR_RX_CPUMASK]);
+		if (ret < 0)
+			goto err;
+		steering = true;
+	}
+
 	/* lookup the fd in the kernel table and extract the socket object */
 	sockfd = nla_get_u32(info->attrs[OVPN_ATTR_SOCKET]);
 	/* sockfd_lookup() increases sock's refcounter */
 	sock = sockfd_lookup(sockfd, &ret);
 	if (!sock) {
 		pr_debug("%s: cannot lookup socket passed from userspace: %d\n", __func__, ret);
-		return -ENOTSOCK;
+		ret = -ENOTSOCK;
+		goto err;
 	}
 
 	/* make sure the transport protocol matches the socket protocol */
@@ -465,7 +1112,7 @@ static int ovpn_netlink_start_vpn(struct sk_buff *skb, struct genl_info *info)
 	case IPPROTO_UDP:
 		if (proto == OVPN_PROTO_UDP4 || proto == OVPN_PROTO_UDP6) {
 			/* customize sock's internals for ovpn encapsulation */
-			ret = ovpn_sock_attach_udp(sock, ovpn);
+			ret = ovpn_sock_attach_udp(sock, ovpn, shared);
 			if (ret < 0)
 				goto sockfd_release;
 			break;
@@ -475,6 +1122,9 @@ static int ovpn_netlink_start_vpn(struct sk_buff *skb, struct genl_info *info)
 		ret = -EINVAL;
 		goto sockfd_release;
 	case IPPROTO_TCP:
+#if IS_ENABLED(CONFIG_MPTCP)
+	case IPPROTO_MPTCP:
+#endif
 		if (proto == OVPN_PROTO_TCP4 || proto == OVPN_PROTO_TCP6)
 			break;
 
@@ -497,6 +1147,12 @@ static int ovpn_netlink_start_vpn(struct sk_buff *skb, struct genl_info *info)
 
 sockfd_release:
 	sockfd_put(sock);
+err:
+	/* the session did not start: don't leave its settings behind */
+	if (steering)
+		ovpn_rx_steering_clear(ovpn);
+	if (shared)
+		ovpn->peer_id = 0;
 	return ret;
 }
 
@@ -510,7 +1166,7 @@ static int ovpn_netlink_stop_vpn(struct sk_buff *skb, struct genl_info *info)
 		return -EINVAL;
 
 	ovpn->sock = NULL;
-	ovpn_sock_detach(sock);
+	ovpn_sock_detach(ovpn, sock);
 
 	spin_lock_bh(&ovpn->lock);
 	peer = rcu_replace_pointer(ovpn->peer, NULL,
@@ -596,6 +1252,24 @@ static const struct genl_ops ovpn_netlink_ops[] = {
 		.flags = GENL_ADMIN_PERM,
 		.doit = ovpn_netlink_set_peer,
 	},
+	{
+		.cmd = OVPN_CMD_GET_PEER,
+		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+		.flags = GENL_ADMIN_PERM,
+		.doit = ovpn_netlink_get_peer,
+	},
+	{
+		.cmd = OVPN_CMD_GET_KEY_STATS,
+		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+		.flags = GENL_ADMIN_PERM,
+		.dumpit = ovpn_netlink_dump_key_stats,
+	},
+	{
+		.cmd = OVPN_CMD_GET_TOP_PEERS,
+		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+		.flags = GENL_ADMIN_PERM,
+		.dumpit = ovpn_netlink_dump_top_peers,
+	},
 	{
 		.cmd = OVPN_CMD_NEW_KEY,
 		.validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
@@ -686,6 +1360,49 @@ err_free_msg:
 	return ret;
 }
 
+/* May be invoked from the datapath, therefore no sleeping allocation */
+int ovpn_netlink_notify_pktid_wrap_warn(struct ovpn_peer *peer, u16 key_id)
+{
+	struct sk_buff *msg;
+	void *hdr;
+	int ret;
+
+	pr_info("%s: packet ID of key %u is about to wrap\n",
+		peer->ovpn->dev->name, key_id);
+
+	msg = nlmsg_new(100, GFP_ATOMIC);
+	if (!msg)
+		return -ENOMEM;
+
+	hdr = genlmsg_put(msg, 0, 0, &ovpn_netlink_family, 0,
+			  OVPN_CMD_PKTID_WRAP_WARN);
+	if (!hdr) {
+		ret = -ENOBUFS;
+		goto err_free_msg;
+	}
+
+	if (nla_put_u32(msg, OVPN_ATTR_IFINDEX, peer->ovpn->dev->ifindex)) {
+		ret = -EMSGSIZE;
+		goto err_free_msg;
+	}
+
+	if (nla_put_u16(msg, OVPN_ATTR_KEY_ID, key_id)) {
+		ret = -EMSGSIZE;
+		goto err_free_msg;
+	}
+
+	genlmsg_end(msg, hdr);
+
+	genlmsg_multicast_netns(&ovpn_netlink_family, dev_net(peer->ovpn->dev),
+				msg, 0, OVPN_MCGRP_PEERS, GFP_ATOMIC);
+
+	return 0;
+
+err_free_msg:
+	nlmsg_free(msg);
+	return ret;
+}
+
 int ovpn_netlink_send_packet(struct ovpn_struct *ovpn, const uint8_t *buf,
 			     size_t len)
 {
@@ -727,6 +1444,45 @@ err_free_msg:
 	return ret;
 }
 
+/* Start a new OVPN_CMD_SAMPLES batch. May be invoked from the datapath,
+ * therefore no sleeping allocation
+ */
+struct sk_buff *ovpn_netlink_samples_new(struct ovpn_struct *ovpn, void **hdr)
+{
+	struct sk_buff *msg;
+
+	msg = nlmsg_new(NLMSG_GOODSIZE, GFP_ATOMIC);
+	if (!msg)
+		return NULL;
+
+	*hdr = genlmsg_put(msg, 0, 0, &ovpn_netlink_family, 0,
+			   OVPN_CMD_SAMPLES);
+	if (!*hdr)
+		goto err_free_msg;
+
+	if (nla_put_u32(msg, OVPN_ATTR_IFINDEX, ovpn->dev->ifindex))
+		goto err_free_msg;
+
+	return msg;
+
+err_free_msg:
+	nlmsg_free(msg);
+	return NULL;
+}
+
+/* send out a batch completed with genlmsg_end() */
+void ovpn_netlink_samples_send(struct ovpn_struct *ovpn, struct sk_buff *msg)
+{
+	genlmsg_multicast_netns(&ovpn_netlink_family, dev_net(ovpn->dev), msg,
+				0, OVPN_MCGRP_SAMPLES, GFP_ATOMIC);
+}
+
+bool ovpn_netlink_samples_listened(struct ovpn_struct *ovpn)
+{
+	return genl_has_listeners(&ovpn_netlink_family, dev_net(ovpn->dev),
+				  OVPN_MCGRP_SAMPLES);
+}
+
 static int ovpn_netlink_notify(struct notifier_block *nb, unsigned long state,
 			       void *_notify)
 {
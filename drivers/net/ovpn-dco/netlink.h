@@ -15,5 +15,9 @@ void ovpn_netlink_unregister(void);
 int ovpn_netlink_send_packet(struct ovpn_struct *ovpn, const uint8_t *buf,
 			     size_t len);
 int ovpn_netlink_notify_del_peer(struct ovpn_peer *peer);
+int ovpn_netlink_notify_pktid_wrap_warn(struct ovpn_peer *peer, u16 key_id);
+struct sk_buff *ovpn_netlink_samples_new(struct ovpn_struct *ovpn, void **hdr);
+void ovpn_netlink_samples_send(struct ovpn_struct *ovpn, struct sk_buff *msg);
+bool ovpn_netlink_samples_listened(struct ovpn_struct *ovpn);
 
 #endif /* _NET_OVPN_DCO_NETLINK_H_ */
@@ -15,13 +15,23 @@
 #include "stats_counters.h"
 #include "proto.h"
 #include "crypto.h"
+#include "echo.h"
+#include "fq.h"
+#include "mssfix.h"
+#include "sample.h"
 #include "skb.h"
+#include "steering.h"
 #include "tcp.h"
 #include "udp.h"
 
+#include <linux/jhash.h>
 #include <linux/workqueue.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
 #include <uapi/linux/if_ether.h>
 
+static u32 ovpn_flow_seed __read_mostly;
+
 static const unsigned char ovpn_keepalive_message[] = {
 	0x2a, 0x18, 0x7b, 0xf3, 0x64, 0x1e, 0xb4, 0xcb,
 	0x07, 0xed, 0x2d, 0x0a, 0x98, 0x1f, 0xc7, 0x48
@@ -78,10 +88,18 @@ int ovpn_struct_init(struct net_device *dev)
 	if (!dev->tstats)
 		return -ENOMEM;
 
+	ovpn->crypto_path = alloc_percpu(struct ovpn_crypto_path_stats);
+	if (!ovpn->crypto_path)
+		return -ENOMEM;
+
 	err = security_tun_dev_alloc_security(&ovpn->security);
 	if (err < 0)
 		return err;
 
+	err = ovpn_sample_init(ovpn);
+	if (err < 0)
+		return err;
+
 	/* kernel -> userspace tun queue length */
 	ovpn->max_tun_queue_len = OVPN_MAX_TUN_QUEUE_LEN;
 
@@ -99,9 +117,6 @@ static void tun_netdev_write(struct ovpn_peer *peer, struct sk_buff *skb)
 	skb->ip_summed = CHECKSUM_UNNECESSARY;
 	skb->csum_level = ~0;
 
-	/* skb hash for transport packet no longer valid after decapsulation */
-	skb_clear_hash(skb);
-
 	/* post-decrypt scrub -- prepare to inject encapsulated packet onto tun
 	 * interface, based on __skb_tunnel_rx() in dst.h
 	 */
@@ -109,17 +124,140 @@ static void tun_netdev_write(struct ovpn_peer *peer, struct sk_buff *skb)
 	skb_set_queue_mapping(skb, 0);
 	skb_scrub_packet(skb, true);
 
-	/* set transport header */
-	skb->transport_header = 0;
-	skb_probe_transport_header(skb);
+	/* set transport header as found by ovpn_skb_parse_inner() */
+	skb_set_transport_header(skb, skb_network_offset(skb) +
+				      OVPN_SKB_CB(skb)->thoff);
 
 	/* update per-cpu RX stats with the stored size of encrypted packet */
 
 	/* we are in softirq context - hence no locking nor disable preemption needed */
 	dev_sw_netstats_rx_add(peer->ovpn->dev, OVPN_SKB_CB(skb)->rx_stats_size);
 
-	/* cause packet to be "received" by tun interface */
-	napi_gro_receive(&peer->napi, skb);
+	/* hand the packet over to the CPU processing its inner flow, if
+	 * configured, otherwise let it be "received" by tun interface here
+	 */
+	if (!ovpn_rx_steer(peer->ovpn, skb))
+		napi_gro_receive(&peer->napi, skb);
+}
+
+/* Consumers of the crypto rings stay marked in *inflight for as long as they
+ * hold packets taken from the ring, so that inline processing cannot overtake
+ * them
+ */
+static void ovpn_inflight_start(atomic_t *inflight)
+{
+	atomic_inc(inflight);
+	/* pairs with smp_rmb() in ovpn_inflight_idle() */
+	smp_mb__after_atomic();
+}
+
+static void ovpn_inflight_end(atomic_t *inflight)
+{
+	smp_mb__before_atomic();
+	atomic_dec(inflight);
+}
+
+/* true if nothing is queued in ring nor being processed by its consumers.
+ * Rings are never resized: no lock needed to test for emptiness
+ */
+static bool ovpn_inflight_idle(struct ptr_ring *ring, atomic_t *inflight)
+{
+	if (!__ptr_ring_empty(ring))
+		return false;
+
+	/* a packet missing from the ring was taken by a consumer that
+	 * already bumped inflight
+	 */
+	smp_rmb();
+	return !atomic_read(inflight);
+}
+
+/* Check if a received packet can be decrypted in softirq context.
+ *
+ * For data packets the key slot is returned in *ksp and must be handed to
+ * ovpn_decrypt_one(), so that a key swap cannot replace it with an async one
+ * between the check and the decryption. Packets without a key are left to
+ * decrypt_work.
+ */
+static bool ovpn_rx_skb_sync(struct ovpn_peer *peer, struct sk_buff *skb,
+			     struct ovpn_crypto_key_slot **ksp)
+{
+	struct ovpn_crypto_key_slot *ks;
+	u32 op;
+
+	*ksp = NULL;
+
+	op = ovpn_op32_from_skb(skb, NULL);
+	/* control packets are only copied to userspace */
+	if (!ovpn_opcode_is_data_v2(op))
+		return true;
+
+	ks = ovpn_crypto_key_id_to_slot(&peer->crypto, ovpn_key_id_extract(op));
+	if (!ks)
+		return false;
+
+	if (!ovpn_crypto_key_slot_sync(ks)) {
+		ovpn_crypto_key_slot_put(ks);
+		return false;
+	}
+
+	*ksp = ks;
+	return true;
+}
+
+/* Check if a received packet can be decrypted right away instead of paying
+ * for a trip through decrypt_work: it must be small, have nothing queued or
+ * being decrypted ahead of it and use a synchronous key slot, which is
+ * returned in *ksp
+ */
+static bool ovpn_rx_inline(struct ovpn_peer *peer, struct sk_buff *skb,
+			   struct ovpn_crypto_key_slot **ksp)
+{
+	if (!ovpn_crypto_inline_len(skb->len))
+		return false;
+
+	if (!ovpn_inflight_idle(&peer->rx_ring, &peer->rx_inflight))
+		return false;
+
+	/* control packets are passed to userspace by decrypt_work */
+	if (!ovpn_opcode_is_data_v2(ovpn_op32_from_skb(skb, NULL)))
+		return false;
+
+	return ovpn_rx_skb_sync(peer, skb, ksp);
+}
+
+static int ovpn_decrypt_one(struct ovpn_peer *peer, struct sk_buff *skb,
+			    struct ovpn_crypto_key_slot *ks);
+
+/* Decrypt the next packet in the RX queue from within NAPI, instead of
+ * waiting for decrypt_work to be scheduled. Packets requiring an async
+ * transform are left to decrypt_work.
+ *
+ * Return true if a packet was taken from the queue.
+ */
+static bool ovpn_napi_decrypt_one(struct ovpn_peer *peer)
+{
+	struct ovpn_crypto_key_slot *ks;
+	struct sk_buff *skb;
+
+	ovpn_inflight_start(&peer->rx_inflight);
+
+	spin_lock(&peer->rx_ring.consumer_lock);
+	skb = __ptr_ring_peek(&peer->rx_ring);
+	if (skb && ovpn_rx_skb_sync(peer, skb, &ks))
+		__ptr_ring_discard_one(&peer->rx_ring);
+	else
+		skb = NULL;
+	spin_unlock(&peer->rx_ring.consumer_lock);
+
+	if (skb) {
+		this_cpu_inc(peer->ovpn->crypto_path->rx[OVPN_CRYPTO_PATH_INLINE]);
+		ovpn_decrypt_one(peer, skb, ks);
+	}
+
+	ovpn_inflight_end(&peer->rx_inflight);
+
+	return !!skb;
 }
 
 int ovpn_napi_poll(struct napi_struct *napi, int budget)
@@ -135,8 +273,19 @@ int ovpn_napi_poll(struct napi_struct *napi, int budget)
 	 * If in the queue we have more packets than what allowed by the
 	 * budget, the next polling will take care of those
 	 */
-	while ((work_done < budget) &&
-	       (skb = __ptr_ring_consume(&peer->netif_rx_ring))) {
+	while (work_done < budget) {
+		skb = __ptr_ring_consume(&peer->netif_rx_ring);
+		if (!skb) {
+			/* an application is busy polling this NAPI: rather
+			 * than letting it spin until decrypt_work gets to run,
+			 * decrypt pending packets right here
+			 */
+			if (!test_bit(NAPI_STATE_IN_BUSY_POLL, &napi->state) ||
+			    !ovpn_napi_decrypt_one(peer))
+				break;
+			continue;
+		}
+
 		tun_netdev_write(peer, skb);
 		work_done++;
 	}
@@ -172,8 +321,22 @@ static int ovpn_transport_to_userspace(struct ovpn_struct *ovpn,
 bool ovpn_recv(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
 	       struct sk_buff *skb)
 {
+	struct ovpn_crypto_key_slot *ks;
 	int ret;
 
+	if (ovpn_rx_inline(peer, skb, &ks)) {
+		this_cpu_inc(ovpn->crypto_path->rx[OVPN_CRYPTO_PATH_INLINE]);
+
+		/* the TCP transport calls us from process context */
+		local_bh_disable();
+		if (ovpn_decrypt_one(peer, skb, ks) == 0)
+			napi_schedule(&peer->napi);
+		local_bh_enable();
+
+		ovpn_peer_put(peer);
+		return true;
+	}
+
 	ret = __ptr_ring_produce(&peer->rx_ring, skb);
 	if (ret < 0) {
 		ovpn_peer_put(peer);
@@ -186,11 +349,135 @@ bool ovpn_recv(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
 	return true;
 }
 
-static int ovpn_decrypt_one(struct ovpn_peer *peer, struct sk_buff *skb)
+/* max distance of a packet ID ahead of the highest one received for a packet
+ * to be accepted for decryption while the peer is under probation. A spoofed
+ * packet carrying a random ID is very unlikely to fall in range
+ */
+#define OVPN_PROBATION_PKTID_AHEAD (REPLAY_WINDOW_MAX / 2)
+
+/* return true if the packet ID of a not yet authenticated packet is worth
+ * trying to decrypt the packet
+ */
+static bool ovpn_decrypt_precheck(struct ovpn_crypto_key_slot *ks,
+				  struct sk_buff *skb)
 {
-	struct ovpn_crypto_key_slot *ks;
+	__be32 *pid;
+
+	if (unlikely(!pskb_may_pull(skb, OVPN_OP_SIZE_V2 + sizeof(*pid))))
+		return false;
+
+	/* PID sits after the op */
+	pid = (__force __be32 *)(skb->data + OVPN_OP_SIZE_V2);
+	return ovpn_pktid_recv_plausible(&ks->pid_recv, ntohl(*pid),
+					 OVPN_PROBATION_PKTID_AHEAD);
+}
+
+/* Parse the headers of a decrypted packet once for all the following stages.
+ * Offset and protocol of the transport header are stored in the skb cb, while
+ * a flow hash replaces the one of the transport packet, so that neither RX
+ * steering nor the stack need to run the flow dissector on the packet.
+ *
+ * Return the L3 protocol or 0 if the packet is not an IP packet.
+ */
+static __be16 ovpn_skb_parse_inner(struct sk_buff *skb)
+{
+	const struct ipv6hdr *ip6h;
+	const struct iphdr *iph;
+	u32 saddr, daddr, hash;
+	__be32 _ports, *ports;
+	u32 l4_ports = 0;
+	__be16 proto, frag_off = 0;
+	unsigned int thoff;
+	bool l4 = false;
+	u8 l4proto;
+	int off;
+
+	proto = ovpn_ip_check_protocol(skb);
+	switch (proto) {
+	case htons(ETH_P_IP):
+		iph = ip_hdr(skb);
+		thoff = iph->ihl * 4;
+		if (unlikely(thoff < sizeof(*iph) ||
+			     !pskb_network_may_pull(skb, thoff)))
+			return 0;
+
+		iph = ip_hdr(skb);
+		saddr = (__force u32)iph->saddr;
+		daddr = (__force u32)iph->daddr;
+		l4proto = iph->protocol;
+		/* all fragments of a datagram must hash the same */
+		l4 = !ip_is_fragment(iph);
+		break;
+	case htons(ETH_P_IPV6):
+		if (unlikely(!pskb_network_may_pull(skb, sizeof(*ip6h))))
+			return 0;
+
+		ip6h = ipv6_hdr(skb);
+		saddr = ipv6_addr_hash(&ip6h->saddr);
+		daddr = ipv6_addr_hash(&ip6h->daddr);
+		l4proto = ip6h->nexthdr;
+		thoff = sizeof(*ip6h);
+		l4 = true;
+
+		if (ipv6_ext_hdr(l4proto)) {
+			/* non-first fragments stop at the fragment header */
+			off = ipv6_skip_exthdr(skb, skb_network_offset(skb) +
+						    thoff, &l4proto, &frag_off);
+			if (off < 0) {
+				l4proto = NEXTHDR_NONE;
+				l4 = false;
+			} else {
+				thoff = off - skb_network_offset(skb);
+			}
+
+			/* all fragments of a datagram must hash the same */
+			if (frag_off)
+				l4 = false;
+		}
+		break;
+	default:
+		return 0;
+	}
+
+	switch (l4proto) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_SCTP:
+		break;
+	default:
+		l4 = false;
+	}
+
+	if (l4) {
+		ports = skb_header_pointer(skb, skb_network_offset(skb) + thoff,
+					   sizeof(_ports), &_ports);
+		if (ports)
+			l4_ports = (__force u32)*ports;
+		else
+			l4 = false;
+	}
+
+	net_get_random_once(&ovpn_flow_seed, sizeof(ovpn_flow_seed));
+	hash = jhash_3words(saddr, daddr, l4_ports, ovpn_flow_seed);
+	__skb_set_sw_hash(skb, hash, l4);
+
+	OVPN_SKB_CB(skb)->thoff = thoff;
+	OVPN_SKB_CB(skb)->l4proto = l4proto;
+
+	return proto;
+}
+
+/* Decrypt a received packet and queue it for NAPI. ks is the key slot
+ * already taken by inline callers (its reference is consumed), NULL when
+ * called by decrypt_work
+ */
+static int ovpn_decrypt_one(struct ovpn_peer *peer, struct sk_buff *skb,
+			    struct ovpn_crypto_key_slot *ks)
+{
+	enum ovpn_crypto_path path;
 	unsigned int rx_stats_size;
-	int key_id, ret = -1;
+	int key_id, peer_id, ret = -1;
 	__be16 proto;
 	u32 op;
 
@@ -218,17 +505,39 @@ static int ovpn_decrypt_one(struct ovpn_peer *peer, struct sk_buff *skb)
 
 	/* get the key slot matching the key Id in the received packet */
 	key_id = ovpn_key_id_extract(op);
-	ks = ovpn_crypto_key_id_to_slot(&peer->crypto, key_id);
-	if (unlikely(!ks))
+	if (!ks) {
+		ks = ovpn_crypto_key_id_to_slot(&peer->crypto, key_id);
+		if (unlikely(!ks))
+			goto drop;
+
+		path = ovpn_crypto_worker_path(ks->decrypt, ks->decrypt_sync,
+					       skb->len);
+		this_cpu_inc(peer->ovpn->crypto_path->rx[path]);
+	}
+
+	/* while under probation, do not waste time decrypting packets that
+	 * would be rejected anyway
+	 */
+	if (unlikely(ovpn_peer_probation(peer) &&
+		     !ovpn_decrypt_precheck(ks, skb))) {
+		atomic64_inc(&peer->probation.dropped);
+		ovpn_crypto_key_slot_put(ks);
+		ret = -EACCES;
 		goto drop;
+	}
 
 	/* decrypt */
-	ret = ks->ops->decrypt(ks, skb, op);
+	ret = ovpn_crypto_decrypt(ks, skb, op);
 
+	ovpn_crypto_key_slot_stats_rx(ks, ret, skb->len);
+	peer_id = ks->remote_peer_id;
 	ovpn_crypto_key_slot_put(ks);
 
 	if (unlikely(ret < 0)) {
-		pr_err("error during decryption: %d\n", ret);
+		if (ret == -EBADMSG)
+			ovpn_peer_auth_fail(peer);
+		net_dbg_ratelimited("%s: error during decryption: %d\n",
+				    peer->ovpn->dev->name, ret);
 		goto drop;
 	}
 
@@ -243,7 +552,7 @@ static int ovpn_decrypt_one(struct ovpn_peer *peer, struct sk_buff *skb)
 	 * tun interface
 	 */
 	skb_reset_network_header(skb);
-	proto = ovpn_ip_check_protocol(skb);
+	proto = ovpn_skb_parse_inner(skb);
 	if (unlikely(!proto)) {
 		/* check if null packet */
 		if (unlikely(!pskb_may_pull(skb, 1))) {
@@ -262,12 +571,21 @@ static int ovpn_decrypt_one(struct ovpn_peer *peer, struct sk_buff *skb)
 			return -1;
 		}
 
+		if (ovpn_echo_recv(peer, skb)) {
+			consume_skb(skb);
+			return -1;
+		}
+
 		ret = -EPROTONOSUPPORT;
 		goto drop;
 	}
 	skb->protocol = proto;
 
-	ret = __ptr_ring_produce(&peer->netif_rx_ring, skb);
+	ovpn_sample(peer, skb, OVPN_SAMPLE_DIR_RX, peer_id, key_id);
+	ovpn_mssfix_recv(peer, skb);
+
+	/* both decrypt_work and NAPI (when busy polling) may produce here */
+	ret = ptr_ring_produce_bh(&peer->netif_rx_ring, skb);
 drop:
 	if (unlikely(ret < 0))
 		kfree_skb(skb);
@@ -282,8 +600,10 @@ void ovpn_decrypt_work(struct work_struct *work)
 	struct sk_buff *skb;
 
 	peer = container_of(work, struct ovpn_peer, decrypt_work);
-	while ((skb = __ptr_ring_consume(&peer->rx_ring))) {
-		if (ovpn_decrypt_one(peer, skb) == 0) {
+	ovpn_inflight_start(&peer->rx_inflight);
+	/* NAPI may also consume from rx_ring while being busy polled */
+	while ((skb = ptr_ring_consume_bh(&peer->rx_ring))) {
+		if (ovpn_decrypt_one(peer, skb, NULL) == 0) {
 			/* if a packet has been enqueued for NAPI, signal
 			 * availability to the networking stack
 			 */
@@ -296,54 +616,191 @@ void ovpn_decrypt_work(struct work_struct *work)
 		if (need_resched())
 			cond_resched();
 	}
+	ovpn_inflight_end(&peer->rx_inflight);
 	ovpn_peer_put(peer);
 }
 
-static bool ovpn_encrypt_one(struct ovpn_peer *peer, struct sk_buff *skb)
+/* Encrypt a packet with the primary key slot. worker is false when called
+ * inline from softirq context: -EAGAIN is then returned, with the packet left
+ * untouched, if the key slot cannot be used synchronously
+ */
+static int ovpn_encrypt_one(struct ovpn_peer *peer, struct sk_buff *skb,
+			    const bool worker)
 {
 	struct ovpn_crypto_key_slot *ks;
-	bool success = false;
+	enum ovpn_crypto_path path;
+	unsigned int len;
 	int ret;
 
 	/* get primary key to be used for encrypting data */
 	ks = ovpn_crypto_key_slot_primary(&peer->crypto);
 	if (unlikely(!ks)) {
 		pr_err("error while retrieving primary key slot\n");
-		return false;
+		return -ENOKEY;
+	}
+
+	/* the slot checked by ovpn_tx_inline() may have been swapped meanwhile
+	 * for one without a synchronous transform
+	 */
+	if (unlikely(!worker && !ovpn_crypto_key_slot_sync(ks))) {
+		ret = -EAGAIN;
+		goto err;
 	}
 
 	/* init packet ID to undef in case we err before setting real value */
 	OVPN_SKB_CB(skb)->pktid = 0;
 
-	if (unlikely(skb->ip_summed == CHECKSUM_PARTIAL &&
-		     skb_checksum_help(skb)))
-		goto err;
+	if (unlikely(skb->ip_summed == CHECKSUM_PARTIAL)) {
+		ret = skb_checksum_help(skb);
+		if (unlikely(ret))
+			goto err;
+	}
+
+	ovpn_sample(peer, skb, OVPN_SAMPLE_DIR_TX, ks->remote_peer_id,
+		    ks->key_id);
+
+	if (worker) {
+		path = ovpn_crypto_worker_path(ks->encrypt, ks->encrypt_sync,
+					       skb->len);
+		this_cpu_inc(peer->ovpn->crypto_path->tx[path]);
+	}
 
 	/* encrypt */
-	ret = ks->ops->encrypt(ks, skb);
+	len = skb->len;
+	ret = ovpn_crypto_encrypt(ks, skb);
+	if (unlikely(ret == -E2BIG)) {
+		/* the primary key ran out of packet IDs: until userspace swaps
+		 * in the renegotiated key, keep the tunnel alive by encrypting
+		 * with the secondary slot, which the remote end already knows
+		 */
+		ovpn_crypto_key_slot_put(ks);
+		ks = ovpn_crypto_key_slot_secondary(&peer->crypto);
+		if (unlikely(!ks)) {
+			net_warn_ratelimited("%s: packet ID space exhausted and no secondary key available\n",
+					     peer->ovpn->dev->name);
+			return -E2BIG;
+		}
+
+		ret = ovpn_crypto_encrypt(ks, skb);
+	}
+
 	if (unlikely(ret < 0)) {
-		pr_err("error during encryption: %d\n", ret);
+		/* an async secondary slot: the packet is still untouched */
+		if (ret != -EAGAIN)
+			pr_err_ratelimited("error during encryption: %d\n",
+					   ret);
 		goto err;
 	}
 
-	success = true;
+	ovpn_crypto_key_slot_stats_tx(ks, len);
+
+	/* increment TX stats */
+	ovpn_peer_stats_increment_tx(peer, skb->len);
+
+	/* packet ID crossed the wrap-warn threshold: ask for a new key */
+	if (unlikely(ret > 0))
+		ovpn_netlink_notify_pktid_wrap_warn(peer, ks->key_id);
+
+	ret = 0;
 err:
 	ovpn_crypto_key_slot_put(ks);
-	return success;
+	return ret;
+}
+
+/* max number of packets taken from a single per-CPU TX ring before moving to
+ * the next one, so that a busy CPU cannot starve the others
+ */
+#define OVPN_TX_RING_BATCH 16
+
+/* Pull the next packet from the per-CPU TX rings, walking them round-robin
+ * starting from *cpu. Returns NULL once all the rings are empty.
+ */
+static struct sk_buff *ovpn_tx_ring_consume(struct ovpn_peer *peer, int *cpu,
+					    int *budget)
+{
+	struct sk_buff *skb;
+	int i;
+
+	for (i = 0; i <= nr_cpu_ids; i++) {
+		if (*budget > 0) {
+			skb = __ptr_ring_consume(per_cpu_ptr(peer->tx_ring,
+							     *cpu));
+			if (skb) {
+				(*budget)--;
+				return skb;
+			}
+		}
+
+		*cpu = cpumask_next(*cpu, cpu_possible_mask);
+		if (*cpu >= nr_cpu_ids)
+			*cpu = cpumask_first(cpu_possible_mask);
+		*budget = OVPN_TX_RING_BATCH;
+	}
+
+	return NULL;
+}
+
+/* Pull the next packet when flow queueing is enabled for the peer.
+ *
+ * Packets waiting in the TX rings are moved into the flow queues whenever
+ * these are empty or after OVPN_TX_RING_BATCH packets have been dequeued, so
+ * that newly active flows are seen quickly without having to scan all the
+ * rings for every packet. GSO lists are split and each segment is queued
+ * on its own.
+ */
+static struct sk_buff *ovpn_fq_next(struct ovpn_peer *peer, int *cpu,
+				    int *budget, unsigned int *dequeued)
+{
+	struct sk_buff *skb, *curr, *next;
+	struct ovpn_fq *fq = peer->fq;
+
+	if (!fq->qlen || ++(*dequeued) >= OVPN_TX_RING_BATCH) {
+		*dequeued = 0;
+
+		while (!ovpn_fq_full(fq) &&
+		       (skb = ovpn_tx_ring_consume(peer, cpu, budget))) {
+			skb_list_walk_safe(skb, curr, next) {
+				skb_mark_not_on_list(curr);
+				ovpn_fq_enqueue(fq, curr);
+			}
+		}
+	}
+
+	return ovpn_fq_dequeue(fq);
 }
 
 /* Process packets in TX queue in a transport-specific way.
  *
  * UDP transport - encrypt and send across the tunnel.
  * TCP transport - encrypt and put into TCP TX queue.
+ *
+ * Always inlined into one worker per transport, so that the transport is
+ * resolved when the work is initialized rather than for every packet.
  */
-void ovpn_encrypt_work(struct work_struct *work)
+static __always_inline void ovpn_encrypt_work_common(struct ovpn_peer *peer,
+						     const bool udp)
 {
+	int cpu = cpumask_first(cpu_possible_mask);
+	int budget = OVPN_TX_RING_BATCH;
 	struct sk_buff *skb, *curr, *next;
-	struct ovpn_peer *peer;
+	unsigned int dequeued = 0;
+
+	ovpn_inflight_start(&peer->tx_inflight);
+	while (1) {
+		/* lower device is backed up: stop encrypting packets that
+		 * would only be dropped. The socket write_space callback will
+		 * reschedule us
+		 */
+		if (udp && ovpn_udp_tx_throttle(peer))
+			break;
+
+		if (peer->fq)
+			skb = ovpn_fq_next(peer, &cpu, &budget, &dequeued);
+		else
+			skb = ovpn_tx_ring_consume(peer, &cpu, &budget);
+		if (!skb)
+			break;
 
-	peer = container_of(work, struct ovpn_peer, encrypt_work);
-	while ((skb = __ptr_ring_consume(&peer->tx_ring))) {
 		/* this might be a GSO-segmented skb list: process each skb
 		 * independently
 		 */
@@ -352,7 +809,7 @@ void ovpn_encrypt_work(struct work_struct *work)
 			 * packet, because it does not really make sense to send
 			 * only part of it at this point
 			 */
-			if (!ovpn_encrypt_one(peer, curr)) {
+			if (ovpn_encrypt_one(peer, curr, true) < 0) {
 				kfree_skb_list(skb);
 				skb = NULL;
 				break;
@@ -364,20 +821,10 @@ void ovpn_encrypt_work(struct work_struct *work)
 			skb_list_walk_safe(skb, curr, next) {
 				skb_mark_not_on_list(curr);
 
-				switch (peer->ovpn->proto) {
-				case OVPN_PROTO_UDP4:
-				case OVPN_PROTO_UDP6:
+				if (udp)
 					ovpn_udp_send_skb(peer->ovpn, peer, curr);
-					break;
-				case OVPN_PROTO_TCP4:
-				case OVPN_PROTO_TCP6:
+				else
 					ovpn_tcp_send_skb(peer, curr);
-					break;
-				default:
-					/* no transport configured yet */
-					consume_skb(skb);
-					break;
-				}
 			}
 		}
 
@@ -385,10 +832,73 @@ void ovpn_encrypt_work(struct work_struct *work)
 		if (need_resched())
 			cond_resched();
 	}
+	ovpn_inflight_end(&peer->tx_inflight);
 	ovpn_peer_put(peer);
 }
 
-/* Put skb into TX queue and schedule a consumer */
+void ovpn_encrypt_work_udp(struct work_struct *work)
+{
+	struct ovpn_peer *peer = container_of(work, struct ovpn_peer,
+					      encrypt_work);
+
+	ovpn_encrypt_work_common(peer, true);
+}
+
+void ovpn_encrypt_work_tcp(struct work_struct *work)
+{
+	struct ovpn_peer *peer = container_of(work, struct ovpn_peer,
+					      encrypt_work);
+
+	ovpn_encrypt_work_common(peer, false);
+}
+
+/* Check if a packet can be encrypted and sent right away on this CPU. Must be
+ * called with BH disabled
+ */
+static bool ovpn_tx_inline(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	struct ovpn_crypto_key_slot *ks;
+	bool sync;
+
+	if (skb->next || !ovpn_crypto_inline_len(skb->len))
+		return false;
+
+	/* flow queueing must see every packet, while TCP frames are queued
+	 * for the socket by the encrypt worker only
+	 */
+	if (peer->fq || peer->ovpn->proto == OVPN_PROTO_TCP4 ||
+	    peer->ovpn->proto == OVPN_PROTO_TCP6)
+		return false;
+
+	/* paced packets wait in the qdisc anyway: let encrypt_work stamp them
+	 * in queue order rather than racing with it from many CPUs
+	 */
+	if (READ_ONCE(peer->pacing.rate))
+		return false;
+
+	/* don't overtake packets queued on this CPU or still being encrypted
+	 * by encrypt_work
+	 */
+	if (!ovpn_inflight_idle(this_cpu_ptr(peer->tx_ring),
+				&peer->tx_inflight))
+		return false;
+
+	if (ovpn_udp_tx_throttle(peer))
+		return false;
+
+	ks = ovpn_crypto_key_slot_primary(&peer->crypto);
+	if (unlikely(!ks))
+		return false;
+
+	sync = ovpn_crypto_key_slot_sync(ks);
+	ovpn_crypto_key_slot_put(ks);
+
+	return sync;
+}
+
+/* Put skb into TX queue and schedule a consumer, or send it right away if it
+ * is small and nothing is pending
+ */
 static void ovpn_queue_skb(struct ovpn_struct *ovpn, struct sk_buff *skb)
 {
 	struct ovpn_peer *peer;
@@ -398,7 +908,28 @@ static void ovpn_queue_skb(struct ovpn_struct *ovpn, struct sk_buff *skb)
 	if (unlikely(!peer))
 		goto drop;
 
-	ret = __ptr_ring_produce(&peer->tx_ring, skb);
+	/* each CPU is the only producer of its own ring as long as BH is
+	 * disabled: this is already the case in ndo_start_xmit, but not when
+	 * sending the explicit-exit-notify from process context
+	 */
+	local_bh_disable();
+	if (ovpn_tx_inline(peer, skb)) {
+		ret = ovpn_encrypt_one(peer, skb, false);
+		/* on -EAGAIN the packet is left to encrypt_work */
+		if (likely(ret != -EAGAIN)) {
+			this_cpu_inc(ovpn->crypto_path->tx[OVPN_CRYPTO_PATH_INLINE]);
+			if (likely(!ret))
+				ovpn_udp_send_skb(ovpn, peer, skb);
+			else
+				kfree_skb(skb);
+			local_bh_enable();
+
+			ovpn_peer_put(peer);
+			return;
+		}
+	}
+	ret = __ptr_ring_produce(this_cpu_ptr(peer->tx_ring), skb);
+	local_bh_enable();
 	if (ret < 0)
 		goto drop;
 
@@ -456,6 +987,8 @@ netdev_tx_t ovpn_net_xmit(struct sk_buff *skb, struct net_device *dev)
 			goto drop_list;
 		}
 
+		ovpn_mssfix_xmit(ovpn, tmp);
+
 		__skb_queue_tail(&skb_list, tmp);
 	}
 	skb_list.prev->next = NULL;
@@ -474,11 +1007,11 @@ drop:
 }
 
 /* Encrypt and transmit a special message to peer, such as keepalive
- * or explicit-exit-notify.  Called from softirq context.
+ * or explicit-exit-notify.  Called from softirq or process context.
  * Assumes that caller holds a reference to peer.
  */
-static void ovpn_xmit_special(struct ovpn_peer *peer, const void *data,
-			      const unsigned int len)
+void ovpn_xmit_special(struct ovpn_peer *peer, const void *data,
+		       const unsigned int len)
 {
 	struct ovpn_struct *ovpn;
 	struct sk_buff *skb;
@@ -500,6 +1033,9 @@ static void ovpn_xmit_special(struct ovpn_peer *peer, const void *data,
 
 void ovpn_keepalive_xmit(struct ovpn_peer *peer)
 {
+	if (ovpn_echo_xmit(peer))
+		return;
+
 	ovpn_xmit_special(peer, ovpn_keepalive_message,
 			  sizeof(ovpn_keepalive_message));
 }
@@ -520,7 +1056,7 @@ void ovpn_explicit_exit_notify_xmit(struct ovpn_peer *peer)
  */
 int ovpn_send_data(struct ovpn_struct *ovpn, const u8 *data, size_t len)
 {
-	u16 skb_len = SKB_HEADER_LEN + len;
+	unsigned int skb_len = SKB_HEADER_LEN + len;
 	struct ovpn_peer *peer;
 	struct sk_buff *skb;
 	bool tcp = false;
@@ -27,6 +27,8 @@ int ovpn_struct_init(struct net_device *dev);
 u16 ovpn_select_queue(struct net_device *dev, struct sk_buff *skb,
 		      struct net_device *sb_dev);
 
+void ovpn_xmit_special(struct ovpn_peer *peer, const void *data,
+		       const unsigned int len);
 void ovpn_keepalive_xmit(struct ovpn_peer *peer);
 void ovpn_explicit_exit_notify_xmit(struct ovpn_peer *peer);
 
@@ -34,7 +36,8 @@ netdev_tx_t ovpn_net_xmit(struct sk_buff *skb, struct net_device *dev);
 
 bool ovpn_recv(struct ovpn_struct *ovpn, struct ovpn_peer *peer, struct sk_buff *skb);
 
-void ovpn_encrypt_work(struct work_struct *work);
+void ovpn_encrypt_work_udp(struct work_struct *work);
+void ovpn_encrypt_work_tcp(struct work_struct *work);
 void ovpn_decrypt_work(struct work_struct *work);
 int ovpn_napi_poll(struct napi_struct *napi, int budget);
 
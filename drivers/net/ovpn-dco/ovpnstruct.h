@@ -11,6 +11,7 @@
 #define _NET_OVPN_DCO_OVPNSTRUCT_H_
 
 #include "peer.h"
+#include "steering.h"
 
 #include <uapi/linux/ovpn_dco.h>
 #include <linux/spinlock.h>
@@ -35,7 +36,22 @@ struct ovpn_struct {
 	 * extended with a table later
 	 */
 	struct ovpn_peer __rcu *peer;
+	/* distribution of decrypted packets across CPUs, NULL if disabled */
+	struct ovpn_rx_steering __rcu *rx_steering;
+	/* per-CPU batches of sampled packets and their periodic flush */
+	struct ovpn_sample_cpu __percpu *sample;
+	struct delayed_work sample_flush;
+	/* how packets were dispatched by the crypto layer */
+	struct ovpn_crypto_path_stats __percpu *crypto_path;
 	struct socket *sock;
+	/* state shared by all the interfaces using the same UDP socket */
+	struct ovpn_udp_socket *udp_sock;
+	/* entry in udp_sock->shared->ovpn_by_peer_id if the socket is shared */
+	struct hlist_node udp_hnode;
+	/* peer-id packets addressed to this interface carry on a shared
+	 * UDP socket
+	 */
+	u32 peer_id;
 	enum ovpn_mode mode;
 	enum ovpn_proto proto;
 
@@ -10,6 +10,7 @@
 #include "ovpn.h"
 #include "bind.h"
 #include "crypto.h"
+#include "keepalive.h"
 #include "peer.h"
 #include "netlink.h"
 #include "tcp.h"
@@ -30,18 +31,6 @@ struct ovpn_peer *ovpn_peer_get(struct ovpn_struct *ovpn)
 	return peer;
 }
 
-static void ovpn_peer_ping(struct timer_list *t)
-{
-	struct ovpn_peer *peer = from_timer(peer, t, keepalive_xmit);
-
-	rcu_read_lock();
-	pr_debug("sending ping to peer %pIScp\n",
-		 &rcu_dereference(peer->bind)->sapair.remote.u);
-	rcu_read_unlock();
-
-	ovpn_keepalive_xmit(peer);
-}
-
 /* remove peer if it is currenly attached to ovpn_struct */
 void ovpn_peer_evict(struct ovpn_peer *peer, int del_reason)
 {
@@ -75,12 +64,111 @@ static void ovpn_peer_expire(struct timer_list *t)
 	ovpn_peer_evict(peer, OVPN_DEL_PEER_REASON_EXPIRED);
 }
 
+static void ovpn_peer_tx_ring_destroy(void *ptr)
+{
+	kfree_skb_list(ptr);
+}
+
+/* Free the TX rings and the packets still queued. These are left behind when
+ * the peer goes away while encrypt_work is throttled
+ */
+static void ovpn_peer_tx_rings_cleanup(struct ovpn_peer *peer)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		ptr_ring_cleanup(per_cpu_ptr(peer->tx_ring, cpu),
+				 ovpn_peer_tx_ring_destroy);
+
+	free_percpu(peer->tx_ring);
+}
+
+static int ovpn_peer_tx_rings_init(struct ovpn_peer *peer)
+{
+	int cpu, ret;
+
+	peer->tx_ring = alloc_percpu(struct ptr_ring);
+	if (!peer->tx_ring)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		ret = ptr_ring_init(per_cpu_ptr(peer->tx_ring, cpu),
+				    OVPN_QUEUE_LEN, GFP_KERNEL);
+		if (ret < 0)
+			goto err;
+	}
+
+	return 0;
+err:
+	/* ptr_ring_cleanup() is a no-op on the zeroed rings not yet
+	 * initialized
+	 */
+	ovpn_peer_tx_rings_cleanup(peer);
+	return ret;
+}
+
+#define ovpn_line(type, member) (offsetof(type, member) / SMP_CACHE_BYTES)
+#define ovpn_line_end(type, member) \
+	((offsetofend(type, member) - 1) / SMP_CACHE_BYTES)
+
+/* Make sure that the hot groups of struct ovpn_peer and of the key slot do
+ * not end up sharing cache lines when fields are added or moved around
+ */
+static void ovpn_peer_check_layout(void)
+{
+#ifdef CONFIG_SMP
+	BUILD_BUG_ON(ovpn_line_end(struct ovpn_peer, crypto.pktid_wrap_warn) >=
+		     ovpn_line(struct ovpn_peer, crypto.mutex));
+	BUILD_BUG_ON(ovpn_line_end(struct ovpn_peer, crypto) >=
+		     ovpn_line(struct ovpn_peer, refcount));
+	BUILD_BUG_ON(ovpn_line_end(struct ovpn_peer, refcount) >=
+		     ovpn_line(struct ovpn_peer, encrypt_work));
+	BUILD_BUG_ON(ovpn_line_end(struct ovpn_peer, keepalive_node) >=
+		     ovpn_line(struct ovpn_peer, decrypt_work));
+	BUILD_BUG_ON(ovpn_line_end(struct ovpn_peer, stats.lock) >=
+		     ovpn_line(struct ovpn_peer, stats.rx));
+	BUILD_BUG_ON(ovpn_line_end(struct ovpn_peer, stats.rx) >=
+		     ovpn_line(struct ovpn_peer, stats.tx));
+	BUILD_BUG_ON(ovpn_line_end(struct ovpn_peer, stats.tx) >=
+		     ovpn_line(struct ovpn_peer, tcp));
+
+	BUILD_BUG_ON(ovpn_line_end(struct ovpn_crypto_key_slot,
+				   nonce_tail_recv) >=
+		     ovpn_line(struct ovpn_crypto_key_slot, pid_recv));
+	BUILD_BUG_ON(ovpn_line_end(struct ovpn_crypto_key_slot, pid_recv) >=
+		     ovpn_line(struct ovpn_crypto_key_slot, pid_xmit));
+	BUILD_BUG_ON(ovpn_line_end(struct ovpn_crypto_key_slot, pid_xmit) >=
+		     ovpn_line(struct ovpn_crypto_key_slot, refcount));
+#endif
+}
+
+/* Enable flow queueing with the given number of flows. Called while the peer
+ * is being created, before it is visible to the datapath
+ */
+static int ovpn_peer_fq_init(struct ovpn_peer *peer, u32 flows)
+{
+	struct ovpn_fq *fq;
+
+	/* allow a full-sized packet per round, as fq_codel does */
+	fq = ovpn_fq_new(flows, max_t(u32, peer->ovpn->dev->mtu, 256),
+			 OVPN_QUEUE_LEN);
+	if (IS_ERR(fq))
+		return PTR_ERR(fq);
+
+	peer->fq = fq;
+	return 0;
+}
+
 /* Construct a new peer */
-static struct ovpn_peer *ovpn_peer_new(struct ovpn_struct *ovpn)
+static struct ovpn_peer *ovpn_peer_new(struct ovpn_struct *ovpn,
+				      const struct ovpn_sockaddr_pair *sapair,
+				      u16 fq_flows)
 {
 	struct ovpn_peer *peer;
 	int ret;
 
+	ovpn_peer_check_layout();
+
 	/* alloc and init peer object */
 	peer = kzalloc(sizeof(*peer), GFP_KERNEL);
 	if (!peer)
@@ -93,13 +181,26 @@ static struct ovpn_peer *ovpn_peer_new(struct ovpn_struct *ovpn)
 	spin_lock_init(&peer->lock);
 	kref_init(&peer->refcount);
 	ovpn_peer_stats_init(&peer->stats);
-
-	INIT_WORK(&peer->encrypt_work, ovpn_encrypt_work);
+	atomic_set(&peer->tx_throttled, 0);
+	atomic_set(&peer->tx_inflight, 0);
+	atomic_set(&peer->rx_inflight, 0);
+	peer->probation.window_start = jiffies;
+	spin_lock_init(&peer->echo.lock);
+
+	/* the transport is known since OVPN_CMD_START_VPN: pick the matching
+	 * TX worker once and for all
+	 */
+	if (ovpn->proto == OVPN_PROTO_TCP4 || ovpn->proto == OVPN_PROTO_TCP6)
+		INIT_WORK(&peer->encrypt_work, ovpn_encrypt_work_tcp);
+	else
+		INIT_WORK(&peer->encrypt_work, ovpn_encrypt_work_udp);
 	INIT_WORK(&peer->decrypt_work, ovpn_decrypt_work);
 
-	/* configure and start NAPI */
-	netif_tx_napi_add(ovpn->dev, &peer->napi, ovpn_napi_poll,
-			  NAPI_POLL_WEIGHT);
+	/* configure and start NAPI. This is an RX NAPI (not a TX one) so that
+	 * it gets a napi_id and applications can busy poll it
+	 */
+	netif_napi_add(ovpn->dev, &peer->napi, ovpn_napi_poll,
+		       NAPI_POLL_WEIGHT);
 	napi_enable(&peer->napi);
 
 	ret = dst_cache_init(&peer->dst_cache, GFP_KERNEL);
@@ -108,9 +209,9 @@ static struct ovpn_peer *ovpn_peer_new(struct ovpn_struct *ovpn)
 		goto err;
 	}
 
-	ret = ptr_ring_init(&peer->tx_ring, OVPN_QUEUE_LEN, GFP_KERNEL);
+	ret = ovpn_peer_tx_rings_init(peer);
 	if (ret < 0) {
-		pr_err("cannot allocate TX ring\n");
+		pr_err("cannot allocate TX rings\n");
 		goto err_dst_cache;
 	}
 
@@ -126,19 +227,33 @@ static struct ovpn_peer *ovpn_peer_new(struct ovpn_struct *ovpn)
 		goto err_rx_ring;
 	}
 
+	if (fq_flows) {
+		ret = ovpn_peer_fq_init(peer, fq_flows);
+		if (ret < 0) {
+			pr_err("cannot allocate flow queues\n");
+			goto err_netif_rx_ring;
+		}
+	}
+
+	/* set peer sockaddr */
+	ret = ovpn_peer_reset_sockaddr(peer, sapair);
+	if (ret < 0)
+		goto err_fq;
+
 	if (ovpn->proto == OVPN_PROTO_TCP4 || ovpn->proto == OVPN_PROTO_TCP6) {
 		INIT_WORK(&peer->tcp.tx_work, ovpn_tcp_tx_work);
-		INIT_WORK(&peer->tcp.rx_work, ovpn_tcp_rx_work);
+		INIT_DELAYED_WORK(&peer->tcp.rx_work, ovpn_tcp_rx_work);
 
 		ret = ptr_ring_init(&peer->tcp.tx_ring, OVPN_QUEUE_LEN, GFP_KERNEL);
 		if (ret < 0) {
 			pr_err("cannot allocate TCP TX ring\n");
-			goto err_netif_rx_ring;
+			goto err_bind;
 		}
 
 		peer->tcp.skb = NULL;
 		peer->tcp.offset = 0;
 		peer->tcp.data_len = 0;
+		peer->tcp.tx_offset = 0;
 
 		ret = ovpn_tcp_sock_attach(ovpn->sock, peer);
 		if (ret < 0) {
@@ -147,23 +262,26 @@ static struct ovpn_peer *ovpn_peer_new(struct ovpn_struct *ovpn)
 		}
 
 		/* schedule initial RX work */
-		queue_work(peer->ovpn->events_wq, &peer->tcp.rx_work);
+		queue_delayed_work(peer->ovpn->events_wq, &peer->tcp.rx_work, 0);
 	}
 
 	dev_hold(ovpn->dev);
 
-	timer_setup(&peer->keepalive_xmit, ovpn_peer_ping, 0);
 	timer_setup(&peer->keepalive_recv, ovpn_peer_expire, 0);
 
 	return peer;
 err_tcp_tx_ring:
 	ptr_ring_cleanup(&peer->tcp.tx_ring, NULL);
+err_bind:
+	ovpn_bind_reset(peer, NULL);
+err_fq:
+	ovpn_fq_free(peer->fq);
 err_netif_rx_ring:
 	ptr_ring_cleanup(&peer->netif_rx_ring, NULL);
 err_rx_ring:
 	ptr_ring_cleanup(&peer->rx_ring, NULL);
 err_tx_ring:
-	ptr_ring_cleanup(&peer->tx_ring, NULL);
+	ovpn_peer_tx_rings_cleanup(peer);
 err_dst_cache:
 	dst_cache_destroy(&peer->dst_cache);
 err:
@@ -192,7 +310,7 @@ int ovpn_peer_reset_sockaddr(struct ovpn_peer *peer,
 
 static void ovpn_peer_timer_delete_all(struct ovpn_peer *peer)
 {
-	del_timer_sync(&peer->keepalive_xmit);
+	ovpn_keepalive_del(peer);
 	del_timer_sync(&peer->keepalive_recv);
 }
 
@@ -201,8 +319,14 @@ void ovpn_peer_release(struct ovpn_peer *peer)
 	ovpn_bind_reset(peer, NULL);
 	ovpn_peer_timer_delete_all(peer);
 
-	WARN_ON(!__ptr_ring_empty(&peer->tx_ring));
-	ptr_ring_cleanup(&peer->tx_ring, NULL);
+	/* do not leave the interface stopped if we were waiting for write
+	 * space: the next peer would never wake it up
+	 */
+	if (atomic_read(&peer->tx_throttled))
+		netif_wake_queue(peer->ovpn->dev);
+
+	ovpn_peer_tx_rings_cleanup(peer);
+	ovpn_fq_free(peer->fq);
 	WARN_ON(!__ptr_ring_empty(&peer->rx_ring));
 	ptr_ring_cleanup(&peer->rx_ring, NULL);
 	WARN_ON(!__ptr_ring_empty(&peer->netif_rx_ring));
@@ -230,6 +354,10 @@ static void ovpn_peer_delete_work(struct work_struct *work)
 
 	napi_disable(&peer->napi);
 	netif_napi_del(&peer->napi);
+	/* the last reference is gone, so encrypt_work cannot be queued again:
+	 * wait for a run still draining the TX rings before they are freed
+	 */
+	cancel_work_sync(&peer->encrypt_work);
 	ovpn_netlink_notify_del_peer(peer);
 
 	call_rcu(&peer->rcu, ovpn_peer_release_rcu);
@@ -262,26 +390,15 @@ void ovpn_peer_delete(struct ovpn_peer *peer, enum ovpn_del_peer_reason reason)
 	ovpn_peer_put(peer);
 }
 
+/* Create a peer bound to sapair. fq_flows is the number of flow queues, 0
+ * disables flow queueing
+ */
 struct ovpn_peer *
 ovpn_peer_new_with_sockaddr(struct ovpn_struct *ovpn,
-			    const struct ovpn_sockaddr_pair *sapair)
+			    const struct ovpn_sockaddr_pair *sapair,
+			    u16 fq_flows)
 {
-	struct ovpn_peer *peer;
-	int ret;
-
-	/* create new peer */
-	peer = ovpn_peer_new(ovpn);
-	if (IS_ERR(peer))
-		return peer;
-
-	/* set peer sockaddr */
-	ret = ovpn_peer_reset_sockaddr(peer, sapair);
-	if (ret < 0) {
-		ovpn_peer_release(peer);
-		return ERR_PTR(ret);
-	}
-
-	return peer;
+	return ovpn_peer_new(ovpn, sapair, fq_flows);
 }
 
 /* Configure keepalive parameters */
@@ -296,10 +413,64 @@ void ovpn_peer_keepalive_set(struct ovpn_peer *peer, u32 interval, u32 timeout)
 	rcu_read_unlock();
 
 	peer->keepalive_interval = interval;
-	delta = msecs_to_jiffies(interval * MSEC_PER_SEC);
-	mod_timer(&peer->keepalive_xmit, jiffies + delta);
+	if (interval)
+		ovpn_keepalive_add(peer);
+	else
+		ovpn_keepalive_del(peer);
 
 	peer->keepalive_timeout = timeout;
 	delta = msecs_to_jiffies(timeout * MSEC_PER_SEC);
 	mod_timer(&peer->keepalive_recv, jiffies + delta);
 }
+
+/* Configure egress pacing rate in bytes per second, 0 to disable it */
+void ovpn_peer_pacing_set(struct ovpn_peer *peer, u64 rate)
+{
+	pr_debug("%s: pacing rate set to %llu bytes/s\n",
+		 peer->ovpn->dev->name, rate);
+
+	WRITE_ONCE(peer->pacing.rate, rate);
+}
+
+/* Configure the encapsulated packet size TCP MSS is clamped for, 0 disables
+ * clamping
+ */
+void ovpn_peer_mssfix_set(struct ovpn_peer *peer, u16 size)
+{
+	pr_debug("%s: mssfix set to %u\n", peer->ovpn->dev->name, size);
+
+	WRITE_ONCE(peer->mssfix.size, size);
+}
+
+/* Account a received packet that failed authentication and put the peer
+ * endpoint under probation if too many are seen within a short time.
+ * Races between concurrent callers only affect the accuracy of the window
+ */
+void ovpn_peer_auth_fail(struct ovpn_peer *peer)
+{
+	const unsigned long now = jiffies;
+	struct ovpn_sockaddr_pair sapair;
+
+	atomic64_inc(&peer->probation.auth_fail);
+
+	if (time_after_eq(now, READ_ONCE(peer->probation.window_start) +
+			       OVPN_AUTH_FAIL_WINDOW)) {
+		WRITE_ONCE(peer->probation.window_start, now);
+		atomic_set(&peer->probation.window_fails, 0);
+	}
+
+	if (atomic_inc_return(&peer->probation.window_fails) !=
+	    OVPN_AUTH_FAIL_MAX)
+		return;
+
+	/* 0 means no probation */
+	WRITE_ONCE(peer->probation.until, (now + OVPN_PROBATION_TIME) ?: 1);
+	atomic64_inc(&peer->probation.count);
+
+	if (ovpn_bind_get_sockaddr_pair(peer, &sapair))
+		net_warn_ratelimited("%s: too many packets failing authentication from %pIScp, putting it under probation\n",
+				     peer->ovpn->dev->name, &sapair.remote.u);
+	else
+		net_warn_ratelimited("%s: too many packets failing authentication, putting peer under probation\n",
+				     peer->ovpn->dev->name);
+}
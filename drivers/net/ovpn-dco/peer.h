@@ -12,88 +12,210 @@
 
 #include "addr.h"
 #include "bind.h"
+#include "fq.h"
 #include "sock.h"
 #include "stats.h"
 
+#include <uapi/linux/ovpn_dco.h>
 #include <linux/timer.h>
 #include <linux/ptr_ring.h>
 #include <net/dst_cache.h>
 
+/* a peer endpoint sending more than OVPN_AUTH_FAIL_MAX packets failing
+ * authentication within OVPN_AUTH_FAIL_WINDOW is put under probation for
+ * OVPN_PROBATION_TIME
+ */
+#define OVPN_AUTH_FAIL_WINDOW HZ
+#define OVPN_AUTH_FAIL_MAX 64
+#define OVPN_PROBATION_TIME (2 * HZ)
+
+/* Fields are grouped by the path using them, so that RX and TX running on
+ * different CPUs do not false-share cache lines: read-mostly fields used by
+ * both directions first, then the refcount (written by both directions on
+ * every packet) in a line of its own, then the TX-hot and the RX-hot groups
+ * and finally the control path state, including counters of rare events.
+ * Nothing written outside of configuration changes belongs to the
+ * read-mostly group.
+ * The layout is verified at build time in ovpn_peer_check_layout().
+ */
 struct ovpn_peer {
+	/* read-mostly group */
 	struct ovpn_struct *ovpn;
 
-	/* work objects to handle encryption/decryption of packets.
+	struct socket *sock;
+
+	/* our binding to peer, protected by spinlock */
+	struct ovpn_bind __rcu *bind;
+
+	/* one TX ring per CPU: ovpn_net_xmit() is LLTX and runs on many CPUs
+	 * at once, so each CPU produces into its own ring (with BH disabled)
+	 * and encrypt_work is the only consumer of all of them
+	 */
+	struct ptr_ring __percpu *tx_ring;
+	/* optional flow queueing between tx_ring and encryption, NULL if
+	 * disabled. Set before the peer is published and never changed
+	 */
+	struct ovpn_fq *fq;
+
+	struct dst_cache dst_cache;
+
+	/* keepalive interval in seconds */
+	unsigned long keepalive_interval;
+	/* keepalive timeout in seconds */
+	unsigned long keepalive_timeout;
+
+	/* MSS clamping of TCP SYNs crossing the tunnel. size is the largest
+	 * encapsulated packet TCP segments are sized for, 0 disables it
+	 */
+	struct {
+		u16 size;
+	} mssfix;
+
+	/* packet sampling, 1 out of rate packets is exported to userspace in
+	 * each direction, 0 disables it
+	 */
+	struct {
+		u32 rate;
+	} sample;
+
+	/* true if ovpn_peer_mark_delete was called */
+	bool halt;
+
+	/* our crypto state. Its mutex sits in a cache line of its own */
+	struct ovpn_crypto_state crypto;
+
+	/* needed because crypto methods can go async */
+	struct kref refcount ____cacheline_aligned_in_smp;
+
+	/* TX-hot group.
+	 * work objects to handle encryption/decryption of packets.
 	 * these works are queued on the ovpn->crypt_wq workqueue.
 	 */
-	struct work_struct encrypt_work;
-	struct work_struct decrypt_work;
+	struct work_struct encrypt_work ____cacheline_aligned_in_smp;
+	/* non-zero while encrypt_work holds packets taken from tx_ring */
+	atomic_t tx_inflight;
 
-	struct ptr_ring tx_ring;
-	struct ptr_ring rx_ring;
-	struct ptr_ring netif_rx_ring;
+	/* when tx_throttle is set, encrypted packets are charged to the UDP
+	 * socket send buffer and tx_throttled is set when encrypt_work paused
+	 * because it is full. Cleared by the socket write_space callback
+	 */
+	bool tx_throttle;
+	atomic_t tx_throttled;
+
+	/* egress pacing of the UDP transport. rate is in bytes per second,
+	 * 0 means disabled. next_tx_ns is the earliest departure time of the
+	 * next packet. Besides encrypt_work, packets sent by userspace and
+	 * inline TX may advance it concurrently
+	 */
+	struct {
+		u64 rate;
+		atomic64_t next_tx_ns;
+		atomic64_t packets;
+		atomic64_t delayed;
+		atomic64_t delay_ns;
+	} pacing;
+
+	/* jiffies at which a ping has to be sent to the other peer, pushed
+	 * forward by any other data sent. Pings are emitted by the keepalive
+	 * wheel, see keepalive.c
+	 */
+	unsigned long keepalive_xmit_due;
+	/* entry in the keepalive wheel, protected by its lock */
+	struct hlist_node keepalive_node;
+
+	/* RX-hot group */
+	struct work_struct decrypt_work ____cacheline_aligned_in_smp;
+	/* number of contexts (decrypt_work, NAPI busy polling) holding
+	 * packets taken from rx_ring
+	 */
+	atomic_t rx_inflight;
+
+	/* timer used to mark a peer as expired when no data is received for
+	 * keepalive_timeout seconds
+	 */
+	struct timer_list keepalive_recv;
+
+	/* authentication failures tracking. While under probation, packets
+	 * whose packet ID cannot be accepted are dropped before decryption.
+	 * until is 0 when not under probation
+	 */
+	struct {
+		unsigned long window_start;
+		atomic_t window_fails;
+		unsigned long until;
+		atomic64_t auth_fail;
+		atomic64_t count;
+		atomic64_t dropped;
+	} probation;
 
 	struct napi_struct napi;
 
-	struct socket *sock;
+	/* producer and consumer sides of a ptr_ring already live in separate
+	 * cache lines
+	 */
+	struct ptr_ring rx_ring;
+	struct ptr_ring netif_rx_ring;
+
+	/* per-peer rx/tx stats, rx and tx counters are cacheline aligned */
+	struct ovpn_peer_stats stats;
 
-	/* state of the TCP reading. Needed to keep track of how much of a single packet has already
+	/* control path group.
+	 * state of the TCP reading. Needed to keep track of how much of a single packet has already
 	 * been read from the stream and how much is missing
 	 */
 	struct {
 		struct ptr_ring tx_ring;
 		struct work_struct tx_work;
-		struct work_struct rx_work;
+		struct delayed_work rx_work;
 
 		u8 raw_len[sizeof(u16)];
 		struct sk_buff *skb;
 		u16 offset;
 		u16 data_len;
+		/* bytes of the skb at the head of tx_ring already sent */
+		unsigned int tx_offset;
 		struct {
 			void (*sk_state_change)(struct sock *sk);
 			void (*sk_data_ready)(struct sock *sk);
 			void (*sk_write_space)(struct sock *sk);
 		} sk_cb;
-	} tcp;
+	} tcp ____cacheline_aligned_in_smp;
 
-	struct dst_cache dst_cache;
-
-	/* our crypto state */
-	struct ovpn_crypto_state crypto;
-
-	/* our binding to peer, protected by spinlock */
-	struct ovpn_bind __rcu *bind;
+	/* TCP SYNs whose MSS was clamped, per direction */
+	struct {
+		atomic64_t tx;
+		atomic64_t rx;
+	} mssfix_stats;
 
-	/* timer used to send periodic ping messages to the other peer, if no
-	 * other data was sent within the past keepalive_interval seconds
-	 */
-	struct timer_list keepalive_xmit;
-	/* keepalive interval in seconds */
-	unsigned long keepalive_interval;
+	/* only written for sampled packets */
+	struct {
+		atomic64_t taken;
+		atomic64_t lost;
+	} sample_stats;
 
-	/* timer used to mark a peer as expired when no data is received for
-	 * keepalive_timeout seconds
+	/* timestamped keepalives, see echo.c. since_ns is when the current
+	 * measurement started: replies to older requests are ignored. Only
+	 * state is read on the datapath and it seldom changes
 	 */
-	struct timer_list keepalive_recv;
-	/* keepalive timeout in seconds */
-	unsigned long keepalive_timeout;
-
-	/* true if ovpn_peer_mark_delete was called */
-	bool halt;
-
-	/* per-peer rx/tx stats */
-	struct ovpn_peer_stats stats;
+	struct {
+		spinlock_t lock;
+		u8 state;
+		u32 seq;
+		u32 unanswered;
+		u32 srtt_us;
+		u32 rttvar_us;
+		u32 loss_ppm;
+		u64 requests;
+		u64 replies;
+		u64 since_ns;
+	} echo;
 
 	/* why peer was deleted - keepalive timeout, module removed etc */
 	enum ovpn_del_peer_reason delete_reason;
 
-	/* protects binding to peer (bind) and timers
-	 * (keepalive_xmit, keepalive_expire)
-	 */
+	/* protects binding to peer (bind) and timers (keepalive_expire) */
 	spinlock_t lock;
 
-	/* needed because crypto methods can go async */
-	struct kref refcount;
-
 	/* needed to free a peer in an RCU safe way */
 	struct rcu_head rcu;
 
@@ -117,6 +239,22 @@ static inline void ovpn_peer_put(struct ovpn_peer *peer)
 	kref_put(&peer->refcount, ovpn_peer_release_kref);
 }
 
+/* return true if the peer is currently under probation */
+static inline bool ovpn_peer_probation(struct ovpn_peer *peer)
+{
+	unsigned long until = READ_ONCE(peer->probation.until);
+
+	if (likely(!until))
+		return false;
+
+	if (time_before(jiffies, until))
+		return true;
+
+	/* probation over: clear it unless it was renewed meanwhile */
+	cmpxchg(&peer->probation.until, until, 0);
+	return false;
+}
+
 static inline void ovpn_peer_keepalive_recv_reset(struct ovpn_peer *peer)
 {
 	u32 delta = msecs_to_jiffies(peer->keepalive_timeout * MSEC_PER_SEC);
@@ -127,6 +265,14 @@ static inline void ovpn_peer_keepalive_recv_reset(struct ovpn_peer *peer)
 	mod_timer(&peer->keepalive_recv, jiffies + delta);
 }
 
+static inline bool ovpn_peer_echo_enabled(const struct ovpn_peer *peer)
+{
+	u8 state = READ_ONCE(peer->echo.state);
+
+	return state == OVPN_ECHO_STATE_PROBING ||
+	       state == OVPN_ECHO_STATE_ACTIVE;
+}
+
 static inline void ovpn_peer_keepalive_xmit_reset(struct ovpn_peer *peer)
 {
 	u32 delta = msecs_to_jiffies(peer->keepalive_interval * MSEC_PER_SEC);
@@ -134,12 +280,17 @@ static inline void ovpn_peer_keepalive_xmit_reset(struct ovpn_peer *peer)
 	if (unlikely(!delta))
 		return;
 
-	mod_timer(&peer->keepalive_xmit, jiffies + delta);
+	/* measurements need one request per interval regardless of traffic */
+	if (ovpn_peer_echo_enabled(peer))
+		return;
+
+	WRITE_ONCE(peer->keepalive_xmit_due, jiffies + delta);
 }
 
 struct ovpn_peer *
 ovpn_peer_new_with_sockaddr(struct ovpn_struct *ovpn,
-			    const struct ovpn_sockaddr_pair *sapair);
+			    const struct ovpn_sockaddr_pair *sapair,
+			    u16 fq_flows);
 
 void ovpn_peer_delete(struct ovpn_peer *peer, enum ovpn_del_peer_reason reason);
 
@@ -151,6 +302,12 @@ int ovpn_peer_xmit_explicit_exit_notify(struct ovpn_peer *peer)
 
 void ovpn_peer_keepalive_set(struct ovpn_peer *peer, u32 interval, u32 timeout);
 
+void ovpn_peer_pacing_set(struct ovpn_peer *peer, u64 rate);
+
+void ovpn_peer_mssfix_set(struct ovpn_peer *peer, u16 size);
+
+void ovpn_peer_auth_fail(struct ovpn_peer *peer);
+
 void ovpn_peer_evict(struct ovpn_peer *peer, int del_reason);
 
 #endif /* _NET_OVPN_DCO_OVPNPEER_H_ */
@@ -11,23 +11,79 @@
 
 #include <linux/atomic.h>
 #include <linux/jiffies.h>
+#include <linux/slab.h>
 
 void ovpn_pktid_xmit_init(struct ovpn_pktid_xmit *pid)
 {
 	atomic64_set(&pid->seq_num, 0);
+	pid->wrap_warn = PKTID_WRAP_WARN;
+	atomic_set(&pid->wrap_warned, 0);
 	pid->tcp_linear = NULL;
 }
 
 void ovpn_pktid_recv_init(struct ovpn_pktid_recv *pr)
 {
 	memset(pr, 0, sizeof(*pr));
+	pr->history = pr->history_min;
+	pr->size = REPLAY_WINDOW_MIN;
 	spin_lock_init(&pr->lock);
 }
 
+void ovpn_pktid_recv_release(struct ovpn_pktid_recv *pr)
+{
+	if (pr->history != pr->history_min)
+		kfree(pr->history);
+}
+
 #if ENABLE_REPLAY_PROTECTION
 
+/* Enlarge the window so that a backtrack of delta fits in its first half.
+ * The history is preserved. On allocation failure the current window is kept
+ */
+static void ovpn_pktid_recv_grow(struct ovpn_pktid_recv *pr,
+				 unsigned int delta)
+{
+	unsigned int size = pr->size, i, ri;
+	u8 *history;
+
+	while (size < REPLAY_WINDOW_MAX && delta >= size / 2)
+		size <<= 1;
+
+	if (size == pr->size)
+		return;
+
+	history = kzalloc(size / 8, GFP_ATOMIC);
+	if (!history)
+		return;
+
+	/* rebase the deque at bit 0 of the new window */
+	for (i = 0; i < pr->extent; i++) {
+		ri = REPLAY_INDEX(pr, i);
+		if (pr->history[ri / 8] & BIT(ri % 8))
+			history[i / 8] |= BIT(i % 8);
+	}
+
+	ovpn_pktid_recv_release(pr);
+	pr->history = history;
+	WRITE_ONCE(pr->size, size);
+	pr->base = 0;
+}
+
+/* Go back to the inline window. Only called when the history has expired,
+ * therefore it doesn't need to be preserved
+ */
+static void ovpn_pktid_recv_shrink(struct ovpn_pktid_recv *pr)
+{
+	ovpn_pktid_recv_release(pr);
+	memset(pr->history_min, 0, sizeof(pr->history_min));
+	pr->history = pr->history_min;
+	WRITE_ONCE(pr->size, REPLAY_WINDOW_MIN);
+	pr->base = 0;
+	pr->extent = 0;
+}
+
 /* Packet replay detection.
- * Allows ID backtrack of up to REPLAY_WINDOW_SIZE - 1.
+ * Allows ID backtrack of up to pr->size - 1.
  */
 static int ovpn_pktid_recv_locked(struct ovpn_pktid_recv *pr, u32 pkt_id,
 				  u32 pkt_time)
@@ -35,8 +91,11 @@ static int ovpn_pktid_recv_locked(struct ovpn_pktid_recv *pr, u32 pkt_id,
 	const unsigned long now = jiffies;
 
 	/* expire backtracks at or below pr->id after PKTID_RECV_EXPIRE time */
-	if (unlikely(time_after_eq(now, pr->expire)))
+	if (unlikely(time_after_eq(now, pr->expire))) {
 		pr->id_floor = pr->id;
+		if (pr->size > REPLAY_WINDOW_MIN)
+			ovpn_pktid_recv_shrink(pr);
+	}
 
 	/* ID must not be zero */
 	if (unlikely(pkt_id == 0))
@@ -59,32 +118,32 @@ static int ovpn_pktid_recv_locked(struct ovpn_pktid_recv *pr, u32 pkt_id,
 
 	if (likely(pkt_id == pr->id + 1)) {
 		/* well-formed ID sequence (incremented by 1) */
-		pr->base = REPLAY_INDEX(pr->base, -1);
+		pr->base = REPLAY_INDEX(pr, -1);
 		pr->history[pr->base / 8] |= (1 << (pr->base % 8));
-		if (pr->extent < REPLAY_WINDOW_SIZE)
+		if (pr->extent < pr->size)
 			++pr->extent;
 		pr->id = pkt_id;
 	} else if (pkt_id > pr->id) {
 		/* ID jumped forward by more than one */
 		const unsigned int delta = pkt_id - pr->id;
 
-		if (delta < REPLAY_WINDOW_SIZE) {
+		if (delta < pr->size) {
 			unsigned int i;
 
-			pr->base = REPLAY_INDEX(pr->base, -delta);
+			pr->base = REPLAY_INDEX(pr, -delta);
 			pr->history[pr->base / 8] |= (1 << (pr->base % 8));
 			pr->extent += delta;
-			if (pr->extent > REPLAY_WINDOW_SIZE)
-				pr->extent = REPLAY_WINDOW_SIZE;
+			if (pr->extent > pr->size)
+				pr->extent = pr->size;
 			for (i = 1; i < delta; ++i) {
-				unsigned int newb = REPLAY_INDEX(pr->base, i);
+				unsigned int newb = REPLAY_INDEX(pr, i);
 
 				pr->history[newb / 8] &= ~BIT(newb % 8);
 			}
 		} else {
 			pr->base = 0;
-			pr->extent = REPLAY_WINDOW_SIZE;
-			memset(pr->history, 0, sizeof(pr->history));
+			pr->extent = pr->size;
+			memset(pr->history, 0, pr->size / 8);
 			pr->history[0] = 1;
 		}
 		pr->id = pkt_id;
@@ -93,22 +152,26 @@ static int ovpn_pktid_recv_locked(struct ovpn_pktid_recv *pr, u32 pkt_id,
 		const unsigned int delta = pr->id - pkt_id;
 
 		if (delta > pr->max_backtrack)
-			pr->max_backtrack = delta;
+			WRITE_ONCE(pr->max_backtrack, delta);
+		/* reordering is getting close to the window size: make room
+		 * for the next packets
+		 */
+		if (unlikely(delta >= pr->size - pr->size / 4))
+			ovpn_pktid_recv_grow(pr, delta);
 		if (delta < pr->extent) {
 			if (pkt_id > pr->id_floor) {
-				const unsigned int ri = REPLAY_INDEX(pr->base,
-								     delta);
+				const unsigned int ri = REPLAY_INDEX(pr, delta);
 				u8 *p = &pr->history[ri / 8];
 				const u8 mask = (1 << (ri % 8));
 
 				if (*p & mask)
-					return -EINVAL;
+					return -ESTALE;
 				*p |= mask;
 			} else {
-				return -EINVAL;
+				return -ESTALE;
 			}
 		} else {
-			return -EINVAL;
+			return -ESTALE;
 		}
 	}
 
@@ -117,15 +180,54 @@ static int ovpn_pktid_recv_locked(struct ovpn_pktid_recv *pr, u32 pkt_id,
 }
 #endif
 
-/* Packet replay detection with locking  */
+/* Packet replay detection with locking.
+ *
+ * Return 0 if the packet ID is acceptable, -ESTALE if it was already seen or
+ * is too old for the replay window, another negative error code otherwise.
+ */
 int ovpn_pktid_recv(struct ovpn_pktid_recv *pr, u32 pkt_id, u32 pkt_time)
 {
 	int ret = 0;
 
 #if ENABLE_REPLAY_PROTECTION
-	spin_lock(&pr->lock);
+	spin_lock_bh(&pr->lock);
 	ret = ovpn_pktid_recv_locked(pr, pkt_id, pkt_time);
-	spin_unlock(&pr->lock);
+	spin_unlock_bh(&pr->lock);
+#endif
+
+	return ret;
+}
+
+/* Check a packet ID before it has been authenticated, without altering the
+ * replay state.
+ *
+ * Return false if ovpn_pktid_recv() would reject pkt_id or if pkt_id is more
+ * than ahead past the highest ID received so far.
+ */
+bool ovpn_pktid_recv_plausible(struct ovpn_pktid_recv *pr, u32 pkt_id,
+			       u32 ahead)
+{
+	bool ret = true;
+
+#if ENABLE_REPLAY_PROTECTION
+	unsigned int delta, ri;
+
+	if (unlikely(pkt_id == 0))
+		return false;
+
+	spin_lock_bh(&pr->lock);
+	if (pkt_id > pr->id) {
+		ret = pkt_id - pr->id <= ahead;
+	} else {
+		delta = pr->id - pkt_id;
+		if (delta >= pr->extent || pkt_id <= pr->id_floor) {
+			ret = false;
+		} else {
+			ri = REPLAY_INDEX(pr, delta);
+			ret = !(pr->history[ri / 8] & BIT(ri % 8));
+		}
+	}
+	spin_unlock_bh(&pr->lock);
 #endif
 
 	return ret;
@@ -40,8 +40,9 @@
  */
 #define PKTID_RECV_EXPIRE (30 * HZ)
 
-/* Warn userspace with OVPN_TH_NOTIFY_PKTID_WRAP_WARN
+/* Warn userspace with OVPN_CMD_PKTID_WRAP_WARN
  * message when packet ID crosses this threshold.
+ * Default value, can be overridden per peer via netlink.
  */
 #ifndef PKTID_WRAP_WARN
 #define PKTID_WRAP_WARN 0xf0000000ULL
@@ -58,22 +59,32 @@ struct ovpn_nonce_tail {
 /* Packet-ID state for transmitter */
 struct ovpn_pktid_xmit {
 	atomic64_t seq_num;
+	/* packet ID after which userspace is warned about the upcoming wrap */
+	u64 wrap_warn;
+	/* set once the warning for this key has been issued */
+	atomic_t wrap_warned;
 	struct ovpn_tcp_linear *tcp_linear;
 };
 
-/* replay window sizing in bytes = 2^REPLAY_WINDOW_ORDER */
-#define REPLAY_WINDOW_ORDER 8
+/* replay window sizing in packets: windows start at the minimum, stored
+ * inline, and are doubled up to the maximum when reordering gets close to
+ * their size. They fall back to the minimum once the peer goes idle. The
+ * minimum is the historical fixed window, so no peer ever gets less
+ * reordering tolerance than before
+ */
+#define REPLAY_WINDOW_MIN 2048
+#define REPLAY_WINDOW_MAX 65536
 
-#define REPLAY_WINDOW_BYTES BIT(REPLAY_WINDOW_ORDER)
-#define REPLAY_WINDOW_SIZE  (REPLAY_WINDOW_BYTES * 8)
-#define REPLAY_INDEX(base, i) (((base) + (i)) & (REPLAY_WINDOW_SIZE - 1))
+#define REPLAY_INDEX(pr, i) (((pr)->base + (i)) & ((pr)->size - 1))
 
-/* Packet-ID state for receiver.
- * Other than lock member, can be zeroed to initialize.
- */
+/* Packet-ID state for receiver */
 struct ovpn_pktid_recv {
-	/* "sliding window" bitmask of recent packet IDs received */
-	u8 history[REPLAY_WINDOW_BYTES];
+	/* "sliding window" bitmask of recent packet IDs received, either
+	 * history_min or allocated when larger
+	 */
+	u8 *history;
+	/* size (in bits) of history, a power of 2 */
+	unsigned int size;
 	/* bit position of deque base in history */
 	unsigned int base;
 	/* extent (in bits) of deque in history */
@@ -86,23 +97,30 @@ struct ovpn_pktid_recv {
 	u32 time;
 	/* we will only accept backtrack IDs > id_floor */
 	u32 id_floor;
+	/* largest reordering distance observed */
 	unsigned int max_backtrack;
 	/* protects entire pktd ID state */
 	spinlock_t lock;
+	u8 history_min[REPLAY_WINDOW_MIN / 8];
 };
 
-/* Get the next packet ID for xmit */
+/* Get the next packet ID for xmit.
+ *
+ * Return 0 on success, 1 on success when the wrap-warn threshold has just been
+ * crossed (reported only once per key) or -E2BIG when the ID space is exhausted
+ */
 static inline int ovpn_pktid_xmit_next(struct ovpn_pktid_xmit *pid, u32 *pktid)
 {
 	const u64 seq_num = atomic64_inc_return(&pid->seq_num);
 
 	BUILD_BUG_ON(PKTID_WRAP_WARN >= 0x100000000ULL);
 	*pktid = (u32)seq_num;
-	if (unlikely(seq_num >= PKTID_WRAP_WARN)) {
+	if (unlikely(seq_num >= READ_ONCE(pid->wrap_warn))) {
 		if (seq_num >= 0x100000000ULL)
 			return -E2BIG;
-		if (seq_num == PKTID_WRAP_WARN)
-			return -1;
+		if (!atomic_read(&pid->wrap_warned) &&
+		    !atomic_xchg(&pid->wrap_warned, 1))
+			return 1;
 	}
 	return 0;
 }
@@ -125,7 +143,10 @@ static inline void ovpn_pktid_chm_write(const u32 pktid, unsigned char *dest)
 
 void ovpn_pktid_xmit_init(struct ovpn_pktid_xmit *pid);
 void ovpn_pktid_recv_init(struct ovpn_pktid_recv *pr);
+void ovpn_pktid_recv_release(struct ovpn_pktid_recv *pr);
 
 int ovpn_pktid_recv(struct ovpn_pktid_recv *pr, u32 pkt_id, u32 pkt_time);
+bool ovpn_pktid_recv_plausible(struct ovpn_pktid_recv *pr, u32 pkt_id,
+			       u32 ahead);
 
 #endif /* _NET_OVPN_DCO_OVPNPKTID_H_ */
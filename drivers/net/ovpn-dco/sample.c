@@ -0,0 +1,240 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include "main.h"
+#include "netlink.h"
+#include "ovpnstruct.h"
+#include "peer.h"
+#include "sample.h"
+
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/timekeeping.h>
+#include <net/genetlink.h>
+
+/* inner bytes exported with each sample */
+#define OVPN_SAMPLE_HDR_LEN 128
+/* samples are sent out at least this often */
+#define OVPN_SAMPLE_FLUSH_INTERVAL (HZ / 10)
+/* a batch is sent out as soon as it holds this many samples */
+#define OVPN_SAMPLE_BATCH 32
+
+/* close the batch being filled and return it, if any. Called with sc->lock
+ * held
+ */
+static struct sk_buff *ovpn_sample_batch_take(struct ovpn_sample_cpu *sc)
+{
+	struct sk_buff *msg = sc->msg;
+
+	sc->msg = NULL;
+	if (!msg)
+		return NULL;
+
+	if (!sc->n) {
+		nlmsg_free(msg);
+		return NULL;
+	}
+
+	genlmsg_end(msg, sc->hdr);
+	sc->n = 0;
+
+	return msg;
+}
+
+/* start a new batch, to be sent out within OVPN_SAMPLE_FLUSH_INTERVAL */
+static bool ovpn_sample_batch_new(struct ovpn_struct *ovpn,
+				  struct ovpn_sample_cpu *sc)
+{
+	sc->msg = ovpn_netlink_samples_new(ovpn, &sc->hdr);
+	if (!sc->msg)
+		return false;
+
+	queue_delayed_work(ovpn->events_wq, &ovpn->sample_flush,
+			   OVPN_SAMPLE_FLUSH_INTERVAL);
+	return true;
+}
+
+static int ovpn_sample_fill(struct sk_buff *msg, struct sk_buff *skb,
+			    enum ovpn_sample_dir dir, int peer_id, int key_id,
+			    u32 rate)
+{
+	unsigned int len = min_t(unsigned int, skb->len, OVPN_SAMPLE_HDR_LEN);
+	struct nlattr *attr, *data;
+
+	attr = nla_nest_start(msg, OVPN_ATTR_SAMPLE);
+	if (!attr)
+		return -EMSGSIZE;
+
+	if (nla_put_u8(msg, OVPN_SAMPLE_ATTR_DIR, dir) ||
+	    nla_put_u32(msg, OVPN_SAMPLE_ATTR_PEER_ID, peer_id) ||
+	    nla_put_u8(msg, OVPN_SAMPLE_ATTR_KEY_ID, key_id) ||
+	    nla_put_u32(msg, OVPN_SAMPLE_ATTR_LEN, skb->len) ||
+	    nla_put_u32(msg, OVPN_SAMPLE_ATTR_RATE, rate) ||
+	    nla_put_u64_64bit(msg, OVPN_SAMPLE_ATTR_TIMESTAMP,
+			      ktime_get_real_ns(), OVPN_SAMPLE_ATTR_PAD))
+		goto err_cancel;
+
+	data = nla_reserve(msg, OVPN_SAMPLE_ATTR_HEADER, len);
+	if (!data || skb_copy_bits(skb, 0, nla_data(data), len) < 0)
+		goto err_cancel;
+
+	nla_nest_end(msg, attr);
+	return 0;
+
+err_cancel:
+	nla_nest_cancel(msg, attr);
+	return -EMSGSIZE;
+}
+
+/* append a sample to the batch of this CPU. Return a batch ready to be sent
+ * out, if any
+ */
+static struct sk_buff *ovpn_sample_add(struct ovpn_peer *peer,
+				       struct ovpn_sample_cpu *sc,
+				       struct sk_buff *skb,
+				       enum ovpn_sample_dir dir, int peer_id,
+				       int key_id, u32 rate)
+{
+	struct ovpn_struct *ovpn = peer->ovpn;
+	struct sk_buff *full = NULL;
+
+	if (!sc->msg && !ovpn_sample_batch_new(ovpn, sc))
+		goto lost;
+
+	if (ovpn_sample_fill(sc->msg, skb, dir, peer_id, key_id, rate) < 0) {
+		/* no room left: send what we have and retry with a new batch */
+		if (!sc->n)
+			goto lost;
+
+		full = ovpn_sample_batch_take(sc);
+		if (!ovpn_sample_batch_new(ovpn, sc) ||
+		    ovpn_sample_fill(sc->msg, skb, dir, peer_id, key_id,
+				     rate) < 0)
+			goto lost;
+	}
+
+	atomic64_inc(&peer->sample_stats.taken);
+	if (++sc->n >= OVPN_SAMPLE_BATCH && !full)
+		full = ovpn_sample_batch_take(sc);
+
+	return full;
+lost:
+	atomic64_inc(&peer->sample_stats.lost);
+	return full;
+}
+
+void __ovpn_sample(struct ovpn_peer *peer, struct sk_buff *skb,
+		   enum ovpn_sample_dir dir, int peer_id, int key_id)
+{
+	u32 rate = READ_ONCE(peer->sample.rate);
+	struct ovpn_struct *ovpn = peer->ovpn;
+	struct ovpn_sample_cpu *sc;
+	struct sk_buff *full = NULL;
+
+	if (!rate)
+		return;
+
+	local_bh_disable();
+	sc = this_cpu_ptr(ovpn->sample);
+	spin_lock(&sc->lock);
+
+	/* randomize the distance between samples (averaging rate) so that
+	 * periodic traffic patterns cannot alias with the sampling
+	 */
+	if (sc->countdown > 1) {
+		sc->countdown--;
+		goto unlock;
+	}
+	sc->countdown = 1 + prandom_u32_max(2 * rate - 1);
+
+	/* nobody to report to: don't bother building the sample */
+	if (!ovpn_netlink_samples_listened(ovpn))
+		goto unlock;
+
+	full = ovpn_sample_add(peer, sc, skb, dir, peer_id, key_id, rate);
+unlock:
+	spin_unlock(&sc->lock);
+	local_bh_enable();
+
+	if (full)
+		ovpn_netlink_samples_send(ovpn, full);
+}
+
+static void ovpn_sample_flush(struct work_struct *work)
+{
+	struct ovpn_struct *ovpn;
+	struct ovpn_sample_cpu *sc;
+	struct sk_buff *msg;
+	int cpu;
+
+	ovpn = container_of(to_delayed_work(work), struct ovpn_struct,
+			    sample_flush);
+
+	for_each_possible_cpu(cpu) {
+		sc = per_cpu_ptr(ovpn->sample, cpu);
+
+		spin_lock_bh(&sc->lock);
+		msg = ovpn_sample_batch_take(sc);
+		spin_unlock_bh(&sc->lock);
+
+		if (msg)
+			ovpn_netlink_samples_send(ovpn, msg);
+	}
+}
+
+/* Configure the sampling rate of a peer: 1 packet out of rate is exported in
+ * each direction. 0 disables sampling
+ */
+void ovpn_peer_sample_set(struct ovpn_peer *peer, u32 rate)
+{
+	pr_debug("%s: sampling rate set to 1/%u\n", peer->ovpn->dev->name,
+		 rate);
+
+	WRITE_ONCE(peer->sample.rate, rate);
+}
+
+int ovpn_sample_init(struct ovpn_struct *ovpn)
+{
+	struct ovpn_sample_cpu *sc;
+	int cpu;
+
+	ovpn->sample = alloc_percpu(struct ovpn_sample_cpu);
+	if (!ovpn->sample)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		sc = per_cpu_ptr(ovpn->sample, cpu);
+		spin_lock_init(&sc->lock);
+	}
+
+	INIT_DELAYED_WORK(&ovpn->sample_flush, ovpn_sample_flush);
+
+	return 0;
+}
+
+/* drop pending samples and release the sampling state. Must be called once
+ * the datapath is stopped
+ */
+void ovpn_sample_release(struct ovpn_struct *ovpn)
+{
+	struct ovpn_sample_cpu *sc;
+	int cpu;
+
+	if (!ovpn->sample)
+		return;
+
+	cancel_delayed_work_sync(&ovpn->sample_flush);
+
+	for_each_possible_cpu(cpu) {
+		sc = per_cpu_ptr(ovpn->sample, cpu);
+		nlmsg_free(sc->msg);
+	}
+
+	free_percpu(ovpn->sample);
+	ovpn->sample = NULL;
+}
@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_DCO_OVPNSAMPLE_H_
+#define _NET_OVPN_DCO_OVPNSAMPLE_H_
+
+#include "peer.h"
+
+#include <uapi/linux/ovpn_dco.h>
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* largest supported sampling rate (1 packet out of N) */
+#define OVPN_SAMPLE_RATE_MAX (1U << 24)
+
+struct ovpn_struct;
+
+/* per-CPU sampling state of an ovpn interface */
+struct ovpn_sample_cpu {
+	/* protects the batch against the periodic flush */
+	spinlock_t lock;
+	/* packets left before the next one is sampled */
+	u32 countdown;
+	/* OVPN_CMD_SAMPLES message being filled, NULL if none */
+	struct sk_buff *msg;
+	void *hdr;
+	unsigned int n;
+};
+
+int ovpn_sample_init(struct ovpn_struct *ovpn);
+void ovpn_sample_release(struct ovpn_struct *ovpn);
+void ovpn_peer_sample_set(struct ovpn_peer *peer, u32 rate);
+void __ovpn_sample(struct ovpn_peer *peer, struct sk_buff *skb,
+		   enum ovpn_sample_dir dir, int peer_id, int key_id);
+
+/* Export 1 out of peer->sample.rate packets to userspace. skb->data must
+ * point to the inner IP header
+ */
+static inline void ovpn_sample(struct ovpn_peer *peer, struct sk_buff *skb,
+			       enum ovpn_sample_dir dir, int peer_id,
+			       int key_id)
+{
+	if (likely(!READ_ONCE(peer->sample.rate)))
+		return;
+
+	__ovpn_sample(peer, skb, dir, peer_id, key_id);
+}
+
+#endif /* _NET_OVPN_DCO_OVPNSAMPLE_H_ */
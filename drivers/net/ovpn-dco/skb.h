@@ -21,6 +21,12 @@ struct ovpn_skb_cb {
 
 	/* OpenVPN packet ID */
 	u32 pktid;
+
+	/* set by ovpn_skb_parse_inner() on decrypted packets: offset of the
+	 * transport header from the network header and transport protocol
+	 */
+	u16 thoff;
+	u8 l4proto;
 };
 
 /* READ_ONCE version of skb_queue_len()
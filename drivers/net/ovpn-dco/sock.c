@@ -9,63 +9,190 @@
 
 #include "main.h"
 #include "ovpn.h"
+#include "ovpnstruct.h"
 #include "peer.h"
+#include "proto.h"
 #include "sock.h"
 #include "rcu.h"
 #include "tcp.h"
 #include "udp.h"
 
+#include <linux/mutex.h>
+#include <linux/slab.h>
 #include <net/udp.h>
 #include <net/udp_tunnel.h>
 
-/* Detach socket from encapsulation handler and/or other callbacks */
-static void ovpn_sock_unset_udp_cb(struct socket *sock)
+/* serializes attaching and detaching interfaces to UDP sockets */
+static DEFINE_MUTEX(ovpn_udp_sock_mutex);
+
+static void ovpn_udp_sock_free_rcu(struct rcu_head *head)
+{
+	struct ovpn_udp_socket *usock = container_of(head,
+						     struct ovpn_udp_socket,
+						     rcu);
+
+	kfree(usock->shared);
+	kfree(usock);
+}
+
+/* Detach an interface from its UDP socket. The encapsulation handler and the
+ * original callbacks are restored once the last interface is gone
+ */
+static void ovpn_sock_unset_udp_cb(struct ovpn_struct *ovpn,
+				   struct socket *sock)
 {
 	struct udp_tunnel_sock_cfg cfg = { };
+	struct ovpn_udp_socket *usock;
+
+	mutex_lock(&ovpn_udp_sock_mutex);
+	usock = ovpn->udp_sock;
+	if (!usock)
+		goto unlock;
+
+	if (rcu_access_pointer(usock->ovpn))
+		RCU_INIT_POINTER(usock->ovpn, NULL);
+	else
+		hash_del_rcu(&ovpn->udp_hnode);
+	ovpn->udp_sock = NULL;
+
+	if (--usock->count)
+		goto unlock;
+
+	/* restore the CB that was saved in ovpn_sock_attach_udp() */
+	write_lock_bh(&sock->sk->sk_callback_lock);
+	sock->sk->sk_write_space = usock->sk_write_space;
+	write_unlock_bh(&sock->sk->sk_callback_lock);
 
 	setup_udp_tunnel_sock(sock_net(sock->sk), sock, &cfg);
+	call_rcu(&usock->rcu, ovpn_udp_sock_free_rcu);
+unlock:
+	mutex_unlock(&ovpn_udp_sock_mutex);
+
+	/* the socket may still be serving other interfaces: make sure no
+	 * reader can find this one anymore before it goes away
+	 */
+	synchronize_net();
 	sockfd_put(sock);
 }
 
-/* Finalize release of socket, called after RCU grace period */
-void ovpn_sock_detach(struct socket *sock)
+/* Finalize release of socket */
+void ovpn_sock_detach(struct ovpn_struct *ovpn, struct socket *sock)
 {
 	if (!sock)
 		return;
 
 	if (sock->sk->sk_protocol == IPPROTO_UDP)
-		ovpn_sock_unset_udp_cb(sock);
-	else if (sock->sk->sk_protocol == IPPROTO_TCP)
+		ovpn_sock_unset_udp_cb(ovpn, sock);
+	else if (ovpn_sock_is_stream(sock->sk))
 		ovpn_tcp_sock_detach(sock);
 }
 
-/* Set UDP encapsulation callbacks */
-int ovpn_sock_attach_udp(struct socket *sock, struct ovpn_struct *ovpn)
+/* must be called under RCU read lock */
+static struct ovpn_struct *
+ovpn_udp_sock_lookup(struct ovpn_udp_socket *usock, u32 peer_id)
+{
+	struct ovpn_struct *ovpn;
+
+	/* an exclusive socket being detached */
+	if (unlikely(!usock->shared))
+		return NULL;
+
+	hash_for_each_possible_rcu(usock->shared->ovpn_by_peer_id, ovpn,
+				   udp_hnode, peer_id)
+		if (ovpn->peer_id == peer_id)
+			return ovpn;
+
+	return NULL;
+}
+
+/* Set UDP encapsulation callbacks.
+ *
+ * If shared is true, the socket can be attached to other interfaces as well
+ * and packets are demultiplexed by ovpn->peer_id. Otherwise the interface
+ * takes the socket for itself
+ */
+int ovpn_sock_attach_udp(struct socket *sock, struct ovpn_struct *ovpn,
+			 bool shared)
 {
 	struct udp_tunnel_sock_cfg cfg = {
-		.sk_user_data = ovpn,
 		.encap_type = UDP_ENCAP_OVPNINUDP,
 		.encap_rcv = ovpn_udp_encap_recv,
 	};
-	void *old_data;
+	struct ovpn_udp_socket *usock;
+	int ret = 0;
 
 	if (sock->sk->sk_protocol != IPPROTO_UDP) {
 		pr_err("%s: expected UDP socket\n", __func__);
 		return -EINVAL;
 	}
 
-	/* make sure no pre-existing encapsulation handler exists */
+	mutex_lock(&ovpn_udp_sock_mutex);
+
 	rcu_read_lock();
-	old_data = rcu_dereference_sk_user_data(sock->sk);
+	usock = rcu_dereference_sk_user_data(sock->sk);
 	rcu_read_unlock();
-	if (old_data) {
-		pr_err("provided socket already taken by other user\n");
-		return -EBUSY;
+	if (usock) {
+		/* make sure the socket is an ovpn one open to sharing */
+		if (READ_ONCE(udp_sk(sock->sk)->encap_type) !=
+		    UDP_ENCAP_OVPNINUDP || !shared || !usock->shared) {
+			pr_err("provided socket already taken by other user\n");
+			ret = -EBUSY;
+			goto unlock;
+		}
+
+		rcu_read_lock();
+		ret = ovpn_udp_sock_lookup(usock, ovpn->peer_id) ? -EEXIST : 0;
+		rcu_read_unlock();
+		if (ret < 0) {
+			pr_err("peer-id %u already in use on the provided socket\n",
+			       ovpn->peer_id);
+			goto unlock;
+		}
+
+		hash_add_rcu(usock->shared->ovpn_by_peer_id, &ovpn->udp_hnode,
+			     ovpn->peer_id);
+		usock->count++;
+		ovpn->udp_sock = usock;
+		goto unlock;
 	}
 
-	setup_udp_tunnel_sock(sock_net(sock->sk), sock, &cfg);
+	usock = kzalloc(sizeof(*usock), GFP_KERNEL);
+	if (!usock) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
 
-	return 0;
+	if (shared) {
+		usock->shared = kzalloc(sizeof(*usock->shared), GFP_KERNEL);
+		if (!usock->shared) {
+			kfree(usock);
+			ret = -ENOMEM;
+			goto unlock;
+		}
+
+		hash_init(usock->shared->ovpn_by_peer_id);
+		hash_add_rcu(usock->shared->ovpn_by_peer_id, &ovpn->udp_hnode,
+			     ovpn->peer_id);
+	} else {
+		RCU_INIT_POINTER(usock->ovpn, ovpn);
+	}
+	usock->count = 1;
+	ovpn->udp_sock = usock;
+
+	/* encrypted packets are charged to the socket send buffer: get
+	 * notified when they leave the lower device so that a throttled
+	 * encrypt_work can be resumed
+	 */
+	write_lock_bh(&sock->sk->sk_callback_lock);
+	usock->sk_write_space = sock->sk->sk_write_space;
+	sock->sk->sk_write_space = ovpn_udp_write_space;
+	write_unlock_bh(&sock->sk->sk_callback_lock);
+
+	cfg.sk_user_data = usock;
+	setup_udp_tunnel_sock(sock_net(sock->sk), sock, &cfg);
+unlock:
+	mutex_unlock(&ovpn_udp_sock_mutex);
+	return ret;
 }
 
 /* Return the encapsulation overhead of the socket */
@@ -79,20 +206,43 @@ int ovpn_sock_holder_encap_overhead(struct socket *sock)
 	return ret;
 }
 
-struct ovpn_struct *ovpn_from_udp_sock(struct sock *sk)
+/* Find the interface a packet received on an ovpn UDP socket belongs to.
+ * skb->data must point to the UDP payload.
+ *
+ * Return NULL if the packet has to be dropped or ERR_PTR(-ENOENT) if the
+ * socket is shared and the packet is not a data channel packet: it is then up
+ * to the process owning the socket to handle it.
+ */
+struct ovpn_struct *ovpn_from_udp_sock(struct sock *sk, struct sk_buff *skb)
 {
+	struct ovpn_udp_socket *usock;
 	struct ovpn_struct *ovpn;
 	struct ovpn_peer *peer;
+	int peer_id = -1;
+	u32 op;
 
 	ovpn_rcu_lockdep_assert_held();
 
 	if (unlikely(READ_ONCE(udp_sk(sk)->encap_type) != UDP_ENCAP_OVPNINUDP))
 		return NULL;
 
-	ovpn = rcu_dereference_sk_user_data(sk);
-	if (unlikely(!ovpn))
+	usock = rcu_dereference_sk_user_data(sk);
+	if (unlikely(!usock))
 		return NULL;
 
+	ovpn = rcu_dereference(usock->ovpn);
+	if (!ovpn) {
+		op = ovpn_op32_from_skb(skb, &peer_id);
+		if (!ovpn_opcode_is_data_v2(op))
+			return ERR_PTR(-ENOENT);
+		if (peer_id < 0)
+			return NULL;
+
+		ovpn = ovpn_udp_sock_lookup(usock, peer_id);
+		if (unlikely(!ovpn))
+			return NULL;
+	}
+
 	peer = rcu_dereference(ovpn->peer);
 	if (unlikely(!peer))
 		return NULL;
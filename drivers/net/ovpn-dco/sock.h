@@ -10,14 +10,62 @@
 #ifndef _NET_OVPN_DCO_SOCK_H_
 #define _NET_OVPN_DCO_SOCK_H_
 
+#include <linux/hashtable.h>
+#include <linux/in.h>
 #include <net/sock.h>
 
 struct ovpn_struct;
 
-int ovpn_sock_attach_udp(struct socket *sock, struct ovpn_struct *ovpn);
-void ovpn_sock_detach(struct socket *sock);
+/* bits of the table of interfaces sharing a UDP socket */
+#define OVPN_UDP_SOCK_HASH_BITS 10
+
+/* interfaces sharing a UDP socket, hashed by peer-id */
+struct ovpn_udp_sock_shared {
+	DECLARE_HASHTABLE(ovpn_by_peer_id, OVPN_UDP_SOCK_HASH_BITS);
+};
+
+/* UDP socket used as transport by one or more ovpn interfaces, stored in the
+ * socket sk_user_data.
+ * An interface either owns the socket alone, or shares it with others: in
+ * the latter case each interface is identified by the peer-id carried by
+ * the data packets of its peer
+ */
+struct ovpn_udp_socket {
+	/* interface owning the socket, NULL if the socket is shared */
+	struct ovpn_struct __rcu *ovpn;
+	/* interfaces sharing the socket, only allocated if the socket is
+	 * shared. Never changes after the socket is set up
+	 */
+	struct ovpn_udp_sock_shared *shared;
+	/* number of attached interfaces, protected by ovpn_udp_sock_mutex */
+	unsigned int count;
+	/* set when one of the attached interfaces waits for write space */
+	atomic_t throttled;
+	/* original sk_write_space, restored on detach */
+	void (*sk_write_space)(struct sock *sk);
+	struct rcu_head rcu;
+};
+
+int ovpn_sock_attach_udp(struct socket *sock, struct ovpn_struct *ovpn,
+			 bool shared);
+void ovpn_sock_detach(struct ovpn_struct *ovpn, struct socket *sock);
 int ovpn_sock_holder_encap_overhead(struct socket *sock);
-struct ovpn_struct *ovpn_from_udp_sock(struct sock *sk);
+struct ovpn_struct *ovpn_from_udp_sock(struct sock *sk, struct sk_buff *skb);
+
+/* MPTCP sockets offer the same stream semantics as TCP ones and are handled
+ * by the TCP transport code: the socket passed by userspace is the MPTCP
+ * master socket and subflows are entirely managed by the MPTCP stack
+ */
+static inline bool ovpn_sock_is_stream(const struct sock *sk)
+{
+	if (sk->sk_protocol == IPPROTO_TCP)
+		return true;
+#if IS_ENABLED(CONFIG_MPTCP)
+	if (sk->sk_protocol == IPPROTO_MPTCP)
+		return true;
+#endif
+	return false;
+}
 
 static inline int ovpn_sock_encap_overhead(const struct sock *sk)
 {
@@ -10,14 +10,102 @@
 #include "main.h"
 #include "stats.h"
 
+#include <linux/math64.h>
+
+/* weight of a new sample in the rate estimators is 1 / 2^OVPN_RATE_EWMA_SHIFT */
+#define OVPN_RATE_EWMA_SHIFT 2
+/* after this many intervals the previous estimate is negligible */
+#define OVPN_RATE_MAX_STEPS 32
+
+static void ovpn_peer_stat_init(struct ovpn_peer_stat *stat)
+{
+	atomic64_set(&stat->bytes, 0);
+	atomic64_set(&stat->packets, 0);
+	stat->notify = 0;
+	memset(&stat->rate, 0, sizeof(stat->rate));
+	stat->rate.stamp = jiffies;
+}
+
 void ovpn_peer_stats_init(struct ovpn_peer_stats *ps)
 {
-	atomic64_set(&ps->rx.bytes, 0);
-	ps->rx.notify = 0;
-	atomic64_set(&ps->tx.bytes, 0);
-	ps->tx.notify = 0;
+	ovpn_peer_stat_init(&ps->rx);
+	ovpn_peer_stat_init(&ps->tx);
 	ps->notify_per = 0;
 	ps->period = 0 * HZ;
 	ps->revisit = jiffies + ps->period;
 	spin_lock_init(&ps->lock);
 }
+
+/* fold sample into avg once per elapsed interval, so that an idle peer
+ * decays as if it had been updated regularly
+ */
+static u64 ovpn_rate_ewma(u64 avg, u64 sample, unsigned long steps)
+{
+	if (steps > OVPN_RATE_MAX_STEPS)
+		return sample;
+
+	while (steps--)
+		avg = avg - (avg >> OVPN_RATE_EWMA_SHIFT) +
+		      (sample >> OVPN_RATE_EWMA_SHIFT);
+
+	return avg;
+}
+
+static void __ovpn_peer_stat_rate_update(struct ovpn_peer_stat *stat,
+					 unsigned long now)
+{
+	struct ovpn_peer_rate *rate = &stat->rate;
+	unsigned long elapsed = now - rate->stamp;
+	unsigned long steps = elapsed / OVPN_RATE_INTERVAL;
+	u64 bytes, packets;
+
+	if (!steps)
+		return;
+
+	bytes = atomic64_read(&stat->bytes);
+	packets = atomic64_read(&stat->packets);
+
+	rate->bytes = ovpn_rate_ewma(rate->bytes,
+				     div64_u64((bytes - rate->last_bytes) * HZ,
+					       elapsed), steps);
+	rate->packets = ovpn_rate_ewma(rate->packets,
+				       div64_u64((packets - rate->last_packets) * HZ,
+						 elapsed), steps);
+
+	rate->last_bytes = bytes;
+	rate->last_packets = packets;
+	rate->stamp = now;
+}
+
+/* Called from the datapath once OVPN_RATE_INTERVAL has elapsed since the last
+ * update. If somebody else holds the lock, they are likely doing the same and
+ * the update is skipped
+ */
+void ovpn_peer_stat_rate_update(struct ovpn_peer_stats *ps,
+				struct ovpn_peer_stat *stat)
+{
+	if (!spin_trylock_bh(&ps->lock))
+		return;
+
+	__ovpn_peer_stat_rate_update(stat, jiffies);
+	spin_unlock_bh(&ps->lock);
+}
+
+/* Read the current rates. The estimators are brought up to date first, so
+ * that peers which went idle are not reported at their last busy rate
+ */
+void ovpn_peer_stats_get_rates(struct ovpn_peer_stats *ps,
+			       struct ovpn_peer_rates *rates)
+{
+	unsigned long now = jiffies;
+
+	spin_lock_bh(&ps->lock);
+	__ovpn_peer_stat_rate_update(&ps->rx, now);
+	__ovpn_peer_stat_rate_update(&ps->tx, now);
+
+	rates->rx_bps = ps->rx.rate.bytes * 8;
+	rates->rx_pps = ps->rx.rate.packets;
+	rates->tx_bps = ps->tx.rate.bytes * 8;
+	rates->tx_pps = ps->tx.rate.packets;
+	spin_unlock_bh(&ps->lock);
+}
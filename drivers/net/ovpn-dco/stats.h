@@ -11,6 +11,7 @@
 #ifndef _NET_OVPN_DCO_OVPNSTATS_H_
 #define _NET_OVPN_DCO_OVPNSTATS_H_
 
+#include <linux/cache.h>
 #include <linux/jiffies.h>
 #include <linux/u64_stats_sync.h>
 
@@ -18,17 +19,39 @@ struct ovpn_struct;
 
 /* per-peer stats, measured on transport layer */
 
+/* minimum time between two updates of the rate estimators */
+#define OVPN_RATE_INTERVAL HZ
+
+/* EWMA rate estimator, protected by ovpn_peer_stats->lock */
+struct ovpn_peer_rate {
+	/* bytes and packets per second */
+	u64 bytes;
+	u64 packets;
+	/* counters and time of the last update */
+	u64 last_bytes;
+	u64 last_packets;
+	unsigned long stamp;
+};
+
 /* one stat */
 struct ovpn_peer_stat {
 	atomic64_t bytes;
+	atomic64_t packets;
 	/* notify userspace when bytes exceeds this value */
 	u64 notify;
+	struct ovpn_peer_rate rate;
+};
+
+/* snapshot of the rate estimators of a peer */
+struct ovpn_peer_rates {
+	u64 rx_bps;
+	u64 rx_pps;
+	u64 tx_bps;
+	u64 tx_pps;
 };
 
 /* rx and tx stats, enabled by notify_per != 0 or period != 0 */
 struct ovpn_peer_stats {
-	struct ovpn_peer_stat rx;
-	struct ovpn_peer_stat tx;
 	/* configured bandwidth-triggered notification */
 	u64 notify_per;
 	/* configured time-triggered notification (relative jiffies) */
@@ -37,6 +60,11 @@ struct ovpn_peer_stats {
 	unsigned long revisit;
 	/* protects the ovpn_peer_stats object */
 	spinlock_t lock;
+	/* rx and tx are updated by different CPUs: keep them apart from each
+	 * other and from the read-mostly config above
+	 */
+	struct ovpn_peer_stat rx ____cacheline_aligned_in_smp;
+	struct ovpn_peer_stat tx ____cacheline_aligned_in_smp;
 };
 
 /* struct for OVPN_ERR_STATS */
@@ -56,5 +84,9 @@ struct ovpn_err_stats {
 };
 
 void ovpn_peer_stats_init(struct ovpn_peer_stats *ps);
+void ovpn_peer_stat_rate_update(struct ovpn_peer_stats *ps,
+				struct ovpn_peer_stat *stat);
+void ovpn_peer_stats_get_rates(struct ovpn_peer_stats *ps,
+			       struct ovpn_peer_rates *rates);
 
 #endif /* _NET_OVPN_DCO_OVPNSTATS_H_ */
@@ -20,6 +20,13 @@ static inline bool ovpn_peer_stats_increment(struct ovpn_peer_stats *stats,
 	const u64 newval = atomic64_add_return(n, &stat->bytes);
 	bool notify_trigger = false;
 
+	atomic64_inc(&stat->packets);
+
+	/* rate estimators are updated lazily, at most once per interval */
+	if (unlikely(time_after_eq(jiffies, READ_ONCE(stat->rate.stamp) +
+					    OVPN_RATE_INTERVAL)))
+		ovpn_peer_stat_rate_update(stats, stat);
+
 	/* for performance, first check for trigger conditions
 	 * before we grab spinlock
 	 */
@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#include "main.h"
+#include "ovpnstruct.h"
+#include "steering.h"
+
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+
+#define OVPN_RX_CPU_KICK_PENDING 0
+
+static int ovpn_rx_cpu_poll(struct napi_struct *napi, int budget)
+{
+	struct ovpn_rx_cpu *rxc = container_of(napi, struct ovpn_rx_cpu, napi);
+	struct sk_buff *skb;
+	int work_done = 0;
+
+	while (work_done < budget) {
+		spin_lock(&rxc->queue.lock);
+		skb = __skb_dequeue(&rxc->queue);
+		spin_unlock(&rxc->queue.lock);
+		if (!skb)
+			break;
+
+		napi_gro_receive(napi, skb);
+		work_done++;
+	}
+
+	/* a producer finding the queue empty schedules us again: if this
+	 * happens while we are still running, napi takes care of polling
+	 * once more after completion
+	 */
+	if (work_done < budget)
+		napi_complete_done(napi, work_done);
+
+	return work_done;
+}
+
+/* runs on the target CPU in hardirq context */
+static void ovpn_rx_cpu_ipi(void *data)
+{
+	struct ovpn_rx_cpu *rxc = data;
+
+	clear_bit(OVPN_RX_CPU_KICK_PENDING, &rxc->state);
+	napi_schedule(&rxc->napi);
+}
+
+static void ovpn_rx_cpu_kick(struct ovpn_rx_cpu *rxc, unsigned int cpu)
+{
+	if (cpu == smp_processor_id()) {
+		napi_schedule(&rxc->napi);
+		return;
+	}
+
+	/* an IPI is already on its way, it will take care of this skb too */
+	if (test_and_set_bit(OVPN_RX_CPU_KICK_PENDING, &rxc->state))
+		return;
+
+	if (unlikely(smp_call_function_single_async(cpu, &rxc->csd))) {
+		/* target CPU went offline: deliver from here */
+		clear_bit(OVPN_RX_CPU_KICK_PENDING, &rxc->state);
+		napi_schedule(&rxc->napi);
+	}
+}
+
+/* Steer a decrypted packet to the CPU selected by its inner flow hash.
+ *
+ * All packets of a flow are queued to the same CPU, in the order they were
+ * decrypted, so that no reordering is introduced within a flow.
+ *
+ * Return true if the skb was consumed, false if steering is disabled and the
+ * caller should deliver the packet itself.
+ */
+bool ovpn_rx_steer(struct ovpn_struct *ovpn, struct sk_buff *skb)
+{
+	struct ovpn_rx_steering *st;
+	struct ovpn_rx_cpu *rxc;
+	unsigned int cpu;
+	bool kick;
+
+	rcu_read_lock();
+	st = rcu_dereference(ovpn->rx_steering);
+	if (likely(!st)) {
+		rcu_read_unlock();
+		return false;
+	}
+
+	cpu = st->cpus[reciprocal_scale(skb_get_hash(skb), st->n_cpus)];
+	rxc = per_cpu_ptr(st->rx_cpu, cpu);
+
+	spin_lock(&rxc->queue.lock);
+	if (unlikely(skb_queue_len(&rxc->queue) >= OVPN_QUEUE_LEN)) {
+		spin_unlock(&rxc->queue.lock);
+		rcu_read_unlock();
+		kfree_skb(skb);
+		return true;
+	}
+	kick = skb_queue_empty(&rxc->queue);
+	__skb_queue_tail(&rxc->queue, skb);
+	spin_unlock(&rxc->queue.lock);
+
+	if (kick)
+		ovpn_rx_cpu_kick(rxc, cpu);
+	rcu_read_unlock();
+
+	return true;
+}
+
+static void ovpn_rx_steering_free(struct ovpn_rx_steering *st)
+{
+	struct ovpn_rx_cpu *rxc;
+	unsigned int i;
+
+	for (i = 0; i < st->n_cpus; i++) {
+		rxc = per_cpu_ptr(st->rx_cpu, st->cpus[i]);
+
+		/* the csd must not be freed while it is still queued */
+		while (test_bit(OVPN_RX_CPU_KICK_PENDING, &rxc->state))
+			cpu_relax();
+
+		napi_disable(&rxc->napi);
+		netif_napi_del(&rxc->napi);
+		skb_queue_purge(&rxc->queue);
+	}
+
+	free_percpu(st->rx_cpu);
+	kfree(st);
+}
+
+static void ovpn_rx_steering_replace(struct ovpn_struct *ovpn,
+				     struct ovpn_rx_steering *new)
+{
+	struct ovpn_rx_steering *old;
+
+	spin_lock_bh(&ovpn->lock);
+	old = rcu_replace_pointer(ovpn->rx_steering, new,
+				  lockdep_is_held(&ovpn->lock));
+	spin_unlock_bh(&ovpn->lock);
+
+	if (!old)
+		return;
+
+	/* wait for in-flight ovpn_rx_steer() calls to be done with old */
+	synchronize_net();
+	ovpn_rx_steering_free(old);
+}
+
+/* Distribute decrypted packets across the CPUs in mask (restricted to the
+ * online ones). An empty mask disables steering.
+ */
+int ovpn_rx_steering_set(struct ovpn_struct *ovpn, const struct cpumask *mask)
+{
+	struct ovpn_rx_steering *st;
+	struct ovpn_rx_cpu *rxc;
+	unsigned int cpu, n = 0;
+
+	if (cpumask_empty(mask)) {
+		ovpn_rx_steering_replace(ovpn, NULL);
+		return 0;
+	}
+
+	if (!cpumask_intersects(mask, cpu_online_mask))
+		return -EINVAL;
+
+	st = kzalloc(struct_size(st, cpus, cpumask_weight(mask)), GFP_KERNEL);
+	if (!st)
+		return -ENOMEM;
+
+	st->rx_cpu = alloc_percpu(struct ovpn_rx_cpu);
+	if (!st->rx_cpu) {
+		kfree(st);
+		return -ENOMEM;
+	}
+
+	for_each_cpu_and(cpu, mask, cpu_online_mask) {
+		rxc = per_cpu_ptr(st->rx_cpu, cpu);
+
+		skb_queue_head_init(&rxc->queue);
+		INIT_CSD(&rxc->csd, ovpn_rx_cpu_ipi, rxc);
+		netif_napi_add(ovpn->dev, &rxc->napi, ovpn_rx_cpu_poll,
+			       NAPI_POLL_WEIGHT);
+		napi_enable(&rxc->napi);
+
+		st->cpus[n++] = cpu;
+	}
+	st->n_cpus = n;
+
+	ovpn_rx_steering_replace(ovpn, st);
+
+	pr_debug("%s: steering RX over %u CPUs\n", ovpn->dev->name, n);
+
+	return 0;
+}
+
+/* Disable steering and release its resources. Must be called from process
+ * context
+ */
+void ovpn_rx_steering_clear(struct ovpn_struct *ovpn)
+{
+	ovpn_rx_steering_replace(ovpn, NULL);
+}
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*  OpenVPN data channel accelerator
+ *
+ *  Copyright (C) 2021 OpenVPN, Inc.
+ *
+ *  Author:	Antonio Quartulli <antonio@openvpn.net>
+ */
+
+#ifndef _NET_OVPN_DCO_OVPNSTEERING_H_
+#define _NET_OVPN_DCO_OVPNSTEERING_H_
+
+#include <linux/cpumask.h>
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/smp.h>
+#include <linux/types.h>
+
+struct ovpn_struct;
+
+/* delivery queue of decrypted packets steered to one CPU */
+struct ovpn_rx_cpu {
+	/* filled by the peer NAPI, drained by napi on the target CPU */
+	struct sk_buff_head queue;
+	struct napi_struct napi;
+	/* IPI used to schedule napi on the target CPU */
+	call_single_data_t csd;
+	/* OVPN_RX_CPU_KICK_PENDING is set while csd is in flight */
+	unsigned long state;
+};
+
+/* RX steering configuration of an ovpn interface */
+struct ovpn_rx_steering {
+	struct ovpn_rx_cpu __percpu *rx_cpu;
+	/* CPUs packets are distributed to, indexed by inner flow hash */
+	unsigned int n_cpus;
+	unsigned int cpus[];
+};
+
+int ovpn_rx_steering_set(struct ovpn_struct *ovpn, const struct cpumask *mask);
+void ovpn_rx_steering_clear(struct ovpn_struct *ovpn);
+bool ovpn_rx_steer(struct ovpn_struct *ovpn, struct sk_buff *skb);
+
+#endif /* _NET_OVPN_DCO_OVPNSTEERING_H_ */
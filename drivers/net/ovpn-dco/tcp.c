@@ -16,6 +16,16 @@
 #include <linux/skbuff.h>
 #include <net/route.h>
 
+/* packets up to this size are received into a linear skb fitting in a page,
+ * larger ones into page fragments after OVPN_TCP_RX_HEAD_LEN linear bytes,
+ * enough for the data channel header and the inner IP and transport headers
+ */
+#define OVPN_TCP_RX_LINEAR_MAX SKB_MAX_HEAD(NET_SKB_PAD + NET_IP_ALIGN)
+#define OVPN_TCP_RX_HEAD_LEN 256
+
+/* delay before retrying to receive after an allocation failure */
+#define OVPN_TCP_RX_RETRY_DELAY (HZ / 10)
+
 static void ovpn_tcp_state_change(struct sock *sk)
 {
 }
@@ -34,7 +44,8 @@ static void ovpn_tcp_data_ready(struct sock *sk)
 	if (!peer)
 		return;
 
-	queue_work(peer->ovpn->events_wq, &peer->tcp.rx_work);
+	/* run now, even if a retry was scheduled after an allocation failure */
+	mod_delayed_work(peer->ovpn->events_wq, &peer->tcp.rx_work, 0);
 	ovpn_peer_put(peer);
 }
 
@@ -81,7 +92,7 @@ void ovpn_tcp_sock_detach(struct socket *sock)
 	 * re-armed
 	 */
 	cancel_work_sync(&peer->tcp.tx_work);
-	cancel_work_sync(&peer->tcp.rx_work);
+	cancel_delayed_work_sync(&peer->tcp.rx_work);
 
 	ovpn_peer_put(peer);
 
@@ -108,9 +119,9 @@ int ovpn_tcp_sock_attach(struct socket *sock, struct ovpn_peer *peer)
 		goto out;
 	}
 
-	/* verify UDP socket */
-	if (sock->sk->sk_protocol != IPPROTO_TCP) {
-		pr_err("expected TCP socket\n");
+	/* verify TCP (or MPTCP) socket */
+	if (!ovpn_sock_is_stream(sock->sk)) {
+		pr_err("expected TCP or MPTCP socket\n");
 		ret = -EINVAL;
 		goto out;
 	}
@@ -137,18 +148,27 @@ out:
 	return ret;
 }
 
-/* Try to send one skb (or part of it) over the TCP stream.
- *
- * Return 0 on success or a negative error code otherwise.
- *
- * Note that the skb is modified by putting away the data being sent, therefore
- * the caller should check if skb->len is zero to understand if the full skb was
- * sent or not.
+/* Send skb from offset off with skb_send_sock_locked(): the pages in the skb
+ * frags are referenced by the socket, while the linear part is still copied.
+ * Only plain TCP implements this, MPTCP sockets go through kernel_sendmsg()
  */
-static int ovpn_tcp_send_one(struct ovpn_struct *ovpn, struct sk_buff *skb)
+static int ovpn_tcp_send_sock(struct sock *sk, struct sk_buff *skb,
+			      unsigned int off)
+{
+	int ret;
+
+	lock_sock(sk);
+	ret = skb_send_sock_locked(sk, skb, off, skb->len - off);
+	release_sock(sk);
+
+	return ret;
+}
+
+static int ovpn_tcp_send_copy(struct socket *sock, struct sk_buff *skb,
+			      unsigned int off)
 {
 	struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL };
-	struct kvec iv = { .iov_base = skb->data, .iov_len = skb->len };
+	struct kvec iv;
 	int ret;
 
 	if (skb_linearize(skb) < 0) {
@@ -156,9 +176,34 @@ static int ovpn_tcp_send_one(struct ovpn_struct *ovpn, struct sk_buff *skb)
 		return -ENOMEM;
 	}
 
-	ret = kernel_sendmsg(ovpn->sock, &msg, &iv, 1, iv.iov_len);
+	iv.iov_base = skb->data + off;
+	iv.iov_len = skb->len - off;
+
+	return kernel_sendmsg(sock, &msg, &iv, 1, iv.iov_len);
+}
+
+/* Try to send one skb (or the part of it still pending) over the TCP stream.
+ *
+ * Return 0 on success or a negative error code otherwise.
+ *
+ * The skb is left untouched: the amount of data sent is tracked in
+ * peer->tcp.tx_offset, therefore the caller should compare it with skb->len to
+ * understand if the full skb was sent or not.
+ */
+static int ovpn_tcp_send_one(struct ovpn_peer *peer, struct sk_buff *skb)
+{
+	struct ovpn_struct *ovpn = peer->ovpn;
+	unsigned int off = peer->tcp.tx_offset;
+	struct sock *sk = ovpn->sock->sk;
+	int ret;
+
+	if (sk->sk_protocol == IPPROTO_TCP)
+		ret = ovpn_tcp_send_sock(sk, skb, off);
+	else
+		ret = ovpn_tcp_send_copy(ovpn->sock, skb, off);
+
 	if (ret > 0) {
-		__skb_pull(skb, ret);
+		peer->tcp.tx_offset += ret;
 
 		/* since we update per-cpu stats in process context,
 		 * we need to disable softirqs
@@ -182,7 +227,7 @@ void ovpn_tcp_tx_work(struct work_struct *work)
 
 	peer = container_of(work, struct ovpn_peer, tcp.tx_work);
 	while ((skb = __ptr_ring_peek(&peer->tcp.tx_ring))) {
-		ret = ovpn_tcp_send_one(peer->ovpn, skb);
+		ret = ovpn_tcp_send_one(peer, skb);
 		if (ret < 0 && ret != -EAGAIN) {
 			pr_warn_ratelimited("%s: cannot send TCP packet: %d\n", __func__, ret);
 			/* in case of TCP error stop sending loop, and, if peer is
@@ -190,10 +235,11 @@ void ovpn_tcp_tx_work(struct work_struct *work)
 			 */
 			ovpn_peer_evict(peer, OVPN_DEL_PEER_REASON_TRANSPORT_ERROR);
 			break;
-		} else if (!skb->len) {
+		} else if (peer->tcp.tx_offset == skb->len) {
 			/* skb was entirely consumed and can now be removed from the ring */
 			__ptr_ring_discard_one(&peer->tcp.tx_ring);
 			consume_skb(skb);
+			peer->tcp.tx_offset = 0;
 		}
 
 		/* give a chance to be rescheduled if needed */
@@ -202,6 +248,63 @@ void ovpn_tcp_tx_work(struct work_struct *work)
 	}
 }
 
+/* Allocate the skb receiving a packet of len bytes, already sized to hold
+ * it. Large packets are not put in a linear buffer, which would require a
+ * high-order allocation
+ */
+static struct sk_buff *ovpn_tcp_rx_alloc(struct net_device *dev, u16 len)
+{
+	unsigned int pad = NET_SKB_PAD + NET_IP_ALIGN;
+	struct sk_buff *skb;
+	int err;
+
+	if (len <= OVPN_TCP_RX_LINEAR_MAX) {
+		skb = netdev_alloc_skb_ip_align(dev, len);
+		if (skb)
+			skb_put(skb, len);
+		return skb;
+	}
+
+	skb = alloc_skb_with_frags(pad + OVPN_TCP_RX_HEAD_LEN,
+				   len - OVPN_TCP_RX_HEAD_LEN,
+				   PAGE_ALLOC_COSTLY_ORDER, &err, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	skb_reserve(skb, pad);
+	skb_put(skb, OVPN_TCP_RX_HEAD_LEN);
+	skb->data_len = len - OVPN_TCP_RX_HEAD_LEN;
+	skb->len = len;
+	skb->dev = dev;
+	return skb;
+}
+
+/* Return where the byte at offset of the packet being received has to be
+ * stored, and in len how many contiguous bytes can be stored there
+ */
+static void *ovpn_tcp_rx_buf(struct sk_buff *skb, unsigned int offset,
+			     size_t *len)
+{
+	unsigned int i, start = skb_headlen(skb);
+	skb_frag_t *frag;
+
+	if (offset < start) {
+		*len = start - offset;
+		return skb->data + offset;
+	}
+
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		frag = &skb_shinfo(skb)->frags[i];
+		if (offset < start + skb_frag_size(frag)) {
+			*len = start + skb_frag_size(frag) - offset;
+			return skb_frag_address(frag) + offset - start;
+		}
+		start += skb_frag_size(frag);
+	}
+
+	return NULL;
+}
+
 static int ovpn_tcp_rx_one(struct ovpn_peer *peer)
 {
 	struct msghdr msg = { .msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL };
@@ -216,11 +319,20 @@ static int ovpn_tcp_rx_one(struct ovpn_peer *peer)
 			.iov_len = sizeof(u16) - peer->tcp.offset,
 		};
 
-		ret = kernel_recvmsg(peer->ovpn->sock, &msg, &iv, 1, iv.iov_len, msg.msg_flags);
-		if (ret <= 0)
-			return ret;
+		/* the prefix may have been fully read already if a previous
+		 * allocation failed
+		 */
+		if (iv.iov_len) {
+			ret = kernel_recvmsg(peer->ovpn->sock, &msg, &iv, 1, iv.iov_len,
+					     msg.msg_flags);
+			if (ret <= 0)
+				return ret;
+
+			peer->tcp.offset += ret;
+		} else {
+			ret = sizeof(u16);
+		}
 
-		peer->tcp.offset += ret;
 		/* the entire packet size was read, prepare skb for reading data */
 		if (peer->tcp.offset == sizeof(u16)) {
 			u16 len = ntohs(*(__be16 *)peer->tcp.raw_len);
@@ -230,15 +342,21 @@ static int ovpn_tcp_rx_one(struct ovpn_peer *peer)
 				return -EINVAL;
 			}
 
-			peer->tcp.skb = netdev_alloc_skb_ip_align(peer->ovpn->dev, len);
+			/* keep the prefix around and retry on the next run */
+			peer->tcp.skb = ovpn_tcp_rx_alloc(peer->ovpn->dev, len);
+			if (!peer->tcp.skb)
+				return -ENOMEM;
+
 			peer->tcp.offset = 0;
 			peer->tcp.data_len = len;
 		}
 	} else {
-		struct kvec iv = {
-			.iov_base = peer->tcp.skb->data + peer->tcp.offset,
-			.iov_len = peer->tcp.data_len - peer->tcp.offset,
-		};
+		struct kvec iv;
+
+		iv.iov_base = ovpn_tcp_rx_buf(peer->tcp.skb, peer->tcp.offset,
+					      &iv.iov_len);
+		if (WARN_ON_ONCE(!iv.iov_base))
+			return -EINVAL;
 
 		ret = kernel_recvmsg(peer->ovpn->sock, &msg, &iv, 1, iv.iov_len, msg.msg_flags);
 		if (ret <= 0)
@@ -247,11 +365,6 @@ static int ovpn_tcp_rx_one(struct ovpn_peer *peer)
 		peer->tcp.offset += ret;
 		/* full packet received, send it up for processing */
 		if (peer->tcp.offset == peer->tcp.data_len) {
-			/* update the skb data structure with the amount of data written by
-			 * kernel_recvmsg()
-			 */
-			skb_put(peer->tcp.skb, peer->tcp.data_len);
-
 			/* hold reference to peer as requird by ovpn_recv() */
 			ovpn_peer_hold(peer);
 			if (!ovpn_recv(peer->ovpn, peer, peer->tcp.skb))
@@ -269,7 +382,8 @@ static int ovpn_tcp_rx_one(struct ovpn_peer *peer)
 
 void ovpn_tcp_rx_work(struct work_struct *work)
 {
-	struct ovpn_peer *peer = container_of(work, struct ovpn_peer, tcp.rx_work);
+	struct ovpn_peer *peer = container_of(to_delayed_work(work),
+					      struct ovpn_peer, tcp.rx_work);
 	int ret;
 
 	while (true) {
@@ -282,6 +396,17 @@ void ovpn_tcp_rx_work(struct work_struct *work)
 			break;
 	}
 
+	/* the data may already be queued in the socket, in which case no new
+	 * data_ready would wake us up
+	 */
+	if (ret == -ENOMEM) {
+		net_dbg_ratelimited("%s: out of memory receiving from TCP, retrying\n",
+				    peer->ovpn->dev->name);
+		queue_delayed_work(peer->ovpn->events_wq, &peer->tcp.rx_work,
+				   OVPN_TCP_RX_RETRY_DELAY);
+		return;
+	}
+
 	if (ret < 0 && ret != -EAGAIN)
 		pr_err("%s: TCP socket error: %d\n", __func__, ret);
 }
@@ -9,6 +9,8 @@
 #ifndef _NET_OVPN_DCO_TCP_H_
 #define _NET_OVPN_DCO_TCP_H_
 
+#include <linux/net.h>
+#include <linux/skbuff.h>
 #include <linux/workqueue.h>
 
 void ovpn_tcp_tx_work(struct work_struct *work);
@@ -29,6 +31,14 @@ static inline void ovpn_tcp_send_skb(struct ovpn_peer *peer, struct sk_buff *skb
 {
 	u16 len = skb->len;
 
+	/* the prefix can't describe larger packets */
+	if (unlikely(skb->len > U16_MAX)) {
+		net_dbg_ratelimited("%s: packet too large for TCP framing: %u\n",
+				    __func__, skb->len);
+		kfree_skb(skb);
+		return;
+	}
+
 	*(__be16 *)__skb_push(skb, sizeof(u16)) = htons(len);
 	ovpn_queue_tcp_skb(peer, skb);
 }
@@ -12,8 +12,11 @@
 #include "ovpnstruct.h"
 #include "peer.h"
 #include "proto.h"
+#include "sock.h"
 #include "udp.h"
 
+#include <linux/math64.h>
+#include <net/busy_poll.h>
 #include <net/dst_cache.h>
 #include <net/route.h>
 #include <net/ip6_route.h>
@@ -68,10 +71,22 @@ int ovpn_udp_encap_recv(struct sock *sk, struct sk_buff *skb)
 	struct ovpn_struct *ovpn;
 	struct ovpn_peer *peer;
 
+	/* encapsulated packets skip __udp_queue_rcv_skb(): record the NAPI the
+	 * transport socket is fed from, so that it can be busy polled too
+	 */
+	sk_mark_napi_id(sk, skb);
+
 	/* pop off outer UDP header */
 	__skb_pull(skb, sizeof(struct udphdr));
 
-	ovpn = ovpn_from_udp_sock(sk);
+	ovpn = ovpn_from_udp_sock(sk, skb);
+	if (IS_ERR(ovpn)) {
+		/* control packet on a shared socket: restore the UDP header
+		 * and let the owner of the socket deal with it
+		 */
+		__skb_push(skb, sizeof(struct udphdr));
+		return 1;
+	}
 	if (unlikely(!ovpn))
 		goto drop;
 
@@ -174,15 +189,25 @@ transmit:
  */
 static int ovpn_udp_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 			   struct dst_cache *cache, struct sock *sk,
-			   struct sk_buff *skb)
+			   struct sk_buff *skb, bool charge)
 {
 	int ret;
 
 	ovpn_rcu_lockdep_assert_held();
 
-	/* set sk to null if skb is already orphaned */
-	if (!skb->destructor)
+	if (charge) {
+		/* charge the encrypted packet to the transport socket, so
+		 * that the amount of data in flight below us is bounded by its
+		 * send buffer. The original owner, if any, is released here:
+		 * from its point of view the packet has left the ovpn
+		 * interface
+		 */
+		skb_orphan(skb);
+		skb_set_owner_w(skb, sk);
+	} else if (!skb->destructor) {
+		/* set sk to null if skb is already orphaned */
 		skb->sk = NULL;
+	}
 
 	switch (bind->sapair.local.family) {
 	case AF_INET:
@@ -201,6 +226,61 @@ static int ovpn_udp_output(struct ovpn_struct *ovpn, struct ovpn_bind *bind,
 	return ret;
 }
 
+/* packets are never scheduled further than this in the future, so that they
+ * stay well within the horizon of the fq qdisc (10s by default)
+ */
+#define OVPN_PACING_HORIZON_NS	NSEC_PER_SEC
+
+/* Stamp skb with its earliest departure time (EDT), so that an fq qdisc on the
+ * lower device spreads the encrypted packets at the configured rate instead of
+ * sending whole bursts at once. If the lower device is backed up and
+ * throttling is enabled, packets waiting in the qdisc are still charged to
+ * the transport socket and ovpn_udp_tx_throttle() eventually stops
+ * encrypt_work.
+ *
+ * Several senders may pace packets of the same peer at once (encrypt_work,
+ * inline TX, packets sent by userspace): each one reserves its slot by
+ * advancing pacing.next_tx_ns atomically.
+ */
+static void ovpn_udp_pace(struct ovpn_peer *peer, struct sock *sk,
+			  struct sk_buff *skb)
+{
+	u64 rate = READ_ONCE(peer->pacing.rate);
+	u64 now, next, len, duration;
+	int overhead;
+	s64 old;
+
+	if (likely(!rate))
+		return;
+
+	/* account for the outer headers too, they consume link capacity */
+	len = skb->len;
+	overhead = ovpn_sock_encap_overhead(sk);
+	if (overhead > 0)
+		len += overhead;
+	duration = div64_u64(len * NSEC_PER_SEC, rate);
+
+	now = ktime_get_ns();
+	old = atomic64_read(&peer->pacing.next_tx_ns);
+	do {
+		/* never accumulate credit while idle: a packet sent after a
+		 * pause departs now, not in the past
+		 */
+		next = max_t(u64, old, now);
+		if (next - now > OVPN_PACING_HORIZON_NS)
+			next = now + OVPN_PACING_HORIZON_NS;
+	} while (!atomic64_try_cmpxchg(&peer->pacing.next_tx_ns, &old,
+				       next + duration));
+
+	skb_set_delivery_time(skb, ns_to_ktime(next), true);
+
+	atomic64_inc(&peer->pacing.packets);
+	if (next > now) {
+		atomic64_inc(&peer->pacing.delayed);
+		atomic64_add(next - now, &peer->pacing.delay_ns);
+	}
+}
+
 /* Called after encrypt to write IP packet to UDP port.
  * This method is expected to manage/free skb.
  */
@@ -212,8 +292,18 @@ void ovpn_udp_send_skb(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
 	int ret = -1;
 
 	skb->dev = ovpn->dev;
-	/* no checksum performed at this layer */
+	/* The payload is now ciphertext: any inner checksum state was resolved
+	 * before encryption and is meaningless. Leave the outer UDP checksum
+	 * to udp_set_csum()/udp6_set_csum(): for a CHECKSUM_NONE skb they
+	 * only store the pseudo-header sum and switch to CHECKSUM_PARTIAL, so
+	 * the lower device computes the checksum if it supports offload and
+	 * validate_xmit_skb() falls back to software otherwise.
+	 * The skb is not an encapsulation from the lower device point of view
+	 * (no inner headers it could offload), make sure it is not flagged
+	 * as such.
+	 */
 	skb->ip_summed = CHECKSUM_NONE;
+	skb->encapsulation = 0;
 
 	/* get socket info */
 	sock = peer->sock;
@@ -229,8 +319,11 @@ void ovpn_udp_send_skb(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
 	/* note event of authenticated packet xmit for keepalive */
 	ovpn_peer_keepalive_xmit_reset(peer);
 
+	ovpn_udp_pace(peer, sock->sk, skb);
+
 	/* crypto layer -> transport (UDP) */
-	ret = ovpn_udp_output(ovpn, bind, &peer->dst_cache, sock->sk, skb);
+	ret = ovpn_udp_output(ovpn, bind, &peer->dst_cache, sock->sk, skb,
+			      READ_ONCE(peer->tx_throttle));
 
 out_unlock:
 	rcu_read_unlock();
@@ -238,3 +331,134 @@ out:
 	if (ret < 0)
 		kfree_skb(skb);
 }
+
+/* Check if the transport socket can take more encrypted packets.
+ *
+ * Called by encrypt_work before processing the next packet. If the socket
+ * send buffer is full (i.e. the lower device or qdisc is backed up), the
+ * interface queue is stopped and true is returned: encrypt_work should then
+ * stop consuming its rings until ovpn_udp_write_space() reschedules it.
+ *
+ * Only peers with tx_throttle set are charged to the socket and throttled.
+ */
+bool ovpn_udp_tx_throttle(struct ovpn_peer *peer)
+{
+	struct ovpn_udp_socket *usock;
+	struct sock *sk;
+
+	if (likely(!READ_ONCE(peer->tx_throttle)) || unlikely(!peer->sock))
+		return false;
+
+	sk = peer->sock->sk;
+	if (likely(sock_writeable(sk)))
+		return false;
+
+	netif_stop_queue(peer->ovpn->dev);
+	atomic_set(&peer->tx_throttled, 1);
+	/* tell ovpn_udp_write_space() that at least one of the interfaces
+	 * using this socket is waiting for room
+	 */
+	rcu_read_lock();
+	usock = rcu_dereference_sk_user_data(sk);
+	if (likely(usock))
+		atomic_set(&usock->throttled, 1);
+	rcu_read_unlock();
+	/* pairs with the barrier implied by atomic_xchg() in
+	 * ovpn_udp_write_space(): either we see the freed space or the
+	 * callback sees the flag
+	 */
+	smp_mb__after_atomic();
+
+	if (!sock_writeable(sk))
+		return true;
+
+	/* space was released in the meantime: keep going */
+	if (atomic_xchg(&peer->tx_throttled, 0))
+		netif_wake_queue(peer->ovpn->dev);
+
+	return false;
+}
+
+/* sk_write_space callback of the UDP transport socket. Invoked whenever an
+ * skb charged to the socket is freed.
+ */
+static void ovpn_udp_wake(struct ovpn_struct *ovpn)
+{
+	struct ovpn_peer *peer;
+
+	peer = rcu_dereference(ovpn->peer);
+	if (likely(!peer || !atomic_read(&peer->tx_throttled)))
+		return;
+
+	if (!atomic_xchg(&peer->tx_throttled, 0))
+		return;
+
+	if (netif_running(ovpn->dev))
+		netif_wake_queue(ovpn->dev);
+
+	/* resume encryption of whatever piled up in the TX rings */
+	if (ovpn_peer_hold(peer) &&
+	    !queue_work(ovpn->crypto_wq, &peer->encrypt_work))
+		ovpn_peer_put(peer);
+}
+
+/* Enable or disable the charging of encrypted packets to the send buffer of
+ * the transport socket, and the throttling of encrypt_work when it is full.
+ *
+ * The send buffer also holds the packets sent by userspace on the socket,
+ * i.e. the control channel, which a busy tunnel can then delay. On a socket
+ * shared by several interfaces, all the peers throttling share the same
+ * buffer. Disabled by default
+ */
+void ovpn_udp_tx_throttle_set(struct ovpn_peer *peer, bool enable)
+{
+	pr_debug("%s: TX throttling %s\n", peer->ovpn->dev->name,
+		 enable ? "enabled" : "disabled");
+
+	WRITE_ONCE(peer->tx_throttle, enable);
+	if (enable)
+		return;
+
+	/* resume a worker paused before the change */
+	rcu_read_lock();
+	ovpn_udp_wake(peer->ovpn);
+	rcu_read_unlock();
+}
+
+void ovpn_udp_write_space(struct sock *sk)
+{
+	void (*write_space)(struct sock *sk) = NULL;
+	struct ovpn_udp_socket *usock;
+	struct ovpn_struct *ovpn;
+	unsigned int bkt;
+
+	rcu_read_lock();
+	usock = rcu_dereference_sk_user_data(sk);
+	if (unlikely(!usock))
+		goto unlock;
+
+	write_space = usock->sk_write_space;
+
+	/* nobody is waiting: don't bother walking the attached interfaces */
+	if (likely(!atomic_read(&usock->throttled)))
+		goto unlock;
+
+	if (!sock_writeable(sk) || !atomic_xchg(&usock->throttled, 0))
+		goto unlock;
+
+	ovpn = rcu_dereference(usock->ovpn);
+	if (ovpn) {
+		ovpn_udp_wake(ovpn);
+		goto unlock;
+	}
+
+	if (usock->shared)
+		hash_for_each_rcu(usock->shared->ovpn_by_peer_id, bkt, ovpn,
+				  udp_hnode)
+			ovpn_udp_wake(ovpn);
+unlock:
+	rcu_read_unlock();
+
+	if (write_space)
+		write_space(sk);
+}
@@ -20,5 +20,8 @@
 int ovpn_udp_encap_recv(struct sock *sk, struct sk_buff *skb);
 void ovpn_udp_send_skb(struct ovpn_struct *ovpn, struct ovpn_peer *peer,
 		       struct sk_buff *skb);
+bool ovpn_udp_tx_throttle(struct ovpn_peer *peer);
+void ovpn_udp_tx_throttle_set(struct ovpn_peer *peer, bool enable);
+void ovpn_udp_write_space(struct sock *sk);
 
 #endif /* _NET_OVPN_DCO_UDP_H_ */
@@ -14,6 +14,7 @@
 #define OVPN_NL_NAME "ovpn-dco"
 
 #define OVPN_NL_MULTICAST_GROUP_PEERS "peers"
+#define OVPN_NL_MULTICAST_GROUP_SAMPLES "samples"
 
 /**
  * enum ovpn_nl_commands - supported netlink commands
@@ -25,7 +26,10 @@ enum ovpn_nl_commands {
 	OVPN_CMD_UNSPEC = 0,
 
 	/**
-	 * @OVPN_CMD_START_VPN: Start VPN session
+	 * @OVPN_CMD_START_VPN: Start VPN session. If OVPN_ATTR_REMOTE_PEER_ID
+	 * is provided, the UDP socket can be shared with other interfaces and
+	 * data packets carrying this peer-id are delivered to this one, while
+	 * any other packet is passed to the socket owner
 	 */
 	OVPN_CMD_START_VPN,
 
@@ -67,6 +71,42 @@ enum ovpn_nl_commands {
 	 * with OVPN_CMD_REGISTER_PACKET
 	 */
 	OVPN_CMD_PACKET,
+
+	/**
+	 * @OVPN_CMD_PKTID_WRAP_WARN: Notify userspace that the packet ID of
+	 * the key used for transmission has crossed the configured threshold
+	 * and a new key should be negotiated before it runs out
+	 */
+	OVPN_CMD_PKTID_WRAP_WARN,
+
+	/**
+	 * @OVPN_CMD_GET_PEER: Retrieve the current parameters and statistics
+	 * of the peer
+	 */
+	OVPN_CMD_GET_PEER,
+
+	/**
+	 * @OVPN_CMD_GET_KEY_STATS: Dump the usage counters of the key slots,
+	 * either of all the interfaces or of the one specified with
+	 * OVPN_ATTR_IFINDEX
+	 */
+	OVPN_CMD_GET_KEY_STATS,
+
+	/**
+	 * @OVPN_CMD_GET_TOP_PEERS: Dump the OVPN_ATTR_TOP_PEERS_N (at most
+	 * 64, 10 by default) peers of the network namespace with the highest
+	 * current rate, busiest first. Each peer is reported with its
+	 * OVPN_ATTR_IFINDEX and OVPN_ATTR_RATES
+	 */
+	OVPN_CMD_GET_TOP_PEERS,
+
+	/**
+	 * @OVPN_CMD_SAMPLES: Batch of packets sampled by the peer of
+	 * OVPN_ATTR_IFINDEX, one OVPN_ATTR_SAMPLE each. Sent to the "samples"
+	 * multicast group when sampling is enabled with
+	 * OVPN_ATTR_SAMPLE_RATE
+	 */
+	OVPN_CMD_SAMPLES,
 };
 
 enum ovpn_mode {
@@ -87,6 +127,7 @@ enum ovpn_cipher_alg {
 	OVPN_CIPHER_ALG_NONE = 0,
 	OVPN_CIPHER_ALG_AES_GCM,
 	OVPN_CIPHER_ALG_CHACHA20_POLY1305,
+	OVPN_CIPHER_ALG_AEGIS128,
 };
 
 enum ovpn_del_peer_reason {
@@ -123,6 +164,159 @@ enum ovpn_sockaddr_attrs {
 	OVPN_SOCKADDR_ATTR_MAX = __OVPN_SOCKADDR_ATTR_AFTER_LAST,
 };
 
+enum ovpn_pacing_attrs {
+	OVPN_PACING_ATTR_UNSPEC,
+	OVPN_PACING_ATTR_RATE,
+	OVPN_PACING_ATTR_PACKETS,
+	OVPN_PACING_ATTR_DELAYED,
+	OVPN_PACING_ATTR_DELAY_NS,
+	OVPN_PACING_ATTR_PAD,
+
+	__OVPN_PACING_ATTR_AFTER_LAST,
+	OVPN_PACING_ATTR_MAX = __OVPN_PACING_ATTR_AFTER_LAST - 1,
+};
+
+enum ovpn_probation_attrs {
+	OVPN_PROBATION_ATTR_UNSPEC,
+	/* packets failing authentication */
+	OVPN_PROBATION_ATTR_AUTH_FAIL,
+	/* number of times the peer was put under probation */
+	OVPN_PROBATION_ATTR_COUNT,
+	/* packets dropped before decryption while under probation */
+	OVPN_PROBATION_ATTR_DROPPED,
+	/* milliseconds left before probation ends, 0 if not under probation */
+	OVPN_PROBATION_ATTR_REMAINING_MS,
+	OVPN_PROBATION_ATTR_PAD,
+
+	__OVPN_PROBATION_ATTR_AFTER_LAST,
+	OVPN_PROBATION_ATTR_MAX = __OVPN_PROBATION_ATTR_AFTER_LAST - 1,
+};
+
+enum ovpn_mssfix_attrs {
+	OVPN_MSSFIX_ATTR_UNSPEC,
+	/* TCP SYNs sent through the tunnel whose MSS was lowered */
+	OVPN_MSSFIX_ATTR_TX,
+	/* TCP SYNs received from the tunnel whose MSS was lowered */
+	OVPN_MSSFIX_ATTR_RX,
+	OVPN_MSSFIX_ATTR_PAD,
+
+	__OVPN_MSSFIX_ATTR_AFTER_LAST,
+	OVPN_MSSFIX_ATTR_MAX = __OVPN_MSSFIX_ATTR_AFTER_LAST - 1,
+};
+
+/* current rates of a peer, estimated by an EWMA over roughly 4 seconds */
+enum ovpn_rates_attrs {
+	OVPN_RATES_ATTR_UNSPEC,
+	/* bits per second, measured on the transport layer */
+	OVPN_RATES_ATTR_RX_BPS,
+	OVPN_RATES_ATTR_RX_PPS,
+	OVPN_RATES_ATTR_TX_BPS,
+	OVPN_RATES_ATTR_TX_PPS,
+	OVPN_RATES_ATTR_PAD,
+
+	__OVPN_RATES_ATTR_AFTER_LAST,
+	OVPN_RATES_ATTR_MAX = __OVPN_RATES_ATTR_AFTER_LAST - 1,
+};
+
+/* ranking criteria of OVPN_CMD_GET_TOP_PEERS, both directions summed */
+enum ovpn_top_peers_sort {
+	OVPN_TOP_PEERS_SORT_BPS = 0,
+	OVPN_TOP_PEERS_SORT_PPS,
+};
+
+enum ovpn_sample_dir {
+	/* decrypted packet received from the peer */
+	OVPN_SAMPLE_DIR_RX = 0,
+	/* packet about to be encrypted and sent to the peer */
+	OVPN_SAMPLE_DIR_TX,
+};
+
+enum ovpn_sample_attrs {
+	OVPN_SAMPLE_ATTR_UNSPEC,
+	/* see enum ovpn_sample_dir */
+	OVPN_SAMPLE_ATTR_DIR,
+	/* peer-id of the data channel session */
+	OVPN_SAMPLE_ATTR_PEER_ID,
+	OVPN_SAMPLE_ATTR_KEY_ID,
+	/* length of the inner packet */
+	OVPN_SAMPLE_ATTR_LEN,
+	/* sampling rate the packet was picked with (1 out of N) */
+	OVPN_SAMPLE_ATTR_RATE,
+	/* CLOCK_REALTIME in nanoseconds */
+	OVPN_SAMPLE_ATTR_TIMESTAMP,
+	/* first bytes of the inner packet, starting at the IP header */
+	OVPN_SAMPLE_ATTR_HEADER,
+	OVPN_SAMPLE_ATTR_PAD,
+
+	__OVPN_SAMPLE_ATTR_AFTER_LAST,
+	OVPN_SAMPLE_ATTR_MAX = __OVPN_SAMPLE_ATTR_AFTER_LAST - 1,
+};
+
+enum ovpn_sample_stats_attrs {
+	OVPN_SAMPLE_STATS_ATTR_UNSPEC,
+	/* packets sampled */
+	OVPN_SAMPLE_STATS_ATTR_TAKEN,
+	/* samples that could not be queued for lack of memory */
+	OVPN_SAMPLE_STATS_ATTR_LOST,
+	OVPN_SAMPLE_STATS_ATTR_PAD,
+
+	__OVPN_SAMPLE_STATS_ATTR_AFTER_LAST,
+	OVPN_SAMPLE_STATS_ATTR_MAX = __OVPN_SAMPLE_STATS_ATTR_AFTER_LAST - 1,
+};
+
+enum ovpn_echo_state {
+	OVPN_ECHO_STATE_OFF = 0,
+	/* requests sent, no reply received yet */
+	OVPN_ECHO_STATE_PROBING,
+	/* the remote end replies, estimates are being updated */
+	OVPN_ECHO_STATE_ACTIVE,
+	/* no reply to the first requests: plain keepalives are sent */
+	OVPN_ECHO_STATE_UNSUPPORTED,
+};
+
+/* health of the tunnel measured through timestamped keepalives */
+enum ovpn_echo_attrs {
+	OVPN_ECHO_ATTR_UNSPEC,
+	/* see enum ovpn_echo_state */
+	OVPN_ECHO_ATTR_STATE,
+	/* smoothed round-trip time in microseconds */
+	OVPN_ECHO_ATTR_SRTT_US,
+	/* round-trip time variation (jitter) in microseconds */
+	OVPN_ECHO_ATTR_RTTVAR_US,
+	/* smoothed fraction of requests left unanswered, in parts per million */
+	OVPN_ECHO_ATTR_LOSS_PPM,
+	OVPN_ECHO_ATTR_REQUESTS,
+	OVPN_ECHO_ATTR_REPLIES,
+	OVPN_ECHO_ATTR_PAD,
+
+	__OVPN_ECHO_ATTR_AFTER_LAST,
+	OVPN_ECHO_ATTR_MAX = __OVPN_ECHO_ATTR_AFTER_LAST - 1,
+};
+
+enum ovpn_key_stats_attrs {
+	OVPN_KEY_STATS_ATTR_UNSPEC,
+	OVPN_KEY_STATS_ATTR_RX_PACKETS,
+	OVPN_KEY_STATS_ATTR_RX_BYTES,
+	OVPN_KEY_STATS_ATTR_TX_PACKETS,
+	OVPN_KEY_STATS_ATTR_TX_BYTES,
+	/* packets failing authentication */
+	OVPN_KEY_STATS_ATTR_AUTH_FAIL,
+	/* packets rejected by the replay protection */
+	OVPN_KEY_STATS_ATTR_REPLAY,
+	/* milliseconds since the key was last used, in either direction */
+	OVPN_KEY_STATS_ATTR_IDLE_MS,
+	/* last packet ID used for transmission */
+	OVPN_KEY_STATS_ATTR_TX_PKTID,
+	OVPN_KEY_STATS_ATTR_PAD,
+	/* current size of the replay window, in packets */
+	OVPN_KEY_STATS_ATTR_REPLAY_WINDOW,
+	/* largest reordering distance observed, in packets */
+	OVPN_KEY_STATS_ATTR_MAX_BACKTRACK,
+
+	__OVPN_KEY_STATS_ATTR_AFTER_LAST,
+	OVPN_KEY_STATS_ATTR_MAX = __OVPN_KEY_STATS_ATTR_AFTER_LAST - 1,
+};
+
 enum ovpn_attrs {
 	OVPN_ATTR_UNSPEC,
 
@@ -150,6 +344,65 @@ enum ovpn_attrs {
 
 	OVPN_ATTR_DEL_PEER_REASON,
 
+	OVPN_ATTR_PKTID_WRAP_THRESHOLD,
+
+	OVPN_ATTR_FQ_FLOWS,
+
+	/* egress pacing rate in bytes per second, 0 disables pacing */
+	OVPN_ATTR_PACING_RATE,
+	/* nested, see enum ovpn_pacing_attrs */
+	OVPN_ATTR_PACING,
+	OVPN_ATTR_PAD,
+
+	/* bitmap of the CPUs decrypted packets are distributed to, by inner
+	 * flow. Array of u32 in host byte order, bit N of word M is CPU
+	 * M * 32 + N
+	 */
+	OVPN_ATTR_RX_CPUMASK,
+
+	/* nested, see enum ovpn_key_stats_attrs */
+	OVPN_ATTR_KEY_STATS,
+
+	/* nested, see enum ovpn_probation_attrs */
+	OVPN_ATTR_PROBATION,
+
+	/* largest size of the encapsulated packets: the MSS of TCP SYNs
+	 * crossing the tunnel is lowered so that segments fit. 0 disables MSS
+	 * clamping
+	 */
+	OVPN_ATTR_MSSFIX,
+	/* nested, see enum ovpn_mssfix_attrs */
+	OVPN_ATTR_MSSFIX_STATS,
+
+	/* nested, see enum ovpn_rates_attrs */
+	OVPN_ATTR_RATES,
+	/* number of peers returned by OVPN_CMD_GET_TOP_PEERS */
+	OVPN_ATTR_TOP_PEERS_N,
+	/* see enum ovpn_top_peers_sort */
+	OVPN_ATTR_TOP_PEERS_SORT,
+
+	/* 1 out of N packets is exported to the "samples" multicast group in
+	 * each direction, 0 disables sampling
+	 */
+	OVPN_ATTR_SAMPLE_RATE,
+	/* nested, see enum ovpn_sample_attrs */
+	OVPN_ATTR_SAMPLE,
+	/* nested, see enum ovpn_sample_stats_attrs */
+	OVPN_ATTR_SAMPLE_STATS,
+
+	/* 1 to send timestamped keepalives, understood by other instances of
+	 * this module only, 0 to send plain ones
+	 */
+	OVPN_ATTR_ECHO,
+	/* nested, see enum ovpn_echo_attrs */
+	OVPN_ATTR_ECHO_STATS,
+
+	/* 1 to charge encrypted packets to the send buffer of the UDP socket
+	 * and stop encrypting while it is full, 0 to disable. The buffer is
+	 * shared with the packets userspace sends on the socket
+	 */
+	OVPN_ATTR_TX_THROTTLE,
+
 	__OVPN_ATTR_AFTER_LAST,
 	OVPN_ATTR_MAX = __OVPN_ATTR_AFTER_LAST - 1,
 };
@@ -13,6 +13,18 @@
 #include <linux/kconfig.h>
 #include <linux/version.h>
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
+
+#include <linux/skbuff.h>
+
+static inline void skb_set_delivery_time(struct sk_buff *skb, ktime_t kt,
+					 bool mono)
+{
+	skb->tstamp = kt;
+}
+
+#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0) */
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0)
 
 #define dev_get_tstats64 ip_tunnel_get_stats64
@@ -47,6 +59,12 @@ static inline void dev_sw_netstats_rx_add(struct net_device *dev, unsigned int l
 	u64_stats_update_end(&tstats->syncp);
 }
 
+#define INIT_CSD(_csd, _func, _info)		\
+	do {					\
+		(_csd)->func = (_func);		\
+		(_csd)->info = (_info);		\
+	} while (0)
+
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0) */
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
@@ -0,0 +1,31 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+# Copyright (C) 2020 OpenVPN, Inc.
+#
+# Compare data channel throughput across ciphers and underlay MTUs by
+# running iperf3 between the two namespaces created by netns-test.sh.
+#
+# Usage: ./netns-bench.sh [-6] [-t]
+#	ALGS="aes chachapoly aegis none" MTUS="1500 9000" DURATION=10 \
+#		./netns-bench.sh
+
+ALGS=${ALGS:-"aes chachapoly aegis none"}
+MTUS=${MTUS:-"1500 9000"}
+DURATION=${DURATION:-10}
+
+for mtu in $MTUS; do
+for alg in $ALGS; do
+	MTU=$mtu ALG=$alg ./netns-test.sh "$@" > /dev/null 2>&1
+	# give the TCP listener time to accept the connection and install keys
+	sleep 2
+
+	ip netns exec peer0 iperf3 -s -1 -D -B 5.5.5.1
+	sleep 1
+
+	bps=$(ip netns exec peer1 iperf3 -c 5.5.5.1 -t $DURATION -J | \
+		grep -A4 '"sum_received"' | \
+		sed -n 's/.*"bits_per_second":[[:space:]]*\([0-9.e+]*\).*/\1/p')
+	printf "%-12s mtu %-6s %s Mbit/s\n" $alg $mtu \
+		$(awk -v b="$bps" 'BEGIN { printf "%.1f", b / 1000000 }')
+done
+done
@@ -8,6 +8,8 @@ set -x
 
 OVPN_CLI=./ovpn-cli
 ALG=${ALG:-aes}
+# underlay MTU, the tunnel MTU leaves room for the encapsulation overhead
+MTU=${MTU:-}
 
 function create_ns() {
 	ip -n peer$1 link del tun0
@@ -19,6 +21,7 @@ function create_ns() {
 function setup_ns() {
 	ip link set veth$1 netns peer$1
 	ip -n peer$1 addr add $2/$3 dev veth$1
+	[ -n "$MTU" ] && ip -n peer$1 link set veth$1 mtu $MTU
 	ip -n peer$1 link set veth$1 up
 	if [ $ipv6 -eq 1 ]; then
 		sleep 5
@@ -26,6 +29,7 @@ function setup_ns() {
 
 	ip -n peer$1 link add tun0 type ovpn-dco
 	ip -n peer$1 addr add $4 dev tun0
+	[ -n "$MTU" ] && ip -n peer$1 link set tun0 mtu $(($MTU - 100))
 	ip -n peer$1 link set tun0 up
 
 	if [ $tcp -eq 0 ]; then
@@ -34,15 +38,30 @@ function setup_ns() {
 		ip netns exec peer$1 $OVPN_CLI tun0 new_key $ALG $1 data64.key
 	else
 		if [ $1 -eq 0 ]; then
-			(ip netns exec peer$1 $OVPN_CLI tun0 listen $5 $8 && \
+			(ip netns exec peer$1 $OVPN_CLI tun0 listen $5 $8 $mptcp_opt && \
 				ip netns exec peer$1 $OVPN_CLI tun0 new_key $ALG $1 data64.key) &
 		else
-			ip netns exec peer$1 $OVPN_CLI tun0 connect $6 $7
+			ip netns exec peer$1 $OVPN_CLI tun0 connect $6 $7 $mptcp_opt
 			ip netns exec peer$1 $OVPN_CLI tun0 new_key $ALG $1 data64.key
 		fi
 	fi
 }
 
+# second path used by MPTCP: veth2 (peer0) <-> veth3 (peer1).
+# The client announces its second address as a subflow endpoint, so that the
+# MPTCP connection carrying the tunnel runs over both veth pairs
+function setup_mptcp_path() {
+	ip link set veth$(($1 + 2)) netns peer$1
+	ip -n peer$1 addr add $2/$3 dev veth$(($1 + 2))
+	ip -n peer$1 link set veth$(($1 + 2)) up
+
+	ip netns exec peer$1 sysctl -w net.mptcp.enabled=1
+	ip -n peer$1 mptcp limits set subflow 2 add_addr_accepted 2
+	if [ $1 -eq 1 ]; then
+		ip -n peer$1 mptcp endpoint add $2 dev veth$(($1 + 2)) subflow
+	fi
+}
+
 create_ns 0
 create_ns 1
 
@@ -61,6 +80,23 @@ if [ "$1" == "-t" ]; then
 	shift
 fi
 
+mptcp_opt=""
+if [ "$1" == "-m" ]; then
+	tcp=1
+	mptcp_opt="mptcp"
+	shift
+
+	ip link del veth2
+	ip link add veth2 type veth peer name veth3
+
+	if [ $ipv6 -eq 1 ]; then
+		setup_mptcp_path 0 fc00:1::1 64
+		setup_mptcp_path 1 fc00:1::2 64
+	else
+		setup_mptcp_path 0 10.10.11.1 24
+		setup_mptcp_path 1 10.10.11.2 24
+	fi
+fi
 
 if [ $ipv6 -eq 1 ]; then
 	setup_ns 0 fc00::1 64 5.5.5.1/24 1 fc00::2 2 ipv6
@@ -6,9 +6,13 @@
  *  Author:	Antonio Quartulli <antonio@openvpn.net>
  */
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <net/if.h>
@@ -42,14 +46,24 @@ enum ovpn_key_direction {
 };
 
 #define KEY_LEN (256 / 8)
+#define AEGIS128_KEY_LEN (128 / 8)
 #define NONCE_LEN 8
 
+/* max number of interfaces a UDP socket can be shared with by start_udp */
+#define OVPN_MAX_SHARES 8
+
+#ifndef IPPROTO_MPTCP
+#define IPPROTO_MPTCP 262
+#endif
+
 struct nl_ctx {
 	struct nl_sock *nl_sock;
 	struct nl_msg *nl_msg;
 	struct nl_cb *nl_cb;
 
 	int ovpn_dco_id;
+	/* nl_sock belongs to the ovpn_ctx and must not be freed */
+	int shared_sock;
 };
 
 struct ovpn_ctx {
@@ -76,11 +90,44 @@ struct ovpn_ctx {
 	unsigned int ifindex;
 
 	int socket;
+	/* IPPROTO_TCP or IPPROTO_MPTCP for stream based sessions */
+	int stream_proto;
 
 	__u32 keepalive_interval;
 	__u32 keepalive_timeout;
+	__u32 pktid_wrap_threshold;
+	__u16 fq_flows;
+	__u64 pacing_rate;
+	bool pacing_rate_set;
+	__u16 mssfix;
+	bool mssfix_set;
+	__u32 sample_rate;
+	bool sample_rate_set;
+	__u8 echo;
+	bool echo_set;
+	__u8 tx_throttle;
+	bool tx_throttle_set;
+	/* get_top parameters */
+	__u32 top_n;
+	enum ovpn_top_peers_sort top_sort;
+	/* CPUs decrypted packets are steered to (first 32 CPUs only) */
+	__u32 rx_cpumask;
+	bool rx_cpumask_set;
+	/* peer-id of the session when the UDP socket is shared */
+	__u32 peer_id;
+	bool peer_id_set;
+	/* other interfaces the UDP socket is shared with */
+	unsigned int share_ifindex[OVPN_MAX_SHARES];
+	__u32 share_peer_id[OVPN_MAX_SHARES];
+	unsigned int n_shares;
 
 	enum ovpn_key_direction key_dir;
+	enum ovpn_key_slot key_slot;
+	__u16 key_id;
+
+	/* optional netlink socket reused across commands (bench-ctl) */
+	struct nl_sock *nl_sock;
+	int ovpn_dco_id;
 };
 
 static int ovpn_nl_recvmsgs(struct nl_ctx *ctx)
@@ -121,6 +168,13 @@ static struct nl_ctx *nl_ctx_alloc(struct ovpn_ctx *ovpn,
 	if (!ctx)
 		return NULL;
 
+	if (ovpn->nl_sock) {
+		ctx->nl_sock = ovpn->nl_sock;
+		ctx->ovpn_dco_id = ovpn->ovpn_dco_id;
+		ctx->shared_sock = 1;
+		goto alloc_msg;
+	}
+
 	ctx->nl_sock = nl_socket_alloc();
 	if (!ctx->nl_sock) {
 		fprintf(stderr, "cannot allocate netlink socket\n");
@@ -143,6 +197,7 @@ static struct nl_ctx *nl_ctx_alloc(struct ovpn_ctx *ovpn,
 		goto err_free;
 	}
 
+alloc_msg:
 	ctx->nl_msg = nlmsg_alloc();
 	if (!ctx->nl_msg) {
 		fprintf(stderr, "cannot allocate netlink message\n");
@@ -165,7 +220,8 @@ nla_put_failure:
 err_msg:
 	nlmsg_free(ctx->nl_msg);
 err_sock:
-	nl_socket_free(ctx->nl_sock);
+	if (!ctx->shared_sock)
+		nl_socket_free(ctx->nl_sock);
 err_free:
 	free(ctx);
 	return NULL;
@@ -176,7 +232,8 @@ static void nl_ctx_free(struct nl_ctx *ctx)
 	if (!ctx)
 		return;
 
-	nl_socket_free(ctx->nl_sock);
+	if (!ctx->shared_sock)
+		nl_socket_free(ctx->nl_sock);
 	nlmsg_free(ctx->nl_msg);
 	nl_cb_put(ctx->nl_cb);
 	free(ctx);
@@ -354,6 +411,8 @@ static int ovpn_read_cipher(const char *cipher, struct ovpn_ctx *ctx)
 		ctx->cipher = OVPN_CIPHER_ALG_AES_GCM;
 	else if (strcmp(cipher, "chachapoly") == 0)
 		ctx->cipher = OVPN_CIPHER_ALG_CHACHA20_POLY1305;
+	else if (strcmp(cipher, "aegis") == 0)
+		ctx->cipher = OVPN_CIPHER_ALG_AEGIS128;
 	else if (strcmp(cipher, "none") == 0)
 		ctx->cipher = OVPN_CIPHER_ALG_NONE;
 	else
@@ -391,12 +450,12 @@ static int ovpn_socket(struct ovpn_ctx *ctx, sa_family_t family, int proto)
 
 	if (proto == IPPROTO_UDP)
 		sock_type = SOCK_DGRAM;
-	else if (proto == IPPROTO_TCP)
+	else if (proto == IPPROTO_TCP || proto == IPPROTO_MPTCP)
 		sock_type = SOCK_STREAM;
 	else
 		return -EINVAL;
 
-	s = socket(family, sock_type, 0);
+	s = socket(family, sock_type, proto);
 	if (s < 0) {
 		perror("cannot create socket");
 		return -1;
@@ -459,7 +518,7 @@ static int ovpn_listen(struct ovpn_ctx *ctx, sa_family_t family)
 	socklen_t socklen;
 	int ret;
 
-	ret = ovpn_socket(ctx, family, IPPROTO_TCP);
+	ret = ovpn_socket(ctx, family, ctx->stream_proto);
 	if (ret < 0)
 		return ret;
 
@@ -515,7 +574,7 @@ static int ovpn_connect(struct ovpn_ctx *ovpn)
 	socklen_t socklen;
 	int s, ret;
 
-	s = socket(ovpn->sa_family, SOCK_STREAM, 0);
+	s = socket(ovpn->sa_family, SOCK_STREAM, ovpn->stream_proto);
 	if (s < 0) {
 		perror("cannot create socket");
 		return -1;
@@ -601,6 +660,14 @@ static int ovpn_start(struct ovpn_ctx *ovpn, enum ovpn_proto proto)
 	NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_PROTO, proto);
 	NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_MODE, OVPN_MODE_CLIENT);
 
+	if (ovpn->rx_cpumask_set)
+		NLA_PUT(ctx->nl_msg, OVPN_ATTR_RX_CPUMASK,
+			sizeof(ovpn->rx_cpumask), &ovpn->rx_cpumask);
+
+	if (ovpn->peer_id_set)
+		NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_REMOTE_PEER_ID,
+			    ovpn->peer_id);
+
 	ret = ovpn_nl_msg_send(ctx, NULL);
 nla_put_failure:
 	nl_ctx_free(ctx);
@@ -644,6 +711,9 @@ static int ovpn_new_peer(struct ovpn_ctx *ovpn)
 
 	nla_nest_end(ctx->nl_msg, addr);
 
+	if (ovpn->fq_flows)
+		NLA_PUT_U16(ctx->nl_msg, OVPN_ATTR_FQ_FLOWS, ovpn->fq_flows);
+
 	ret = ovpn_nl_msg_send(ctx, NULL);
 nla_put_failure:
 	nl_ctx_free(ctx);
@@ -664,37 +734,360 @@ static int ovpn_set_peer(struct ovpn_ctx *ovpn)
 	NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_KEEPALIVE_TIMEOUT,
 		    ovpn->keepalive_timeout);
 
+	if (ovpn->pktid_wrap_threshold)
+		NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_PKTID_WRAP_THRESHOLD,
+			    ovpn->pktid_wrap_threshold);
+
+	if (ovpn->pacing_rate_set)
+		NLA_PUT_U64(ctx->nl_msg, OVPN_ATTR_PACING_RATE,
+			    ovpn->pacing_rate);
+
+	if (ovpn->mssfix_set)
+		NLA_PUT_U16(ctx->nl_msg, OVPN_ATTR_MSSFIX, ovpn->mssfix);
+
+	if (ovpn->sample_rate_set)
+		NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_SAMPLE_RATE,
+			    ovpn->sample_rate);
+
+	if (ovpn->echo_set)
+		NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_ECHO, ovpn->echo);
+
+	if (ovpn->tx_throttle_set)
+		NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_TX_THROTTLE,
+			   ovpn->tx_throttle);
+
 	ret = ovpn_nl_msg_send(ctx, NULL);
 nla_put_failure:
 	nl_ctx_free(ctx);
 	return ret;
 }
 
+static void ovpn_print_pacing(struct nlattr *attr)
+{
+	struct nlattr *pacing[OVPN_PACING_ATTR_MAX + 1];
+
+	if (nla_parse_nested(pacing, OVPN_PACING_ATTR_MAX, attr, NULL))
+		return;
+
+	if (pacing[OVPN_PACING_ATTR_RATE])
+		fprintf(stderr, "pacing rate: %llu bytes/s\n",
+			(unsigned long long)nla_get_u64(pacing[OVPN_PACING_ATTR_RATE]));
+	if (pacing[OVPN_PACING_ATTR_PACKETS])
+		fprintf(stderr, "pacing packets: %llu\n",
+			(unsigned long long)nla_get_u64(pacing[OVPN_PACING_ATTR_PACKETS]));
+	if (pacing[OVPN_PACING_ATTR_DELAYED])
+		fprintf(stderr, "pacing delayed: %llu\n",
+			(unsigned long long)nla_get_u64(pacing[OVPN_PACING_ATTR_DELAYED]));
+	if (pacing[OVPN_PACING_ATTR_DELAY_NS])
+		fprintf(stderr, "pacing total delay: %llu ns\n",
+			(unsigned long long)nla_get_u64(pacing[OVPN_PACING_ATTR_DELAY_NS]));
+}
+
+static void ovpn_print_probation(struct nlattr *attr)
+{
+	struct nlattr *prob[OVPN_PROBATION_ATTR_MAX + 1];
+
+	if (nla_parse_nested(prob, OVPN_PROBATION_ATTR_MAX, attr, NULL))
+		return;
+
+	if (prob[OVPN_PROBATION_ATTR_AUTH_FAIL])
+		fprintf(stderr, "authentication failures: %llu\n",
+			(unsigned long long)nla_get_u64(prob[OVPN_PROBATION_ATTR_AUTH_FAIL]));
+	if (prob[OVPN_PROBATION_ATTR_COUNT])
+		fprintf(stderr, "probations: %llu\n",
+			(unsigned long long)nla_get_u64(prob[OVPN_PROBATION_ATTR_COUNT]));
+	if (prob[OVPN_PROBATION_ATTR_DROPPED])
+		fprintf(stderr, "probation drops: %llu\n",
+			(unsigned long long)nla_get_u64(prob[OVPN_PROBATION_ATTR_DROPPED]));
+	if (prob[OVPN_PROBATION_ATTR_REMAINING_MS])
+		fprintf(stderr, "probation remaining: %u ms\n",
+			nla_get_u32(prob[OVPN_PROBATION_ATTR_REMAINING_MS]));
+}
+
+static void ovpn_print_mssfix(struct nlattr *attr)
+{
+	struct nlattr *mssfix[OVPN_MSSFIX_ATTR_MAX + 1];
+
+	if (nla_parse_nested(mssfix, OVPN_MSSFIX_ATTR_MAX, attr, NULL))
+		return;
+
+	if (mssfix[OVPN_MSSFIX_ATTR_TX])
+		fprintf(stderr, "mssfix clamped tx: %llu\n",
+			(unsigned long long)nla_get_u64(mssfix[OVPN_MSSFIX_ATTR_TX]));
+	if (mssfix[OVPN_MSSFIX_ATTR_RX])
+		fprintf(stderr, "mssfix clamped rx: %llu\n",
+			(unsigned long long)nla_get_u64(mssfix[OVPN_MSSFIX_ATTR_RX]));
+}
+
+static void ovpn_print_sample_stats(struct nlattr *attr)
+{
+	struct nlattr *stats[OVPN_SAMPLE_STATS_ATTR_MAX + 1];
+
+	if (nla_parse_nested(stats, OVPN_SAMPLE_STATS_ATTR_MAX, attr, NULL))
+		return;
+
+	if (stats[OVPN_SAMPLE_STATS_ATTR_TAKEN])
+		fprintf(stderr, "samples taken: %llu\n",
+			(unsigned long long)nla_get_u64(stats[OVPN_SAMPLE_STATS_ATTR_TAKEN]));
+	if (stats[OVPN_SAMPLE_STATS_ATTR_LOST])
+		fprintf(stderr, "samples lost: %llu\n",
+			(unsigned long long)nla_get_u64(stats[OVPN_SAMPLE_STATS_ATTR_LOST]));
+}
+
+static void ovpn_print_echo(struct nlattr *attr)
+{
+	static const char * const states[] = {
+		[OVPN_ECHO_STATE_OFF] = "off",
+		[OVPN_ECHO_STATE_PROBING] = "probing",
+		[OVPN_ECHO_STATE_ACTIVE] = "active",
+		[OVPN_ECHO_STATE_UNSUPPORTED] = "unsupported",
+	};
+	struct nlattr *echo[OVPN_ECHO_ATTR_MAX + 1];
+	__u8 state;
+
+	if (nla_parse_nested(echo, OVPN_ECHO_ATTR_MAX, attr, NULL))
+		return;
+
+	if (echo[OVPN_ECHO_ATTR_STATE]) {
+		state = nla_get_u8(echo[OVPN_ECHO_ATTR_STATE]);
+		fprintf(stderr, "echo: %s\n",
+			state < sizeof(states) / sizeof(states[0]) ? states[state] : "unknown");
+	}
+	if (echo[OVPN_ECHO_ATTR_SRTT_US] && echo[OVPN_ECHO_ATTR_RTTVAR_US])
+		fprintf(stderr, "echo rtt: %u us, rttvar: %u us\n",
+			nla_get_u32(echo[OVPN_ECHO_ATTR_SRTT_US]),
+			nla_get_u32(echo[OVPN_ECHO_ATTR_RTTVAR_US]));
+	if (echo[OVPN_ECHO_ATTR_LOSS_PPM])
+		fprintf(stderr, "echo loss: %u ppm\n",
+			nla_get_u32(echo[OVPN_ECHO_ATTR_LOSS_PPM]));
+	if (echo[OVPN_ECHO_ATTR_REQUESTS] && echo[OVPN_ECHO_ATTR_REPLIES])
+		fprintf(stderr, "echo requests: %llu, replies: %llu\n",
+			(unsigned long long)nla_get_u64(echo[OVPN_ECHO_ATTR_REQUESTS]),
+			(unsigned long long)nla_get_u64(echo[OVPN_ECHO_ATTR_REPLIES]));
+}
+
+static void ovpn_print_rates(struct nlattr *attr, const char *prefix)
+{
+	struct nlattr *rates[OVPN_RATES_ATTR_MAX + 1];
+
+	if (nla_parse_nested(rates, OVPN_RATES_ATTR_MAX, attr, NULL))
+		return;
+
+	if (rates[OVPN_RATES_ATTR_RX_BPS] && rates[OVPN_RATES_ATTR_RX_PPS])
+		fprintf(stderr, "%srx rate: %llu bit/s, %llu pkt/s\n", prefix,
+			(unsigned long long)nla_get_u64(rates[OVPN_RATES_ATTR_RX_BPS]),
+			(unsigned long long)nla_get_u64(rates[OVPN_RATES_ATTR_RX_PPS]));
+	if (rates[OVPN_RATES_ATTR_TX_BPS] && rates[OVPN_RATES_ATTR_TX_PPS])
+		fprintf(stderr, "%stx rate: %llu bit/s, %llu pkt/s\n", prefix,
+			(unsigned long long)nla_get_u64(rates[OVPN_RATES_ATTR_TX_BPS]),
+			(unsigned long long)nla_get_u64(rates[OVPN_RATES_ATTR_TX_PPS]));
+}
+
+static int ovpn_handle_peer(struct nl_msg *msg, void *arg)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nlattr *attrs[OVPN_ATTR_MAX + 1];
+
+	if (nla_parse(attrs, OVPN_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		      genlmsg_attrlen(gnlh, 0), NULL)) {
+		fprintf(stderr, "received bogus data from ovpn-dco\n");
+		return NL_STOP;
+	}
+
+	if (attrs[OVPN_ATTR_KEEPALIVE_INTERVAL])
+		fprintf(stderr, "keepalive interval: %u\n",
+			nla_get_u32(attrs[OVPN_ATTR_KEEPALIVE_INTERVAL]));
+	if (attrs[OVPN_ATTR_KEEPALIVE_TIMEOUT])
+		fprintf(stderr, "keepalive timeout: %u\n",
+			nla_get_u32(attrs[OVPN_ATTR_KEEPALIVE_TIMEOUT]));
+	if (attrs[OVPN_ATTR_TX_THROTTLE])
+		fprintf(stderr, "tx throttle: %u\n",
+			nla_get_u8(attrs[OVPN_ATTR_TX_THROTTLE]));
+	if (attrs[OVPN_ATTR_PACING])
+		ovpn_print_pacing(attrs[OVPN_ATTR_PACING]);
+	if (attrs[OVPN_ATTR_PROBATION])
+		ovpn_print_probation(attrs[OVPN_ATTR_PROBATION]);
+	if (attrs[OVPN_ATTR_MSSFIX])
+		fprintf(stderr, "mssfix: %u\n",
+			nla_get_u16(attrs[OVPN_ATTR_MSSFIX]));
+	if (attrs[OVPN_ATTR_MSSFIX_STATS])
+		ovpn_print_mssfix(attrs[OVPN_ATTR_MSSFIX_STATS]);
+	if (attrs[OVPN_ATTR_SAMPLE_RATE])
+		fprintf(stderr, "sample rate: %u\n",
+			nla_get_u32(attrs[OVPN_ATTR_SAMPLE_RATE]));
+	if (attrs[OVPN_ATTR_SAMPLE_STATS])
+		ovpn_print_sample_stats(attrs[OVPN_ATTR_SAMPLE_STATS]);
+	if (attrs[OVPN_ATTR_ECHO_STATS])
+		ovpn_print_echo(attrs[OVPN_ATTR_ECHO_STATS]);
+	if (attrs[OVPN_ATTR_RATES])
+		ovpn_print_rates(attrs[OVPN_ATTR_RATES], "");
+
+	return NL_SKIP;
+}
+
+static int ovpn_get_peer(struct ovpn_ctx *ovpn)
+{
+	struct nl_ctx *ctx;
+	int ret;
+
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_GET_PEER);
+	if (!ctx)
+		return -ENOMEM;
+
+	ret = ovpn_nl_msg_send(ctx, ovpn_handle_peer);
+	nl_ctx_free(ctx);
+	return ret;
+}
+
+static int ovpn_handle_key_stats(struct nl_msg *msg, void *arg)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nlattr *stats[OVPN_KEY_STATS_ATTR_MAX + 1];
+	struct nlattr *attrs[OVPN_ATTR_MAX + 1];
+
+	if (nla_parse(attrs, OVPN_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		      genlmsg_attrlen(gnlh, 0), NULL)) {
+		fprintf(stderr, "received bogus data from ovpn-dco\n");
+		return NL_STOP;
+	}
+
+	if (!attrs[OVPN_ATTR_KEY_SLOT] || !attrs[OVPN_ATTR_KEY_ID] ||
+	    !attrs[OVPN_ATTR_KEY_STATS])
+		return NL_SKIP;
+
+	if (nla_parse_nested(stats, OVPN_KEY_STATS_ATTR_MAX,
+			     attrs[OVPN_ATTR_KEY_STATS], NULL))
+		return NL_SKIP;
+
+	fprintf(stderr, "%s key (id %u):\n",
+		nla_get_u8(attrs[OVPN_ATTR_KEY_SLOT]) == OVPN_KEY_SLOT_PRIMARY ?
+			"primary" : "secondary",
+		nla_get_u16(attrs[OVPN_ATTR_KEY_ID]));
+
+	if (stats[OVPN_KEY_STATS_ATTR_RX_PACKETS] &&
+	    stats[OVPN_KEY_STATS_ATTR_RX_BYTES])
+		fprintf(stderr, "\trx: %llu packets, %llu bytes\n",
+			(unsigned long long)nla_get_u64(stats[OVPN_KEY_STATS_ATTR_RX_PACKETS]),
+			(unsigned long long)nla_get_u64(stats[OVPN_KEY_STATS_ATTR_RX_BYTES]));
+	if (stats[OVPN_KEY_STATS_ATTR_TX_PACKETS] &&
+	    stats[OVPN_KEY_STATS_ATTR_TX_BYTES])
+		fprintf(stderr, "\ttx: %llu packets, %llu bytes\n",
+			(unsigned long long)nla_get_u64(stats[OVPN_KEY_STATS_ATTR_TX_PACKETS]),
+			(unsigned long long)nla_get_u64(stats[OVPN_KEY_STATS_ATTR_TX_BYTES]));
+	if (stats[OVPN_KEY_STATS_ATTR_AUTH_FAIL])
+		fprintf(stderr, "\tauth failures: %llu\n",
+			(unsigned long long)nla_get_u64(stats[OVPN_KEY_STATS_ATTR_AUTH_FAIL]));
+	if (stats[OVPN_KEY_STATS_ATTR_REPLAY])
+		fprintf(stderr, "\treplayed: %llu\n",
+			(unsigned long long)nla_get_u64(stats[OVPN_KEY_STATS_ATTR_REPLAY]));
+	if (stats[OVPN_KEY_STATS_ATTR_TX_PKTID])
+		fprintf(stderr, "\tlast tx packet id: %llu\n",
+			(unsigned long long)nla_get_u64(stats[OVPN_KEY_STATS_ATTR_TX_PKTID]));
+	if (stats[OVPN_KEY_STATS_ATTR_IDLE_MS])
+		fprintf(stderr, "\tidle: %u ms\n",
+			nla_get_u32(stats[OVPN_KEY_STATS_ATTR_IDLE_MS]));
+	if (stats[OVPN_KEY_STATS_ATTR_REPLAY_WINDOW])
+		fprintf(stderr, "\treplay window: %u packets\n",
+			nla_get_u32(stats[OVPN_KEY_STATS_ATTR_REPLAY_WINDOW]));
+	if (stats[OVPN_KEY_STATS_ATTR_MAX_BACKTRACK])
+		fprintf(stderr, "\tmax reordering: %u packets\n",
+			nla_get_u32(stats[OVPN_KEY_STATS_ATTR_MAX_BACKTRACK]));
+
+	return NL_SKIP;
+}
+
+static int ovpn_get_key_stats(struct ovpn_ctx *ovpn)
+{
+	struct nl_ctx *ctx;
+	int ret;
+
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_GET_KEY_STATS);
+	if (!ctx)
+		return -ENOMEM;
+
+	nlmsg_hdr(ctx->nl_msg)->nlmsg_flags |= NLM_F_DUMP;
+
+	ret = ovpn_nl_msg_send(ctx, ovpn_handle_key_stats);
+	nl_ctx_free(ctx);
+	return ret;
+}
+
+static int ovpn_handle_top_peer(struct nl_msg *msg, void *arg)
+{
+	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct nlattr *attrs[OVPN_ATTR_MAX + 1];
+	char ifname[IF_NAMESIZE];
+
+	if (nla_parse(attrs, OVPN_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		      genlmsg_attrlen(gnlh, 0), NULL)) {
+		fprintf(stderr, "received bogus data from ovpn-dco\n");
+		return NL_STOP;
+	}
+
+	if (!attrs[OVPN_ATTR_IFINDEX] || !attrs[OVPN_ATTR_RATES])
+		return NL_SKIP;
+
+	if (!if_indextoname(nla_get_u32(attrs[OVPN_ATTR_IFINDEX]), ifname))
+		snprintf(ifname, sizeof(ifname), "#%u",
+			 nla_get_u32(attrs[OVPN_ATTR_IFINDEX]));
+
+	fprintf(stderr, "%s:\n", ifname);
+	ovpn_print_rates(attrs[OVPN_ATTR_RATES], "\t");
+
+	return NL_SKIP;
+}
+
+static int ovpn_get_top_peers(struct ovpn_ctx *ovpn)
+{
+	struct nl_ctx *ctx;
+	int ret = -1;
+
+	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_GET_TOP_PEERS);
+	if (!ctx)
+		return -ENOMEM;
+
+	nlmsg_hdr(ctx->nl_msg)->nlmsg_flags |= NLM_F_DUMP;
+
+	if (ovpn->top_n)
+		NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_TOP_PEERS_N, ovpn->top_n);
+	NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_TOP_PEERS_SORT, ovpn->top_sort);
+
+	ret = ovpn_nl_msg_send(ctx, ovpn_handle_top_peer);
+nla_put_failure:
+	nl_ctx_free(ctx);
+	return ret;
+}
+
 static int ovpn_new_key(struct ovpn_ctx *ovpn)
 {
+	int key_len = KEY_LEN;
 	struct nlattr *key_dir;
 	struct nl_ctx *ctx;
 	int ret = -1;
 
+	/* AEGIS128 only accepts 128bit keys: use the first half of the PSK */
+	if (ovpn->cipher == OVPN_CIPHER_ALG_AEGIS128)
+		key_len = AEGIS128_KEY_LEN;
+
 	ctx = nl_ctx_alloc(ovpn, OVPN_CMD_NEW_KEY);
 	if (!ctx)
 		return -ENOMEM;
 
 	NLA_PUT_U32(ctx->nl_msg, OVPN_ATTR_REMOTE_PEER_ID, 0);
-	NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_KEY_SLOT, OVPN_KEY_SLOT_PRIMARY);
-	NLA_PUT_U16(ctx->nl_msg, OVPN_ATTR_KEY_ID, 0);
+	NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_KEY_SLOT, ovpn->key_slot);
+	NLA_PUT_U16(ctx->nl_msg, OVPN_ATTR_KEY_ID, ovpn->key_id);
 
 	NLA_PUT_U16(ctx->nl_msg, OVPN_ATTR_CIPHER_ALG, ovpn->cipher);
 
 	key_dir = nla_nest_start(ctx->nl_msg, OVPN_ATTR_ENCRYPT_KEY);
-	NLA_PUT(ctx->nl_msg, OVPN_KEY_DIR_ATTR_CIPHER_KEY, KEY_LEN,
+	NLA_PUT(ctx->nl_msg, OVPN_KEY_DIR_ATTR_CIPHER_KEY, key_len,
 		ovpn->key_enc);
 	NLA_PUT(ctx->nl_msg, OVPN_KEY_DIR_ATTR_NONCE_TAIL, NONCE_LEN,
 		ovpn->nonce);
 	nla_nest_end(ctx->nl_msg, key_dir);
 
 	key_dir = nla_nest_start(ctx->nl_msg, OVPN_ATTR_DECRYPT_KEY);
-	NLA_PUT(ctx->nl_msg, OVPN_KEY_DIR_ATTR_CIPHER_KEY, KEY_LEN,
+	NLA_PUT(ctx->nl_msg, OVPN_KEY_DIR_ATTR_CIPHER_KEY, key_len,
 		ovpn->key_dec);
 	NLA_PUT(ctx->nl_msg, OVPN_KEY_DIR_ATTR_NONCE_TAIL, NONCE_LEN,
 		ovpn->nonce);
@@ -715,7 +1108,7 @@ static int ovpn_del_key(struct ovpn_ctx *ovpn)
 	if (!ctx)
 		return -ENOMEM;
 
-	NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_KEY_SLOT, OVPN_KEY_SLOT_PRIMARY);
+	NLA_PUT_U8(ctx->nl_msg, OVPN_ATTR_KEY_SLOT, ovpn->key_slot);
 
 	ret = ovpn_nl_msg_send(ctx, NULL);
 nla_put_failure:
@@ -866,6 +1259,38 @@ static int mcast_ack_handler(struct nl_msg *msg, void *arg)
 	return NL_STOP;
 }
 
+static void ovpn_print_sample(const char *ifname, struct nlattr *attr)
+{
+	struct nlattr *sample[OVPN_SAMPLE_ATTR_MAX + 1];
+	const unsigned char *hdr;
+	int i, len;
+
+	if (nla_parse_nested(sample, OVPN_SAMPLE_ATTR_MAX, attr, NULL))
+		return;
+
+	if (!sample[OVPN_SAMPLE_ATTR_DIR] || !sample[OVPN_SAMPLE_ATTR_LEN] ||
+	    !sample[OVPN_SAMPLE_ATTR_HEADER])
+		return;
+
+	fprintf(stderr, "sample %s %s len %u", ifname,
+		nla_get_u8(sample[OVPN_SAMPLE_ATTR_DIR]) == OVPN_SAMPLE_DIR_RX ?
+			"rx" : "tx",
+		nla_get_u32(sample[OVPN_SAMPLE_ATTR_LEN]));
+	if (sample[OVPN_SAMPLE_ATTR_PEER_ID])
+		fprintf(stderr, " peer-id %u",
+			nla_get_u32(sample[OVPN_SAMPLE_ATTR_PEER_ID]));
+	if (sample[OVPN_SAMPLE_ATTR_TIMESTAMP])
+		fprintf(stderr, " ts %llu",
+			(unsigned long long)nla_get_u64(sample[OVPN_SAMPLE_ATTR_TIMESTAMP]));
+	fprintf(stderr, "\n\t");
+
+	hdr = nla_data(sample[OVPN_SAMPLE_ATTR_HEADER]);
+	len = nla_len(sample[OVPN_SAMPLE_ATTR_HEADER]);
+	for (i = 0; i < len; i++)
+		fprintf(stderr, "%02x", hdr[i]);
+	fprintf(stderr, "\n");
+}
+
 static int ovpn_handle_msg(struct nl_msg *msg, void *arg)
 {
 	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
@@ -873,7 +1298,9 @@ static int ovpn_handle_msg(struct nl_msg *msg, void *arg)
 	struct nlmsghdr *nlh = nlmsg_hdr(msg);
 	enum ovpn_del_peer_reason reason;
 	char ifname[IF_NAMESIZE];
+	struct nlattr *attr;
 	__u32 ifindex;
+	int rem;
 
 	fprintf(stderr, "received message from ovpn-dco\n");
 
@@ -911,6 +1338,21 @@ static int ovpn_handle_msg(struct nl_msg *msg, void *arg)
 			"received CMD_DEL_PEER, ifname: %s reason: %d\n",
 			ifname, reason);
 		break;
+	case OVPN_CMD_PKTID_WRAP_WARN:
+		if (!attrs[OVPN_ATTR_KEY_ID]) {
+			fprintf(stderr, "no key ID in PKTID_WRAP_WARN message\n");
+			return NL_STOP;
+		}
+		fprintf(stderr,
+			"received CMD_PKTID_WRAP_WARN, ifname: %s key_id: %u\n",
+			ifname, nla_get_u16(attrs[OVPN_ATTR_KEY_ID]));
+		break;
+	case OVPN_CMD_SAMPLES:
+		nla_for_each_attr(attr, genlmsg_attrdata(gnlh, 0),
+				  genlmsg_attrlen(gnlh, 0), rem)
+			if (nla_type(attr) == OVPN_ATTR_SAMPLE)
+				ovpn_print_sample(ifname, attr);
+		break;
 	default:
 		fprintf(stderr, "received unknown command: %d\n", gnlh->cmd);
 		return NL_STOP;
@@ -969,7 +1411,7 @@ static int ovpn_get_mcast_id(struct nl_sock *sock, const char *family,
 	return ret;
 }
 
-static void ovpn_listen_mcast(void)
+static void ovpn_listen_mcast(const char *group, int rxbuf)
 {
 	struct nl_sock *sock;
 	struct nl_cb *cb;
@@ -981,7 +1423,7 @@ static void ovpn_listen_mcast(void)
 		goto err_free;
 	}
 
-	nl_socket_set_buffer_size(sock, 8192, 8192);
+	nl_socket_set_buffer_size(sock, rxbuf, 8192);
 
 	ret = genl_connect(sock);
 	if (ret < 0) {
@@ -990,8 +1432,7 @@ static void ovpn_listen_mcast(void)
 		goto err_free;
 	}
 
-	mcid = ovpn_get_mcast_id(sock, OVPN_NL_NAME,
-				 OVPN_NL_MULTICAST_GROUP_PEERS);
+	mcid = ovpn_get_mcast_id(sock, OVPN_NL_NAME, group);
 	if (mcid < 0) {
 		fprintf(stderr, "cannot get mcast group: %s\n",
 			nl_geterror(mcid));
@@ -1022,38 +1463,75 @@ static void usage(const char *cmd)
 {
 	fprintf(stderr, "Error: invalid arguments.\n\n");
 	fprintf(stderr,
-		"Usage %s <iface> <start_udp|connect|listen|new_peer|set_peer|new_key|del_key|recv|send> [arguments..]\n",
+		"Usage %s <iface> <start_udp|connect|listen|new_peer|set_peer|get_peer|get_key_stats|get_top|new_key|del_key|recv|send|samples|bench-ctl> [arguments..]\n",
 		cmd);
 	fprintf(stderr, "\tiface: tun interface name\n\n");
 
-	fprintf(stderr, "* start_udp <lport>: start UDP-based VPN session on port\n");
-	fprintf(stderr, "\tlocal-port: UDP port to listen to\n\n");
+	fprintf(stderr,
+		"* start_udp <lport> [ipv6] [rx_cpus=<mask>] [peer_id=<id>] [share=<iface>:<id>..]: start UDP-based VPN session on port\n");
+	fprintf(stderr, "\tlocal-port: UDP port to listen to\n");
+	fprintf(stderr,
+		"\trx_cpus: hex mask of CPUs decrypted packets are distributed to\n");
+	fprintf(stderr,
+		"\tpeer_id: peer-id of the session, allows sharing the socket\n");
+	fprintf(stderr,
+		"\tshare: also start a session with peer-id <id> on <iface> using the same socket (needs peer_id)\n\n");
 
-	fprintf(stderr, "* connect <raddr> <rport>: start connecting peer of TCP-based VPN session\n");
+	fprintf(stderr,
+		"* connect <raddr> <rport> [mptcp] [rx_cpus=<mask>]: start connecting peer of TCP-based VPN session\n");
 	fprintf(stderr, "\tremote-addr: peer IP address\n");
-	fprintf(stderr, "\tremote-port: peer TCP port\n\n");
+	fprintf(stderr, "\tremote-port: peer TCP port\n");
+	fprintf(stderr, "\tmptcp: use a Multipath TCP socket\n\n");
 
-	fprintf(stderr, "* listen <lport>: start listening peer of TCP-based VPN session\n");
-	fprintf(stderr, "\tlocal-port: src TCP port\n\n");
+	fprintf(stderr,
+		"* listen <lport> [ipv6] [mptcp] [rx_cpus=<mask>]: start listening peer of TCP-based VPN session\n");
+	fprintf(stderr, "\tlocal-port: src TCP port\n");
+	fprintf(stderr, "\tmptcp: use a Multipath TCP socket\n\n");
 
 	fprintf(stderr,
-		"* new_peer <laddr> <lport> <raddr> <rport>: set peer link\n");
+		"* new_peer <laddr> <lport> <raddr> <rport> [fq_flows]: set peer link\n");
 	fprintf(stderr, "\tlocal-addr: src IP address\n");
 	fprintf(stderr, "\tlocal-port: src UDP port\n");
 	fprintf(stderr, "\tremote-addr: peer IP address\n");
-	fprintf(stderr, "\tremote-port: peer UDP port\n\n");
+	fprintf(stderr, "\tremote-port: peer UDP port\n");
+	fprintf(stderr,
+		"\tfq_flows: number of per-peer flow queues (max 1024, 0 to disable)\n\n");
 
 	fprintf(stderr,
-		"* set_peer <keepalive_interval> <keepalive_timeout>: set peer attributes\n");
+		"* bench-ctl <n_peers> <rotations> <key_file> [threads]: measure control plane latency\n");
+	fprintf(stderr,
+		"\tn_peers: number of peers to create (each replaces the previous one)\n");
+	fprintf(stderr,
+		"\trotations: number of key rotations (new_key, swap_keys, del_key) per peer\n");
+	fprintf(stderr, "\tkey_file: file containing the pre-shared key\n");
+	fprintf(stderr,
+		"\tthreads: concurrent workers, worker i uses interface <iface><i> when > 1\n\n");
+
+	fprintf(stderr,
+		"* set_peer <keepalive_interval> <keepalive_timeout> [pktid_wrap_threshold] [pacing_rate] [mssfix] [sample_rate] [echo] [tx_throttle]: set peer attributes\n");
 	fprintf(stderr,
 		"\tkeepalive_interval: interval for sending ping messages\n");
 	fprintf(stderr,
-		"\tkeepalive_timeout: time after which a peer is timed out\n\n");
+		"\tkeepalive_timeout: time after which a peer is timed out\n");
+	fprintf(stderr,
+		"\tpktid_wrap_threshold: packet ID after which a key renegotiation is requested\n");
+	fprintf(stderr,
+		"\tpacing_rate: egress rate in bytes per second, 0 to disable pacing\n");
+	fprintf(stderr,
+		"\tmssfix: largest encapsulated packet TCP MSS is clamped for, 0 to disable clamping\n");
+	fprintf(stderr,
+		"\tsample_rate: export 1 out of N packets per direction, 0 to disable sampling\n");
+	fprintf(stderr,
+		"\techo: 1 to measure RTT and loss with timestamped keepalives, 0 to disable\n");
+	fprintf(stderr,
+		"\ttx_throttle: 1 to pause encryption while the UDP socket send buffer is full, 0 to disable\n\n");
+
+	fprintf(stderr, "* get_peer: show peer attributes and statistics\n\n");
 
 	fprintf(stderr,
 		"* new_key <cipher> <key_dir> <key_file>: set data channel key\n");
 	fprintf(stderr,
-		"\tcipher: cipher to use, supported: aes (AES-GCM), chachapoly (CHACHA20POLY1305), none\n");
+		"\tcipher: cipher to use, supported: aes (AES-GCM), chachapoly (CHACHA20POLY1305), aegis (AEGIS128), none\n");
 	fprintf(stderr,
 		"\tkey_dir: key direction, must 0 on one host and 1 on the other\n");
 	fprintf(stderr, "\tkey_file: file containing the pre-shared key\n\n");
@@ -1062,12 +1540,82 @@ static void usage(const char *cmd)
 
 	fprintf(stderr, "* swap_keys: swap primary and seconday key slots\n\n");
 
+	fprintf(stderr,
+		"* get_key_stats: show per key slot usage counters\n\n");
+
+	fprintf(stderr,
+		"* get_top [n] [pps]: show the n (default 10) busiest peers of all interfaces\n");
+	fprintf(stderr,
+		"\tpps: rank by packet rate rather than bit rate\n\n");
+
 	fprintf(stderr, "* recv: receive packet and exit\n\n");
 
+	fprintf(stderr,
+		"* samples: print the packets sampled by all interfaces\n\n");
+
 	fprintf(stderr, "* send <string>: send packet with string\n");
 	fprintf(stderr, "\tstring: message to send to the peer\n");
 }
 
+/* trailing options of start_udp, listen and connect */
+static int ovpn_parse_start_opts(struct ovpn_ctx *ovpn, sa_family_t *family,
+				 int argc, char *argv[], int first)
+{
+	int i;
+
+	for (i = first; i < argc; i++) {
+		if (!strcmp(argv[i], "ipv6") && family) {
+			*family = AF_INET6;
+		} else if (!strcmp(argv[i], "mptcp")) {
+			ovpn->stream_proto = IPPROTO_MPTCP;
+		} else if (!strncmp(argv[i], "rx_cpus=", strlen("rx_cpus="))) {
+			ovpn->rx_cpumask = strtoul(argv[i] + strlen("rx_cpus="),
+						   NULL, 16);
+			if (errno == ERANGE) {
+				fprintf(stderr, "rx_cpus value out of range\n");
+				return -1;
+			}
+			ovpn->rx_cpumask_set = true;
+		} else if (!strncmp(argv[i], "peer_id=", strlen("peer_id="))) {
+			ovpn->peer_id = strtoul(argv[i] + strlen("peer_id="),
+						NULL, 10);
+			if (errno == ERANGE) {
+				fprintf(stderr, "peer_id value out of range\n");
+				return -1;
+			}
+			ovpn->peer_id_set = true;
+		} else if (!strncmp(argv[i], "share=", strlen("share="))) {
+			char ifname[IF_NAMESIZE], *sep;
+			const char *arg = argv[i] + strlen("share=");
+
+			sep = strchr(arg, ':');
+			if (!sep || sep - arg >= IF_NAMESIZE ||
+			    ovpn->n_shares == OVPN_MAX_SHARES) {
+				fprintf(stderr, "invalid share option: %s\n",
+					argv[i]);
+				return -1;
+			}
+
+			memcpy(ifname, arg, sep - arg);
+			ifname[sep - arg] = '\0';
+			ovpn->share_ifindex[ovpn->n_shares] =
+				if_nametoindex(ifname);
+			if (!ovpn->share_ifindex[ovpn->n_shares]) {
+				fprintf(stderr, "cannot find interface %s\n",
+					ifname);
+				return -1;
+			}
+			ovpn->share_peer_id[ovpn->n_shares++] =
+				strtoul(sep + 1, NULL, 10);
+		} else {
+			fprintf(stderr, "unknown option: %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static int ovpn_parse_new_peer(struct ovpn_ctx *ovpn, int argc, char *argv[])
 {
 	int ret;
@@ -1120,6 +1668,14 @@ static int ovpn_parse_new_peer(struct ovpn_ctx *ovpn, int argc, char *argv[])
 		return -1;
 	}
 
+	if (argc > 7) {
+		ovpn->fq_flows = strtoul(argv[7], NULL, 10);
+		if (errno == ERANGE || ovpn->fq_flows > 1024) {
+			fprintf(stderr, "fq_flows value out of range\n");
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -1142,14 +1698,391 @@ static int ovpn_parse_set_peer(struct ovpn_ctx *ovpn, int argc, char *argv[])
 		return -1;
 	}
 
+	if (argc > 5) {
+		ovpn->pktid_wrap_threshold = strtoul(argv[5], NULL, 0);
+		if (errno == ERANGE) {
+			fprintf(stderr, "pktid wrap threshold value out of range\n");
+			return -1;
+		}
+	}
+
+	if (argc > 6) {
+		ovpn->pacing_rate = strtoull(argv[6], NULL, 10);
+		if (errno == ERANGE) {
+			fprintf(stderr, "pacing rate value out of range\n");
+			return -1;
+		}
+		ovpn->pacing_rate_set = true;
+	}
+
+	if (argc > 7) {
+		unsigned long mssfix = strtoul(argv[7], NULL, 10);
+
+		if (errno == ERANGE || mssfix > 0xffff) {
+			fprintf(stderr, "mssfix value out of range\n");
+			return -1;
+		}
+		ovpn->mssfix = mssfix;
+		ovpn->mssfix_set = true;
+	}
+
+	if (argc > 8) {
+		ovpn->sample_rate = strtoul(argv[8], NULL, 10);
+		if (errno == ERANGE) {
+			fprintf(stderr, "sample rate value out of range\n");
+			return -1;
+		}
+		ovpn->sample_rate_set = true;
+	}
+
+	if (argc > 9) {
+		unsigned long echo = strtoul(argv[9], NULL, 10);
+
+		if (errno == ERANGE || echo > 1) {
+			fprintf(stderr, "echo value must be 0 or 1\n");
+			return -1;
+		}
+		ovpn->echo = echo;
+		ovpn->echo_set = true;
+	}
+
+	if (argc > 10) {
+		unsigned long tx_throttle = strtoul(argv[10], NULL, 10);
+
+		if (errno == ERANGE || tx_throttle > 1) {
+			fprintf(stderr, "tx_throttle value must be 0 or 1\n");
+			return -1;
+		}
+		ovpn->tx_throttle = tx_throttle;
+		ovpn->tx_throttle_set = true;
+	}
+
+	return 0;
+}
+
+/* control plane benchmark (bench-ctl) */
+
+enum ovpn_bench_op {
+	BENCH_OP_NEW_PEER,
+	BENCH_OP_NEW_KEY,
+	BENCH_OP_SWAP_KEYS,
+	BENCH_OP_DEL_KEY,
+	__BENCH_OP_MAX,
+};
+
+static const char * const ovpn_bench_op_names[__BENCH_OP_MAX] = {
+	[BENCH_OP_NEW_PEER] = "new_peer",
+	[BENCH_OP_NEW_KEY] = "new_key",
+	[BENCH_OP_SWAP_KEYS] = "swap_keys",
+	[BENCH_OP_DEL_KEY] = "del_key",
+};
+
+struct ovpn_bench_thread {
+	pthread_t tid;
+	struct ovpn_ctx ovpn;
+	unsigned int peers;
+	unsigned int rotations;
+
+	/* latency samples in ns, one array per operation */
+	__u64 *lat[__BENCH_OP_MAX];
+	unsigned int n_lat[__BENCH_OP_MAX];
+
+	int ret;
+};
+
+static __u64 ovpn_bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int ovpn_bench_run_op(struct ovpn_bench_thread *t,
+			     enum ovpn_bench_op op)
+{
+	__u64 start = ovpn_bench_now();
+	int ret;
+
+	switch (op) {
+	case BENCH_OP_NEW_PEER:
+		ret = ovpn_new_peer(&t->ovpn);
+		break;
+	case BENCH_OP_NEW_KEY:
+		ret = ovpn_new_key(&t->ovpn);
+		break;
+	case BENCH_OP_SWAP_KEYS:
+		ret = ovpn_swap_keys(&t->ovpn);
+		break;
+	case BENCH_OP_DEL_KEY:
+		ret = ovpn_del_key(&t->ovpn);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (ret < 0) {
+		fprintf(stderr, "bench: %s failed: %d\n",
+			ovpn_bench_op_names[op], ret);
+		return ret;
+	}
+
+	t->lat[op][t->n_lat[op]++] = ovpn_bench_now() - start;
 	return 0;
 }
 
+/* For each peer: install it (replacing the previous one), add the primary
+ * key and then rotate keys as a daemon does on renegotiation: new key in the
+ * secondary slot, swap, delete the old key now sitting in the secondary slot
+ */
+static void *ovpn_bench_thread_run(void *arg)
+{
+	struct ovpn_bench_thread *t = arg;
+	struct ovpn_ctx *ovpn = &t->ovpn;
+	unsigned int p, r;
+	int ret = 0;
+
+	for (p = 0; p < t->peers; p++) {
+		ovpn->rport = 1 + (p % 65535);
+
+		ret = ovpn_bench_run_op(t, BENCH_OP_NEW_PEER);
+		if (ret < 0)
+			goto out;
+
+		ovpn->key_slot = OVPN_KEY_SLOT_PRIMARY;
+		ovpn->key_id = 0;
+		ret = ovpn_bench_run_op(t, BENCH_OP_NEW_KEY);
+		if (ret < 0)
+			goto out;
+
+		for (r = 0; r < t->rotations; r++) {
+			ovpn->key_slot = OVPN_KEY_SLOT_SECONDARY;
+			/* key IDs are 3 bits on the wire */
+			ovpn->key_id = (r + 1) % 8;
+			ret = ovpn_bench_run_op(t, BENCH_OP_NEW_KEY);
+			if (ret < 0)
+				goto out;
+
+			ret = ovpn_bench_run_op(t, BENCH_OP_SWAP_KEYS);
+			if (ret < 0)
+				goto out;
+
+			ret = ovpn_bench_run_op(t, BENCH_OP_DEL_KEY);
+			if (ret < 0)
+				goto out;
+		}
+	}
+out:
+	t->ret = ret;
+	return NULL;
+}
+
+static int ovpn_bench_cmp(const void *a, const void *b)
+{
+	const __u64 *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+static __u64 ovpn_bench_pct(const __u64 *v, unsigned int n, unsigned int pct)
+{
+	unsigned int idx = (n * pct) / 100;
+
+	if (idx >= n)
+		idx = n - 1;
+
+	return v[idx];
+}
+
+static void ovpn_bench_report(struct ovpn_bench_thread *threads,
+			      unsigned int n_threads, __u64 elapsed)
+{
+	unsigned int op, i, n, total = 0;
+	__u64 *all;
+
+	printf("%-10s %8s %10s %10s %10s %10s (usec)\n", "op", "count",
+	       "p50", "p90", "p99", "max");
+
+	for (op = 0; op < __BENCH_OP_MAX; op++) {
+		n = 0;
+		for (i = 0; i < n_threads; i++)
+			n += threads[i].n_lat[op];
+
+		if (!n)
+			continue;
+
+		all = calloc(n, sizeof(*all));
+		if (!all)
+			return;
+
+		n = 0;
+		for (i = 0; i < n_threads; i++) {
+			memcpy(all + n, threads[i].lat[op],
+			       threads[i].n_lat[op] * sizeof(*all));
+			n += threads[i].n_lat[op];
+		}
+
+		qsort(all, n, sizeof(*all), ovpn_bench_cmp);
+		printf("%-10s %8u %10.1f %10.1f %10.1f %10.1f\n",
+		       ovpn_bench_op_names[op], n,
+		       ovpn_bench_pct(all, n, 50) / 1000.0,
+		       ovpn_bench_pct(all, n, 90) / 1000.0,
+		       ovpn_bench_pct(all, n, 99) / 1000.0,
+		       all[n - 1] / 1000.0);
+
+		total += n;
+		free(all);
+	}
+
+	printf("total: %u ops in %.3f s, %.1f ops/sec\n", total,
+	       elapsed / 1e9, total / (elapsed / 1e9));
+}
+
+/* bench-ctl <n_peers> <rotations> <key_file> [threads]
+ *
+ * with more than one thread, thread i operates on interface <iface><i>, which
+ * must already exist and not be started yet, like <iface> itself
+ */
+static int ovpn_bench_ctl(struct ovpn_ctx *base, const char *iface, int argc,
+			  char *argv[])
+{
+	unsigned int i, op, peers, rotations, n_threads = 1;
+	struct ovpn_bench_thread *threads;
+	char ifname[IF_NAMESIZE];
+	int ret = -1;
+	__u64 start;
+
+	if (argc < 6) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	peers = strtoul(argv[3], NULL, 10);
+	rotations = strtoul(argv[4], NULL, 10);
+	if (argc > 6)
+		n_threads = strtoul(argv[6], NULL, 10);
+
+	if (!peers || !n_threads) {
+		fprintf(stderr, "bench: peers and threads must be > 0\n");
+		return -1;
+	}
+
+	ret = ovpn_read_key(argv[5], base);
+	if (ret)
+		return ret;
+
+	/* AES-GCM keys exercise the whole crypto_alloc_aead() path */
+	base->cipher = OVPN_CIPHER_ALG_AES_GCM;
+
+	threads = calloc(n_threads, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+
+	for (i = 0; i < n_threads; i++) {
+		struct ovpn_bench_thread *t = &threads[i];
+		struct ovpn_ctx *ovpn = &t->ovpn;
+
+		*ovpn = *base;
+		t->peers = peers;
+		t->rotations = rotations;
+
+		if (n_threads > 1) {
+			snprintf(ifname, sizeof(ifname), "%s%u", iface, i);
+			ovpn->ifindex = if_nametoindex(ifname);
+			if (!ovpn->ifindex) {
+				fprintf(stderr, "bench: cannot find %s\n",
+					ifname);
+				ret = -1;
+				goto out;
+			}
+		}
+
+		for (op = 0; op < __BENCH_OP_MAX; op++) {
+			t->lat[op] = calloc(peers * (rotations + 1),
+					    sizeof(__u64));
+			if (!t->lat[op]) {
+				ret = -ENOMEM;
+				goto out;
+			}
+		}
+
+		/* one netlink socket per thread, kept across commands as a
+		 * daemon would do
+		 */
+		ovpn->nl_sock = nl_socket_alloc();
+		if (!ovpn->nl_sock) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		nl_socket_set_buffer_size(ovpn->nl_sock, 8192, 8192);
+		ret = genl_connect(ovpn->nl_sock);
+		if (ret) {
+			fprintf(stderr, "bench: cannot connect to generic netlink: %s\n",
+				nl_geterror(ret));
+			goto out;
+		}
+
+		ovpn->ovpn_dco_id = genl_ctrl_resolve(ovpn->nl_sock,
+						      OVPN_NL_NAME);
+		if (ovpn->ovpn_dco_id < 0) {
+			ret = ovpn->ovpn_dco_id;
+			goto out;
+		}
+
+		/* peers are bound to 127.0.0.1, only the remote port changes */
+		ovpn->sa_family = AF_INET;
+		ovpn->local.in4.s_addr = htonl(INADDR_LOOPBACK);
+		ovpn->remote.in4.s_addr = htonl(INADDR_LOOPBACK);
+		ovpn->lport = 0;
+
+		ret = ovpn_udp_socket(ovpn, AF_INET);
+		if (ret < 0)
+			goto out;
+
+		ret = ovpn_start(ovpn, OVPN_PROTO_UDP4);
+		if (ret < 0) {
+			fprintf(stderr, "bench: cannot start VPN\n");
+			goto out;
+		}
+	}
+
+	start = ovpn_bench_now();
+	for (i = 0; i < n_threads; i++) {
+		ret = pthread_create(&threads[i].tid, NULL,
+				     ovpn_bench_thread_run, &threads[i]);
+		if (ret) {
+			fprintf(stderr, "bench: cannot create thread\n");
+			n_threads = i;
+			ret = -1;
+			break;
+		}
+	}
+
+	for (i = 0; i < n_threads; i++) {
+		pthread_join(threads[i].tid, NULL);
+		if (threads[i].ret < 0)
+			ret = threads[i].ret;
+	}
+
+	ovpn_bench_report(threads, n_threads, ovpn_bench_now() - start);
+out:
+	for (i = 0; i < n_threads; i++) {
+		if (threads[i].ovpn.nl_sock)
+			nl_socket_free(threads[i].ovpn.nl_sock);
+		for (op = 0; op < __BENCH_OP_MAX; op++)
+			free(threads[i].lat[op]);
+	}
+	free(threads);
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	sa_family_t family = AF_INET;
 	struct ovpn_ctx ovpn;
 	struct nl_ctx *ctx;
+	unsigned int i;
 	int ret;
 
 	if (argc < 3) {
@@ -1158,6 +2091,7 @@ int main(int argc, char *argv[])
 	}
 
 	memset(&ovpn, 0, sizeof(ovpn));
+	ovpn.stream_proto = IPPROTO_TCP;
 
 	ovpn.ifindex = if_nametoindex(argv[1]);
 	if (!ovpn.ifindex) {
@@ -1178,19 +2112,39 @@ int main(int argc, char *argv[])
 			return -1;
 		}
 
-		if (argc > 4 && !strcmp(argv[4], "ipv6"))
-			family = AF_INET6;
+		ret = ovpn_parse_start_opts(&ovpn, &family, argc, argv, 4);
+		if (ret < 0)
+			return ret;
 
 		ret = ovpn_udp_socket(&ovpn, family);
 		if (ret < 0)
 			return ret;
 
+		if (ovpn.n_shares && !ovpn.peer_id_set) {
+			fprintf(stderr, "share requires peer_id\n");
+			close(ovpn.socket);
+			return -1;
+		}
+
 		ret = ovpn_start(&ovpn, OVPN_PROTO_UDP4);
 		if (ret < 0) {
 			fprintf(stderr, "cannot start VPN\n");
 			close(ovpn.socket);
 			return ret;
 		}
+
+		for (i = 0; i < ovpn.n_shares; i++) {
+			ovpn.ifindex = ovpn.share_ifindex[i];
+			ovpn.peer_id = ovpn.share_peer_id[i];
+
+			ret = ovpn_start(&ovpn, OVPN_PROTO_UDP4);
+			if (ret < 0) {
+				fprintf(stderr,
+					"cannot start VPN on shared interface\n");
+				close(ovpn.socket);
+				return ret;
+			}
+		}
 	} else if (!strcmp(argv[2], "listen")) {
 		if (argc < 4) {
 			usage(argv[0]);
@@ -1203,8 +2157,9 @@ int main(int argc, char *argv[])
 			return -1;
 		}
 
-		if (argc > 4 && !strcmp(argv[4], "ipv6"))
-			family = AF_INET6;
+		ret = ovpn_parse_start_opts(&ovpn, &family, argc, argv, 4);
+		if (ret < 0)
+			return ret;
 
 		ret = ovpn_listen(&ovpn, family);
 		if (ret < 0) {
@@ -1251,6 +2206,10 @@ int main(int argc, char *argv[])
 			return -1;
 		}
 
+		ret = ovpn_parse_start_opts(&ovpn, NULL, argc, argv, 5);
+		if (ret < 0)
+			return ret;
+
 		ret = ovpn_connect(&ovpn);
 		if (ret < 0) {
 			fprintf(stderr, "cannot connect TCP socket\n");
@@ -1290,6 +2249,35 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "cannot set peer to VPN\n");
 			return ret;
 		}
+	} else if (!strcmp(argv[2], "get_peer")) {
+		ret = ovpn_get_peer(&ovpn);
+		if (ret < 0) {
+			fprintf(stderr, "cannot get peer\n");
+			return ret;
+		}
+	} else if (!strcmp(argv[2], "get_key_stats")) {
+		ret = ovpn_get_key_stats(&ovpn);
+		if (ret < 0) {
+			fprintf(stderr, "cannot get key stats\n");
+			return ret;
+		}
+	} else if (!strcmp(argv[2], "get_top")) {
+		if (argc > 3) {
+			ovpn.top_n = strtoul(argv[3], NULL, 10);
+			if (errno == ERANGE || !ovpn.top_n) {
+				fprintf(stderr, "invalid number of peers\n");
+				return -1;
+			}
+		}
+
+		if (argc > 4 && !strcmp(argv[4], "pps"))
+			ovpn.top_sort = OVPN_TOP_PEERS_SORT_PPS;
+
+		ret = ovpn_get_top_peers(&ovpn);
+		if (ret < 0) {
+			fprintf(stderr, "cannot get top peers\n");
+			return ret;
+		}
 	} else if (!strcmp(argv[2], "new_key")) {
 		if (argc < 5) {
 			usage(argv[0]);
@@ -1343,8 +2331,13 @@ int main(int argc, char *argv[])
 		ret = ovpn_send_data(&ovpn, argv[3], strlen(argv[3]) + 1);
 		if (ret < 0)
 			fprintf(stderr, "cannot send data\n");
+	} else if (!strcmp(argv[2], "bench-ctl")) {
+		ret = ovpn_bench_ctl(&ovpn, argv[1], argc, argv);
 	} else if (!strcmp(argv[2], "listen")) {
-		ovpn_listen_mcast();
+		ovpn_listen_mcast(OVPN_NL_MULTICAST_GROUP_PEERS, 8192);
+	} else if (!strcmp(argv[2], "samples")) {
+		/* batches of samples are much bigger than notifications */
+		ovpn_listen_mcast(OVPN_NL_MULTICAST_GROUP_SAMPLES, 1 << 20);
 	} else {
 		usage(argv[0]);
 		return -1;